@@ -13,9 +13,23 @@ void main (void) {
 	char c;
 
 	sd_file f, f2;
+#if (defined SD_SEEK_CHECKPOINTS && !(defined LOW_RAM_MODE))
+	uint32_t checkpoints[8];
+#endif
 
-#ifndef LOW_RAM_MODE
-	/* Option 1: Create at least one new sd_buffer variable
+#if (defined SD_BUFFER_POOL && !(defined LOW_RAM_MODE))
+	/* Option 1: Let the driver lend a buffer from its pool
+	 *
+	 * A NULL buffer pointer tells SDfopen() to borrow one of the driver's
+	 * pool buffers. Files that are used alternately (such as the copy loop
+	 * below) each keep a sector in RAM and the buffer is handed back when
+	 * the file is closed.
+	 *
+	 */
+	f.buf = NULL;
+	f2.buf = NULL;
+#elif !(defined LOW_RAM_MODE)
+	/* Option 2: Create at least one new sd_buffer variable
 	 *
 	 * An extra 526 bytes of memory are required to create a new sd_buffer
 	 * for the file variable, but speed will be increased if files are
@@ -28,7 +42,7 @@ void main (void) {
 	f.buf = &fileBuf;
 	f2.buf = &fileBuf2;
 #else
-	/* Option 2: Use the generic buffer [i.e. g_sd_buf] as the buffer
+	/* Option 3: Use the generic buffer [i.e. g_sd_buf] as the buffer
 	 *
 	 * Good for low-RAM situations due to the re-use of g_sd_buf. Speed is
 	 * decreased when multiple files are used often.
@@ -38,6 +52,21 @@ void main (void) {
 	f2.buf = &g_sd_buf;
 #endif
 
+#ifdef SD_SEEK_CHECKPOINTS
+	/* Each file may be given a table of seek checkpoints; 4 bytes per
+	 * entry buy faster seeks in long files. NULL and 0 keep none.
+	 */
+#ifndef LOW_RAM_MODE
+	f.checkpoint = checkpoints;
+	f.checkpointCount = sizeof(checkpoints) / sizeof(checkpoints[0]);
+#else
+	f.checkpoint = NULL;
+	f.checkpointCount = 0;
+#endif
+	f2.checkpoint = NULL;
+	f2.checkpointCount = 0;
+#endif
+
 #ifdef DEBUG
 	printf("Beginning SD card initialization...\n");
 #endif
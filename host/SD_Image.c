@@ -0,0 +1,49 @@
+/**
+ * @file    SD_Image.c
+ *
+ * @project PropWare
+ *
+ * @brief   Mount a FAT16/32 card image on a host computer and open the SD
+ *          shell on it, e.g.
+ *              printf 'ls\ncat STUFF.TXT\nexit\n' | ./SD_Image card.img
+ */
+
+// sd.h comes first; its file positions are named like stdio's SEEK_* macros
+#include <sd.h>
+#include <stdio.h>
+
+int main (int argc, char *argv[]) {
+    uint8_t err;
+    FILE *image;
+    sd_block_dev dev;
+    sd_file f;
+
+    if (2 != argc) {
+        fprintf(stderr, "Usage: %s <card image>\n", argv[0]);
+        return 1;
+    }
+    if (NULL == (image = fopen(argv[1], "r+b"))) {
+        perror(argv[1]);
+        return 1;
+    }
+
+    SDFileDevice(&dev, image);
+    SDSetBlockDevice(&dev);
+    if ((err = SDMount())) {
+        fprintf(stderr, "Could not mount %s: SD error %u\n", argv[1], err);
+        return 1;
+    }
+
+    // Files opened by the shell borrow from the buffer pool
+    f.buf = NULL;
+#ifdef SD_SEEK_CHECKPOINTS
+    f.checkpoint = NULL;
+    f.checkpointCount = 0;
+#endif
+    err = SD_Shell(&f);
+
+    if (!err)
+        err = SDUnmount();
+    fclose(image);
+    return err;
+}
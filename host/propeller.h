@@ -0,0 +1,35 @@
+/**
+ * @file    propeller.h
+ *
+ * @project PropWare
+ *
+ * @brief   Stand-in for propgcc's propeller.h when the SD driver is built for
+ *          a host computer (see Makefile). Only the system counter is
+ *          provided; sd.h leaves the SD card and SPI code out of such a build
+ *          (see SD_CARD)
+ */
+
+#ifndef PROPELLER_H_
+#define PROPELLER_H_
+
+#include <stdint.h>
+#include <time.h>
+
+#define CLKFREQ     80000000
+
+// An 80 MHz system counter, as on a Propeller
+#define CNT         PropWareHostCNT()
+
+static inline uint32_t PropWareHostCNT (void) {
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint32_t) (now.tv_sec * 80000000ULL + now.tv_nsec * 2 / 25);
+}
+
+static inline void waitcnt (const uint32_t target) {
+    while (0 < (int32_t) (target - CNT))
+        ;
+}
+
+#endif /* PROPELLER_H_ */
@@ -34,7 +34,19 @@
  *
  * @param   err     Error number used to determine error string
  */
-static void SDError (const uint8_t err);
+static void SDErrorHalt (const uint8_t err);
+
+#ifdef SD_SERVER
+// The server cog hands errors back in the request instead; halting there
+// would leave the requesting cog in SDwait() forever
+#define SDError(err)                do { \
+                                        if (cogid() == g_sd_serverId) \
+                                            return err; \
+                                        SDErrorHalt(err); \
+                                    } while (0)
+#else
+#define SDError(err)                SDErrorHalt(err)
+#endif
 
 /**
  * @brief   Print to screen each status bit individually with human-readable
@@ -49,28 +61,31 @@ static void SDFirstByteExpansion (const uint8_t response);
 #endif
 
 /*** Global variable declarations ***/
-// Initialization variables
-static uint32_t g_sd_cs;  // Chip select pin mask
-static uint8_t g_sd_filesystem;  // Filesystem type - one of SD_FAT_16 or SD_FAT_32
-static uint8_t g_sd_sectorsPerCluster_shift;  // Used as a quick multiply/divide; Stores log_2(Sectors per Cluster)
-static uint32_t g_sd_rootDirSectors;  // Number of sectors for the root directory
-static uint32_t g_sd_fatStart;  // Starting block address of the FAT
-static uint32_t g_sd_rootAddr;  // Starting block address of the root directory
-static uint32_t g_sd_rootAllocUnit;  // Allocation unit of root directory/first data sector (FAT32 only)
-static uint32_t g_sd_firstDataAddr;  // Starting block address of the first data cluster
-
-// FAT filesystem variables
-static uint8_t g_sd_fat[SD_SECTOR_SIZE];        // Buffer for FAT entries only
-#ifdef SD_FILE_WRITE
-static uint8_t g_sd_fatMod = 0;  // Has the currently loaded FAT sector been modified
-static uint32_t g_sd_fatSize;
+sd_buffer g_sd_buf;
+
+#ifdef SD_READ_AHEAD
+// Pool buffer receiving (or holding) the sector after g_sd_aheadFile's
+// current one; NULL when no sector has been read ahead
+static sd_buffer *g_sd_aheadBuf = NULL;
+static const sd_file *g_sd_aheadFile;
+static uint32_t g_sd_aheadSector;  // File sector offset held by g_sd_aheadBuf
+static uint8_t g_sd_readPending = 0;  // The SPI cog is still receiving a sector
 #endif
-static uint16_t g_sd_entriesPerFatSector_Shift;  // How many FAT entries are in a single sector of the FAT
-static uint32_t g_sd_curFatSector;  // Store the current FAT sector loaded into g_sd_fat
 
-static uint32_t g_sd_dir_firstAllocUnit;  // Store the current directory's starting allocation unit
+#ifdef SD_AU_ALIGN
+// log_2 of the card's allocation unit in sectors, indexed by the AU_SIZE field
+// of the "SD Status" block; 0 where the size is undefined. 12 MB (0xB) and
+// 24 MB (0xD) are no power of 2 and fall back to the largest one that divides
+// them, 4 MB and 8 MB
+static const uint8_t g_sd_auSizeShift[16] = { 0, 5, 6, 7, 8, 9, 10, 11, 12, 13,
+        14, 13, 15, 14, 16, 17 };
+#endif
 
-sd_buffer g_sd_buf;
+#ifdef SD_BUFFER_POOL
+// Buffers lent to files opened without one of their own
+static sd_buffer g_sd_bufPool[SD_BUFFER_POOL_SIZE];
+static uint32_t g_sd_bufTick = 0;  // Incremented on each buffer load; used for LRU eviction
+#endif
 
 // Assigned to a file and then to each buffer that it touches - overwritten by other functions
 // and used as a check by the file to determine if the buffer needs to be reloaded with its
@@ -80,6 +95,72 @@ static uint8_t g_sd_fileID = 0;
 // First byte response receives special treatment to allow for proper debugging
 static uint8_t g_sd_firstByteResponse;
 
+#ifdef SD_CARD
+// The SD card over SPI is the default block device
+static const sd_block_ops g_sd_cardOps = { SDCardRead, SDCardWrite,
+#ifdef SD_MULTI_BLOCK
+        SDCardReadMulti,
+#if (defined SD_FILE_WRITE || defined SD_RAW_BLOCKS)
+        SDCardWriteMulti,
+#else
+        NULL,
+#endif
+#else
+        NULL, NULL,
+#endif
+        SDCardSync,
+#if (defined SD_ERASE_FREED || defined SD_RAW_BLOCKS)
+        SDCardErase
+#else
+        NULL
+#endif
+        };
+static sd_card g_sd_defaultCard;
+static sd_block_dev g_sd_card = { &g_sd_cardOps, &g_sd_defaultCard };
+static sd_card *g_sd_curCard = &g_sd_defaultCard;  // Card addressed last; the one whose chip select the commands use
+#endif
+
+// The volume used until another is selected; its directory buffer is g_sd_buf
+// and, without a card, it has no device until one is set
+static sd_volume g_sd_defaultVolume = {
+#ifdef SD_CARD
+        .dev = &g_sd_card,
+#endif
+        .buf = &g_sd_buf,
+#ifdef SD_BUFFER_POOL
+        .ownBuf = &g_sd_buf
+#endif
+        };
+static sd_volume *g_sd_curVol = &g_sd_defaultVolume;  // Volume of the calls that name no open file (see SDSelectVolume())
+static sd_volume *g_sd_vol = &g_sd_defaultVolume;  // Volume that the call in progress works on
+
+#ifdef SD_BLOCK_FILE
+static const sd_block_ops g_sd_fileOps = { SDFileRead, SDFileWrite,
+        SDFileReadMulti, SDFileWriteMulti, SDFileSync, NULL };
+#endif
+
+#ifdef SD_RAM_DISK
+static const sd_block_ops g_sd_ramOps = { SDRamRead, SDRamWrite,
+        SDRamReadMulti, SDRamWriteMulti, NULL, NULL };
+#endif
+
+#ifdef SD_SERVER
+// Requests waiting for the server cog; producers advance the tail while
+// holding g_sd_serverLock, only the server advances the head
+static sd_request * volatile g_sd_serverQueue[SD_SERVER_QUEUE_SIZE];
+static volatile uint8_t g_sd_serverHead = 0;  // Next request to be carried out
+static volatile uint8_t g_sd_serverTail = 0;  // Slot for the next request queued
+static int g_sd_serverLock = -1;  // Kept once allocated, so that a stopping server never returns a held lock
+static volatile int g_sd_serverCog = -1;
+// Set until a stopping server cog no longer uses its stack or the queue
+static volatile uint8_t g_sd_serverRunning = 0;
+static uint32_t g_sd_serverStack[SD_SERVER_STACK_SIZE / 4];
+#ifdef SD_DEBUG
+// Cog carrying out requests, which must not halt on an error; -1 if none
+static volatile int g_sd_serverId = -1;
+#endif
+#endif
+
 #ifdef SD_DEBUG
 // variable is needed to help determine what is causing seemingly random timeouts
 uint32_t g_sd_sectorRdAddress;
@@ -88,13 +169,25 @@ uint32_t g_sd_sectorRdAddress;
 /***********************************
  *** Public Function Definitions ***
  ***********************************/
+#ifdef SD_CARD
 uint8_t SDStart (const uint32_t mosi, const uint32_t miso, const uint32_t sclk,
         const uint32_t cs, const uint32_t freq) {
-    uint8_t i, j, k, err;
+    uint8_t err;
+#if (defined SD_VERBOSE && defined SD_DEBUG)
     uint8_t response[16];
+#endif
+    sd_block_dev *dev = g_sd_curVol->dev;
+
+    // The card holding the selected volume is started, or the default one if
+    // the volume is not on a card
+    if (&g_sd_cardOps != dev->ops)
+        dev = &g_sd_card;
+    if ((err = SDSelectCard(dev)))
+        SDError(err);
 
     // Set CS for output and initialize high
-    g_sd_cs = cs;
+    g_sd_curCard->cs = cs;
+    g_sd_curCard->busy = 0;
     GPIODirModeSet(cs, GPIO_DIR_OUT);
     GPIOPinSet(cs);
 
@@ -107,99 +200,31 @@ uint8_t SDStart (const uint32_t mosi, const uint32_t miso, const uint32_t sclk,
     printf("Starting SD card...\n");
 #endif
 
-    for (i = 0; i < 10; ++i) {
-        // Initialization loop (reset SD card)
-        for (j = 0; j < 10; ++j) {
-            waitcnt(CLKFREQ / 10 + CNT);
-
-            // Send at least 72 clock cycles to enable the SD card
-            GPIOPinSet(cs);
-            for (k = 0; k < 5; ++k)
-                checkErrors(SPIShiftOut(16, -1));
-            checkErrors(SPIWait());
-
-            GPIOPinClear(cs);
-            // Send SD into idle state, retrieve a response and ensure it is the "idle" response
-            if ((err = SDSendCommand(SD_CMD_IDLE, 0, SD_CRC_IDLE)))
-                SDError(err);
-            SDGetResponse(SD_RESPONSE_LEN_R1, response);
-            if (SD_RESPONSE_IDLE == g_sd_firstByteResponse)
-                j = 10;
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-            else
-                printf("Failed attempt at CMD0: 0x%02X\n",
-                        g_sd_firstByteResponse);
-#endif
-        }
-        if (SD_RESPONSE_IDLE != g_sd_firstByteResponse)
-            SDError(SD_INVALID_INIT);
-
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-        printf("SD card in idle state. Now sending CMD8...\n");
-#endif
-
-        // Set voltage to 3.3V and ensure response is R7
-        if ((err = SDSendCommand(SD_CMD_SDHC, SD_CMD_VOLT_ARG, SD_CRC_SDHC)))
-            SDError(err);
-        if ((err = SDGetResponse(SD_RESPONSE_LEN_R7, response)))
-            SDError(err);
-        if ((SD_RESPONSE_IDLE == g_sd_firstByteResponse)
-                && (0x01 == response[2]) && (0xAA == response[3]))
-            i = 10;
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-        else
-            printf("Failed attempt at CMD8\n");
-#endif
-    }
-
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-    printf("CMD8 succeeded. Requesting operating conditions...\n");
-#endif
-
-    // Request operating conditions register and ensure response begins with R1
-    if ((err = SDSendCommand(SD_CMD_READ_OCR, 0, SD_CRC_OTHER)))
-        SDError(err);
-    if ((err = SDGetResponse(SD_RESPONSE_LEN_R3, response)))
-        SDError(err);
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-    SDPrintHexBlock(response, SD_RESPONSE_LEN_R3);
-#endif
-    if (SD_RESPONSE_IDLE != g_sd_firstByteResponse)
-        SDError(SD_INVALID_INIT);
+    // The card needs a millisecond after power-up before the first command
+    waitcnt(MILLISECOND + CNT);
 
-    // Spin up the card and bring to active state
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-    printf("OCR read successfully. Sending into active state...\n");
-#endif
-    for (i = 0; i < 8; ++i) {
-        waitcnt(CLKFREQ / 10 + CNT);
-        if ((err = SDSendCommand(SD_CMD_APP, 0, SD_CRC_OTHER)))
-            SDError(err);
-        if ((err = SDGetResponse(1, response)))
-            SDError(err);
-        if ((err = SDSendCommand(SD_CMD_WR_OP, BIT_30, SD_CRC_OTHER)))
+    // A card that kept its power through a reset of the Propeller is still in
+    // SPI mode and initialized; only a cold card needs the full sequence
+    if (!SDIsReady())
+        if ((err = SDReset()))
             SDError(err);
-        SDGetResponse(1, response);
-        if (SD_RESPONSE_ACTIVE == g_sd_firstByteResponse)
-            break;
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-        else
-            printf("Failed attempt at active state: 0x%02X\n",
-                    g_sd_firstByteResponse);
-#endif
-    }
-    if (SD_RESPONSE_ACTIVE != g_sd_firstByteResponse)
-        SDError(SD_INVALID_RESPONSE);
 #if (defined SD_VERBOSE && defined SD_DEBUG)
     printf("Activated!\n");
 #endif
 
-    // Initialization nearly complete, increase clock
+    // Initialization complete, increase clock
     if (((uint32_t) -1) != freq)
         SPISetClock(freq);
     else
         SPISetClock(SD_DEFAULT_SPI_FREQ);
 
+#ifdef SD_AU_ALIGN
+    // Files are placed without regard to the allocation unit of a card that
+    // does not report it
+    if (SDReadAUSize())
+        g_sd_curCard->auShift = 0;
+#endif
+
     // If debugging requested, print to the screen CSD and CID registers from SD card
 #if (defined SD_VERBOSE && defined SD_DEBUG)
     printf("Requesting CSD...\n");
@@ -225,9 +250,122 @@ uint8_t SDStart (const uint32_t mosi, const uint32_t miso, const uint32_t sclk,
     // Initialization complete
     return 0;
 }
+#endif
+
+#ifdef SD_SERVER
+uint8_t SDServerStart (const uint32_t mosi, const uint32_t miso,
+        const uint32_t sclk, const uint32_t cs, const uint32_t freq) {
+    sd_server_start start;
+
+    if (-1 != g_sd_serverCog)
+        return 0;
+    if (-1 == g_sd_serverLock)
+        if (-1 == (g_sd_serverLock = locknew()))
+            return SD_SERVER_NOT_RUNNING;
+
+    start.mosi = mosi;
+    start.miso = miso;
+    start.sclk = sclk;
+    start.cs = cs;
+    start.freq = freq;
+    start.done = 0;
+
+    // A server that has just unmounted may still be failing its last
+    // requests on the same stack and queue
+    while (g_sd_serverRunning)
+        ;
+    g_sd_serverRunning = 1;
+    g_sd_serverHead = g_sd_serverTail = 0;
+    g_sd_serverCog = cogstart(SDServer, &start, g_sd_serverStack,
+            sizeof(g_sd_serverStack));
+    if (-1 == g_sd_serverCog) {
+        g_sd_serverRunning = 0;
+        return SD_SERVER_NOT_RUNNING;
+    }
+
+    // The server reads start before it sets done, so start may then go
+    while (!start.done)
+        ;
+    if (start.err)
+        g_sd_serverCog = -1;
+
+    return start.err;
+}
+
+uint8_t SDServerSubmit (sd_request *req) {
+    uint8_t next;
+
+    if (-1 == g_sd_serverLock)
+        return SD_SERVER_NOT_RUNNING;
+
+    req->done = 0;
+    while (lockset(g_sd_serverLock))
+        ;
+    if (-1 == g_sd_serverCog) {
+        lockclr(g_sd_serverLock);
+        return SD_SERVER_NOT_RUNNING;
+    }
+    next = (g_sd_serverTail + 1) & (SD_SERVER_QUEUE_SIZE - 1);
+    if (next == g_sd_serverHead) {
+        lockclr(g_sd_serverLock);
+        return SD_SERVER_QUEUE_FULL;
+    }
+    g_sd_serverQueue[g_sd_serverTail] = req;
+    g_sd_serverTail = next;
+    lockclr(g_sd_serverLock);
+
+    return 0;
+}
+#endif
+
+#ifdef SD_ASYNC
+uint8_t SDfread_async (uint8_t dat[], const uint32_t bytes, sd_file *f,
+        sd_request *req) {
+    req->type = SD_REQUEST_READ;
+    req->f = f;
+    req->dat = dat;
+    req->bytes = bytes;
+
+    return SDSubmitOrServe(req);
+}
+
+#ifdef SD_FILE_WRITE
+uint8_t SDfwrite_async (const uint8_t dat[], const uint32_t bytes, sd_file *f,
+        sd_request *req) {
+    req->type = SD_REQUEST_WRITE;
+    req->f = f;
+    // Only read by the write
+    req->dat = (uint8_t *) dat;
+    req->bytes = bytes;
+
+    return SDSubmitOrServe(req);
+}
+#endif
+
+inline uint8_t SDpoll (const sd_request *req) {
+    return req->done;
+}
+
+uint8_t SDwait (const sd_request *req) {
+    while (!req->done)
+        ;
+
+    return req->err;
+}
+#endif
 
 uint8_t SDMount (void) {
+    return SDMountVol(g_sd_curVol);
+}
+
+uint8_t SDMountVol (sd_volume *vol) {
     uint8_t err, temp;
+#ifdef SD_FREE_SPACE
+    uint32_t fsInfoAddr = 0;
+#endif
+#ifdef SD_AU_ALIGN
+    uint8_t auShift = 0;
+#endif
 
     // FAT system determination variables:
     uint32_t rsvdSectorCount, numFATs, rootEntryCount, totalSectors, FATSize,
@@ -235,59 +373,78 @@ uint8_t SDMount (void) {
     uint32_t bootSector = 0;
     uint32_t clusterCount;
 
+    SDUseVolume(vol);
+#ifdef SD_BUFFER_POOL
+    // None of the volume's files is open yet, so its own buffer is free
+    g_sd_vol->buf = g_sd_vol->ownBuf;
+#endif
+#ifndef SD_CARD
+    // There is no card to fall back on; an image must have been given
+    if (NULL == g_sd_vol->dev)
+        SDError(SD_DEVICE_ERROR);
+#endif
+
     // Read in first sector
-    if ((err = SDReadDataBlock(bootSector, g_sd_buf.buf)))
+    if ((err = SDReadDataBlock(bootSector, g_sd_vol->buf->buf)))
         SDError(err);
     // Check if sector 0 is boot sector or MBR; if MBR, skip to boot sector at first partition
-    if (SD_BOOT_SECTOR_ID != g_sd_buf.buf[SD_BOOT_SECTOR_ID_ADDR]) {
-        bootSector = SDReadDat32(&(g_sd_buf.buf[SD_BOOT_SECTOR_BACKUP]));
-        if ((err = SDReadDataBlock(bootSector, g_sd_buf.buf)))
+    if (SD_BOOT_SECTOR_ID != g_sd_vol->buf->buf[SD_BOOT_SECTOR_ID_ADDR]) {
+        bootSector = SDReadDat32(&(g_sd_vol->buf->buf[SD_BOOT_SECTOR_BACKUP]));
+        if ((err = SDReadDataBlock(bootSector, g_sd_vol->buf->buf)))
             SDError(err);
     }
 
     // Print the boot sector if requested
 #if (defined SD_VERBOSE && defined SD_DEBUG && defined SD_VERBOSE_BLOCKS)
     printf("***BOOT SECTOR***\n");
-    SDPrintHexBlock(g_sd_buf.buf, SD_SECTOR_SIZE);
+    SDPrintHexBlock(g_sd_vol->buf->buf, SD_SECTOR_SIZE);
     putchar('\n');
 #endif
 
     // Do this whether it is FAT16 or FAT32
-    temp = g_sd_buf.buf[SD_CLUSTER_SIZE_ADDR];
+    temp = g_sd_vol->buf->buf[SD_CLUSTER_SIZE_ADDR];
 #if (defined SD_DEBUG && defined SD_VERBOSE)
     printf("Preliminary sectors per cluster: %u\n", temp);
 #endif
+    // Another volume may have been mounted before
+    g_sd_vol->sectorsPerCluster_shift = 0;
     while (temp) {
         temp >>= 1;
-        ++g_sd_sectorsPerCluster_shift;
+        ++g_sd_vol->sectorsPerCluster_shift;
     }
-    --g_sd_sectorsPerCluster_shift;
-    rsvdSectorCount = SDReadDat16(&((g_sd_buf.buf)[SD_RSVD_SCTR_CNT_ADDR]));
-    numFATs = g_sd_buf.buf[SD_NUM_FATS_ADDR];
+    --g_sd_vol->sectorsPerCluster_shift;
+    rsvdSectorCount = SDReadDat16(
+            &((g_sd_vol->buf->buf)[SD_RSVD_SCTR_CNT_ADDR]));
+    numFATs = g_sd_vol->buf->buf[SD_NUM_FATS_ADDR];
 #ifdef SD_FILE_WRITE
-    if (2 != numFATs)
+    if (!numFATs)
         SDError(SD_TOO_MANY_FATS);
 #endif
-    rootEntryCount = SDReadDat16(&(g_sd_buf.buf[SD_ROOT_ENTRY_CNT_ADDR]));
+    rootEntryCount = SDReadDat16(&(g_sd_vol->buf->buf[SD_ROOT_ENTRY_CNT_ADDR]));
 
     // Check if FAT size is valid in 16- or 32-bit location
-    FATSize = SDReadDat16(&(g_sd_buf.buf[SD_FAT_SIZE_16_ADDR]));
+    FATSize = SDReadDat16(&(g_sd_vol->buf->buf[SD_FAT_SIZE_16_ADDR]));
     if (!FATSize)
-        FATSize = SDReadDat32(&(g_sd_buf.buf[SD_FAT_SIZE_32_ADDR]));
+        FATSize = SDReadDat32(&(g_sd_vol->buf->buf[SD_FAT_SIZE_32_ADDR]));
 
     // Check if FAT16 total sectors is valid
-    totalSectors = SDReadDat16(&(g_sd_buf.buf[SD_TOT_SCTR_16_ADDR]));
+    totalSectors = SDReadDat16(&(g_sd_vol->buf->buf[SD_TOT_SCTR_16_ADDR]));
     if (!totalSectors)
-        totalSectors = SDReadDat32(&(g_sd_buf.buf[SD_TOT_SCTR_32_ADDR]));
+        totalSectors = SDReadDat32(&(g_sd_vol->buf->buf[SD_TOT_SCTR_32_ADDR]));
 
     // Compute necessary numbers to determine FAT type (12/16/32)
-    g_sd_rootDirSectors = (rootEntryCount * 32) >> SD_SECTOR_SIZE_SHIFT;
+    g_sd_vol->rootDirSectors = (rootEntryCount * 32) >> SD_SECTOR_SIZE_SHIFT;
     dataSectors = totalSectors
-            - (rsvdSectorCount + numFATs * FATSize + rootEntryCount);
-    clusterCount = dataSectors >> g_sd_sectorsPerCluster_shift;
+            - (rsvdSectorCount + numFATs * FATSize + g_sd_vol->rootDirSectors);
+    clusterCount = dataSectors >> g_sd_vol->sectorsPerCluster_shift;
+    g_sd_vol->clusterCount = clusterCount;
+#ifdef SD_RAW_BLOCKS
+    g_sd_vol->volumeStart = bootSector;
+    g_sd_vol->volumeEnd = bootSector + totalSectors;
+#endif
 
 #if (defined SD_DEBUG && defined SD_VERBOSE)
-    printf("Sectors per cluster: %u\n", 1 << g_sd_sectorsPerCluster_shift);
+    printf("Sectors per cluster: %u\n", 1 << g_sd_vol->sectorsPerCluster_shift);
     printf("Reserved sector count: 0x%08X / %u\n", rsvdSectorCount,
             rsvdSectorCount);
     printf("Number of FATs: 0x%02X / %u\n", numFATs, numFATs);
@@ -295,92 +452,144 @@ uint8_t SDMount (void) {
     printf("Total cluster count: 0x%08X / %u\n", clusterCount, clusterCount);
     printf("Total data sectors: 0x%08X / %u\n", dataSectors, dataSectors);
     printf("FAT Size: 0x%04X / %u\n", FATSize, FATSize);
-    printf("Root directory sectors: 0x%08X / %u\n", g_sd_rootDirSectors,
-            g_sd_rootDirSectors);
+    printf("Root directory sectors: 0x%08X / %u\n", g_sd_vol->rootDirSectors,
+            g_sd_vol->rootDirSectors);
     printf("Root entry count: 0x%08X / %u\n", rootEntryCount, rootEntryCount);
 #endif
 
     // Determine and store FAT type
-    if (SD_FAT12_CLSTR_CNT > clusterCount)
+    if (SD_FAT12_CLSTR_CNT > clusterCount
+#ifdef SD_RAM_DISK
+            // SDRamFormat() uses FAT16 however small the disk is
+            && &g_sd_ramOps != g_sd_vol->dev->ops
+#endif
+            )
         SDError(SD_INVALID_FILESYSTEM);
     else if (SD_FAT16_CLSTR_CNT > clusterCount) {
 #if (defined SD_VERBOSE && defined SD_DEBUG)
         printf("\n***FAT type is FAT16***\n");
 #endif
-        g_sd_filesystem = SD_FAT_16;
-        g_sd_entriesPerFatSector_Shift = 8;
+        g_sd_vol->filesystem = SD_FAT_16;
+        g_sd_vol->entriesPerFatSector_Shift = 8;
     } else {
 #if (defined SD_VERBOSE && defined SD_DEBUG)
         printf("\n***FAT type is FAT32***\n");
 #endif
-        g_sd_filesystem = SD_FAT_32;
-        g_sd_entriesPerFatSector_Shift = 7;
+        g_sd_vol->filesystem = SD_FAT_32;
+        g_sd_vol->entriesPerFatSector_Shift = 7;
     }
 
     // Find start of FAT
-    g_sd_fatStart = bootSector + rsvdSectorCount;
+    g_sd_vol->fatStart = bootSector + rsvdSectorCount;
 
-    //    g_sd_filesystem = SD_FAT_16;
+    //    g_sd_vol->filesystem = SD_FAT_16;
     // Find root directory address
-    switch (g_sd_filesystem) {
+    switch (g_sd_vol->filesystem) {
         case SD_FAT_16:
-            g_sd_rootAddr = FATSize * numFATs + g_sd_fatStart;
-            g_sd_firstDataAddr = g_sd_rootAddr + g_sd_rootDirSectors;
+            g_sd_vol->rootAddr = FATSize * numFATs + g_sd_vol->fatStart;
+            g_sd_vol->firstDataAddr = g_sd_vol->rootAddr
+                    + g_sd_vol->rootDirSectors;
+            g_sd_vol->rootAllocUnit = -1;
             break;
         case SD_FAT_32:
-            g_sd_firstDataAddr = g_sd_rootAddr = bootSector + rsvdSectorCount
-                    + FATSize * numFATs;
-            g_sd_rootAllocUnit = SDReadDat32(
-                    &(g_sd_buf.buf[SD_ROOT_CLUSTER_ADDR]));
+            g_sd_vol->firstDataAddr = g_sd_vol->rootAddr = bootSector
+                    + rsvdSectorCount + FATSize * numFATs;
+            g_sd_vol->rootAllocUnit = SDReadDat32(
+                    &(g_sd_vol->buf->buf[SD_ROOT_CLUSTER_ADDR]));
             break;
     }
 
 #ifdef SD_FILE_WRITE
     // If files will be written to, the second FAT must also be updated - the first sector
     // address of which is stored here
-    g_sd_fatSize = FATSize;
+    g_sd_vol->fatSize = FATSize;
+    g_sd_vol->numFATs = numFATs;
+#endif
+
+#ifdef SD_AU_ALIGN
+    // Clusters only start on allocation unit boundaries if they are no larger
+    // than an allocation unit and the data region is laid out on the card in
+    // whole clusters
+    g_sd_vol->auClusters = 0;
+    if (&g_sd_cardOps == g_sd_vol->dev->ops)
+        auShift = ((const sd_card *) g_sd_vol->dev->priv)->auShift;
+    if (auShift && auShift >= g_sd_vol->sectorsPerCluster_shift
+            && !(SDGetSectorFromAlloc(2)
+                    & ((1 << g_sd_vol->sectorsPerCluster_shift) - 1))) {
+        g_sd_vol->auClusters = 1
+                << (auShift - g_sd_vol->sectorsPerCluster_shift);
+        g_sd_vol->auFirst = 2
+                + ((((SDGetSectorFromAlloc(2) + (1 << auShift) - 1)
+                        & ~((1 << auShift) - 1)) - SDGetSectorFromAlloc(2))
+                        >> g_sd_vol->sectorsPerCluster_shift);
+        g_sd_vol->auNext = g_sd_vol->auFirst;
+    }
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    printf("Clusters per allocation unit: %u\n", g_sd_vol->auClusters);
+#endif
+#endif
+
+#ifdef SD_FREE_SPACE
+    // Count the free clusters once; every change to the FAT keeps the count
+    // current from here on. The boot sector is still loaded
+    if (SD_FAT_32 == g_sd_vol->filesystem) {
+        fsInfoAddr = SDReadDat16(&(g_sd_vol->buf->buf[SD_FSINFO_SECTOR_ADDR]));
+        if (0xffff == fsInfoAddr)
+            fsInfoAddr = 0;
+        if (fsInfoAddr)
+            fsInfoAddr += bootSector;
+    }
+    if ((err = SDLoadFreeCount(fsInfoAddr)))
+        SDError(err);
 #endif
 
 #if (defined SD_VERBOSE && defined SD_DEBUG)
-    printf("Start of FAT: 0x%08X\n", g_sd_fatStart);
-    printf("Root directory alloc. unit: 0x%08X\n", g_sd_rootAllocUnit);
-    printf("Root directory sector: 0x%08X\n", g_sd_rootAddr);
+    printf("Start of FAT: 0x%08X\n", g_sd_vol->fatStart);
+    printf("Root directory alloc. unit: 0x%08X\n", g_sd_vol->rootAllocUnit);
+    printf("Root directory sector: 0x%08X\n", g_sd_vol->rootAddr);
     printf("Calculated root directory sector: 0x%08X\n",
-            SDGetSectorFromAlloc(g_sd_rootAllocUnit));
-    printf("First data sector: 0x%08X\n", g_sd_firstDataAddr);
+            SDGetSectorFromAlloc(g_sd_vol->rootAllocUnit));
+    printf("First data sector: 0x%08X\n", g_sd_vol->firstDataAddr);
 #endif
 
     // Store the first sector of the FAT
-    if ((err = SDReadDataBlock(g_sd_fatStart, g_sd_fat)))
+    if ((err = SDReadDataBlock(g_sd_vol->fatStart, g_sd_vol->fat)))
         SDError(err);
-    g_sd_curFatSector = 0;
+    g_sd_vol->curFatSector = 0;
 
     // Print FAT if desired
 #if (defined SD_VERBOSE && defined SD_DEBUG && defined SD_VERBOSE_BLOCKS)
     printf("\n***First File Allocation Table***\n");
-    SDPrintHexBlock(g_sd_fat, SD_SECTOR_SIZE);
+    SDPrintHexBlock(g_sd_vol->fat, SD_SECTOR_SIZE);
     putchar('\n');
 #endif
 
     // Read in the root directory, set root as current
-    if ((err = SDReadDataBlock(g_sd_rootAddr, g_sd_buf.buf)))
+    if ((err = SDReadDataBlock(g_sd_vol->rootAddr, g_sd_vol->buf->buf)))
         SDError(err);
-    g_sd_buf.curClusterStartAddr = g_sd_rootAddr;
-    if (SD_FAT_16 == g_sd_filesystem) {
-        g_sd_dir_firstAllocUnit = -1;
-        g_sd_buf.curAllocUnit = -1;
-    } else {
-        g_sd_buf.curAllocUnit = g_sd_dir_firstAllocUnit = g_sd_rootAllocUnit;
-        if ((err = SDGetFATValue(g_sd_buf.curAllocUnit, &g_sd_buf.nextAllocUnit)))
-            return err;
-    }
-    g_sd_buf.curClusterStartAddr = g_sd_rootAddr;
-    g_sd_buf.curSectorOffset = 0;
+    g_sd_vol->buf->curClusterStartAddr = g_sd_vol->rootAddr;
+    g_sd_vol->buf->curAllocUnit = g_sd_vol->dir_firstAllocUnit =
+            g_sd_vol->rootAllocUnit;
+    if ((err = SDGetFATValue(g_sd_vol->buf->curAllocUnit,
+            &(g_sd_vol->buf->nextAllocUnit))))
+        return err;
+    g_sd_vol->buf->curSectorOffset = 0;
+    g_sd_vol->buf->id = SD_FOLDER_ID;
+#ifdef SD_DIR_INDEX
+    g_sd_vol->dirIndexDir = g_sd_vol->dir_firstAllocUnit;
+    g_sd_vol->dirIndexBuilt = 0;
+#endif
+#ifdef SD_PATH_CACHE
+    memset(g_sd_vol->pathCache, 0, sizeof(g_sd_vol->pathCache));
+#endif
+#if (defined SD_TAIL_CACHE && defined SD_FILE_WRITE)
+    memset(g_sd_vol->tailCache, 0, sizeof(g_sd_vol->tailCache));
+#endif
 
     // Print root directory
 #if (defined SD_VERBOSE_BLOCKS && defined SD_VERBOSE && defined SD_DEBUG)
     printf("***Root directory***\n");
-    SDPrintHexBlock(g_sd_buf.buf, SD_SECTOR_SIZE);
+    SDPrintHexBlock(g_sd_vol->buf->buf, SD_SECTOR_SIZE);
     putchar('\n');
 #endif
 
@@ -389,263 +598,517 @@ uint8_t SDMount (void) {
 
 #ifdef SD_FILE_WRITE
 uint8_t SDUnmount (void) {
+    return SDUnmountVol(g_sd_curVol);
+}
+
+uint8_t SDUnmountVol (sd_volume *vol) {
     uint8_t err;
 
+    SDUseVolume(vol);
+
     // If the directory buffer was modified, write it
-    if (g_sd_buf.mod)
-        if ((err = SDWriteDataBlock(
-                g_sd_buf.curClusterStartAddr + g_sd_buf.curSectorOffset,
-                g_sd_buf.buf)))
-            return err;
+    if ((err = SDWriteBackBuf(g_sd_vol->buf)))
+        return err;
 
-    // If the FAT sector was modified, write it
-    if (g_sd_fatMod) {
-        if ((err = SDWriteDataBlock(g_sd_curFatSector + g_sd_fatStart, g_sd_fat)))
-            return err;
-        if ((err = SDWriteDataBlock(
-                g_sd_curFatSector + g_sd_fatStart + g_sd_fatSize, g_sd_fat)))
-            return err;
+#ifdef SD_BUFFER_POOL
+    // Save any unwritten sectors held by borrowed buffers
+    {
+        uint8_t i;
+        for (i = 0; i < SD_BUFFER_POOL_SIZE; ++i)
+            if ((err = SDWriteBackBuf(&(g_sd_bufPool[i]))))
+                return err;
     }
+#endif
 
-    return 0;
-}
+    // Write the FAT sector if it was modified and update every FAT copy
+    if ((err = SDSyncFATs()))
+        return err;
+#ifdef SD_FREE_SPACE
+    if ((err = SDWriteFSInfo()))
+        return err;
 #endif
 
-uint8_t SDchdir (const char *d) {
+#ifdef SD_TAIL_CACHE
+    // The volume may be remounted from a different card
+    memset(g_sd_vol->tailCache, 0, sizeof(g_sd_vol->tailCache));
+#endif
+
+    // Whatever the device still holds back is written out
+    return SDSyncDevice();
+}
+
+uint8_t SDsync (void) {
+    return SDsyncVol(g_sd_curVol);
+}
+
+uint8_t SDsyncVol (sd_volume *vol) {
     uint8_t err;
-    uint16_t fileEntryOffset = 0;
 
-    g_sd_buf.id = SD_FOLDER_ID;
+    SDUseVolume(vol);
+    if ((err = SDWriteBackBuf(g_sd_vol->buf)))
+        return err;
 
-    // Attempt to find the file
-    if ((err = SDFind(d, &fileEntryOffset))) {
+    if ((err = SDSyncFATs()))
+        return err;
+#ifdef SD_FREE_SPACE
+    if ((err = SDWriteFSInfo()))
         return err;
-    } else {
-        // File entry was found successfully, load it into the buffer and update status variables
-#ifdef SD_FILE_WRITE
-        // If the previous sector was modified, write it back to the SD card before reading
-        if (g_sd_buf.mod)
-            SDWriteDataBlock(
-                    g_sd_buf.curClusterStartAddr + g_sd_buf.curSectorOffset,
-                    g_sd_buf.buf);
-        g_sd_buf.mod = 0;
 #endif
 
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-        printf("%s found at offset 0x%04X from address 0x%08X\n", d,
-                fileEntryOffset,
-                g_sd_buf.curClusterStartAddr + g_sd_buf.curSectorOffset);
+    // Whatever the device still holds back is written out
+    return SDSyncDevice();
+}
 #endif
 
-        if (SD_FAT_16 == g_sd_filesystem)
-            g_sd_buf.curAllocUnit = SDReadDat16(
-                    &(g_sd_buf.buf[fileEntryOffset + SD_FILE_START_CLSTR_LOW]));
-        else {
-            g_sd_buf.curAllocUnit = SDReadDat16(
-                    &(g_sd_buf.buf[fileEntryOffset + SD_FILE_START_CLSTR_LOW]));
-            g_sd_buf.curAllocUnit |= SDReadDat16(
-                    &(g_sd_buf.buf[fileEntryOffset + SD_FILE_START_CLSTR_HIGH]))
-                    << 16;
-            // Clear the highest 4 bits - they are always reserved
-            g_sd_buf.curAllocUnit &= 0x0FFFFFFF;
-        }
-        SDGetFATValue(g_sd_buf.curAllocUnit, &(g_sd_buf.nextAllocUnit));
-        if (0 == g_sd_buf.curAllocUnit) {
-            g_sd_buf.curAllocUnit = -1;
-            g_sd_dir_firstAllocUnit = g_sd_rootAllocUnit;
-        } else
-            g_sd_dir_firstAllocUnit = g_sd_buf.curAllocUnit;
-        g_sd_buf.curSectorOffset = 0;
-        SDReadDataBlock(g_sd_buf.curClusterStartAddr, g_sd_buf.buf);
+#ifdef SD_FREE_SPACE
+uint32_t SDGetFreeSpace (void) {
+    return SDGetFreeSpaceVol(g_sd_curVol);
+}
 
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-        printf("Opening directory from...\n");
-        printf("\tAllocation unit 0x%08X\n", g_sd_buf.curAllocUnit);
-        printf("\tCluster starting address 0x%08X\n",
-                g_sd_buf.curClusterStartAddr);
-        printf("\tSector offset 0x%04X\n", g_sd_buf.curSectorOffset);
-#ifdef SD_VERBOSE_BLOCKS
-        printf("And the first directory sector looks like....\n");
-        SDPrintHexBlock(g_sd_buf.buf, SD_SECTOR_SIZE);
-        putchar('\n');
-#endif
-#endif
-        return 0;
-    }
+uint32_t SDGetFreeSpaceVol (sd_volume *vol) {
+    SDUseVolume(vol);
+    return g_sd_vol->freeClusters << g_sd_vol->sectorsPerCluster_shift;
 }
+#endif
 
-uint8_t SDfopen (const char *name, sd_file *f, const sd_file_mode mode) {
-    uint8_t err;
-    uint16_t fileEntryOffset = 0;
+uint8_t SDIsBusy (void) {
+#ifdef SD_CARD
+    uint8_t temp = 0;
 
-#if (defined SD_DEBUG && defined SD_VERBOSE)
-    printf("Attempting to open %s\n", name);
-#endif
+    // Only a card is ever busy
+    if (&g_sd_cardOps != g_sd_curVol->dev->ops)
+        return 0;
+    if (SDSelectCard(g_sd_curVol->dev) || !g_sd_curCard->busy)
+        return 0;
 
-    if (NULL == f->buf)
-        SDError(SD_FILE_WITHOUT_BUFFER);
+    // Look at a single byte rather than waiting for the card
+    GPIOPinClear(g_sd_curCard->cs);
+    SPIShiftIn(8, &temp, sizeof(temp));
+    GPIOPinSet(g_sd_curCard->cs);
 
-    f->id = g_sd_fileID++;
-    f->rPtr = 0;
-    f->wPtr = 0;
-#if (defined SD_DEBUG && !(defined SD_FILE_WRITE))
-    if (SD_FILE_MODE_R != mode)
-    SDError(SD_INVALID_FILE_MODE);
+    if (temp)
+        g_sd_curCard->busy = 0;
+    return g_sd_curCard->busy;
+#else
+    return 0;
 #endif
-    f->mode = mode;
-    f->mod = 0;
+}
 
-    // Attempt to find the file
-    if ((err = SDFind(name, &fileEntryOffset))) {
-#ifdef SD_FILE_WRITE
-        // If the file didn't exist and you're trying to read from it, that's a
-        // problem
-        if (SD_FILE_MODE_R == mode)
-            return err;
+void SDSetBlockDevice (sd_block_dev *dev) {
+#ifdef SD_CARD
+    g_sd_curVol->dev = (NULL == dev) ? &g_sd_card : dev;
+#else
+    g_sd_curVol->dev = dev;
+#endif
+}
 
-        // Find returned an error, ensure it was either file-not-found or EOC
-        // and then create the file
-        if (SD_EOC_END == err) {
-            // File wasn't found and the cluster is full; add another to the
-            // directory
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-            printf("Directory cluster was full, adding another...\n");
+#ifdef SD_CARD
+void SDCardDevice (sd_block_dev *dev, sd_card *card) {
+    dev->ops = &g_sd_cardOps;
+    dev->priv = card;
+}
 #endif
-            if ((err = SDExtendFAT(&g_sd_buf)))
-                SDError(err);
-            if ((err = SDLoadNextSector(&g_sd_buf)))
-                SDError(err);
-        }
-        if (SD_EOC_END == err || SD_FILENAME_NOT_FOUND == err) {
-            // File wasn't found, but there is still room in this cluster (or a
-            // new cluster was just added)
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-            printf("Creating a new directory entry...\n");
+
+void SDVolumeInit (sd_volume *vol, sd_block_dev *dev, sd_buffer *buf) {
+    memset(vol, 0, sizeof(*vol));
+    memset(buf, 0, sizeof(*buf));
+#ifdef SD_CARD
+    vol->dev = (NULL == dev) ? &g_sd_card : dev;
+#else
+    vol->dev = dev;
 #endif
-            if ((err = SDCreateFile(name, &fileEntryOffset)))
-                SDError(err);
-        } else
+    vol->buf = buf;
+#ifdef SD_BUFFER_POOL
+    vol->ownBuf = buf;
 #endif
-            // SDFind returned unknown error - throw it
-            SDError(err);
-    }
+}
 
-    // `name` was found successfully, determine if it is a file or directory
-    if (SD_SUB_DIR & g_sd_buf.buf[fileEntryOffset + SD_FILE_ATTRIBUTE_OFFSET])
-        SDError(SD_ENTRY_NOT_FILE);
+void SDSelectVolume (sd_volume *vol) {
+    g_sd_curVol = (NULL == vol) ? &g_sd_defaultVolume : vol;
+}
 
-    // Passed the file-not-directory test, load it into the buffer and update
-    // status variables
-    f->buf->id = f->id;
-    f->curSector = 0;
-    if (SD_FAT_16 == g_sd_filesystem)
-        f->buf->curAllocUnit = SDReadDat16(
-                &(g_sd_buf.buf[fileEntryOffset + SD_FILE_START_CLSTR_LOW]));
-    else {
-        f->buf->curAllocUnit = SDReadDat16(
-                &(g_sd_buf.buf[fileEntryOffset + SD_FILE_START_CLSTR_LOW]));
-        f->buf->curAllocUnit |= SDReadDat16(
-                &(g_sd_buf.buf[fileEntryOffset + SD_FILE_START_CLSTR_HIGH]))
-                << 16;
+void SDUseVolume (sd_volume *vol) {
+    g_sd_vol = (NULL == vol) ? &g_sd_defaultVolume : vol;
+}
 
-        // Clear the highest 4 bits - they are always reserved
-        f->buf->curAllocUnit &= 0x0FFFFFFF;
+#ifdef SD_BLOCK_FILE
+void SDFileDevice (sd_block_dev *dev, FILE *image) {
+    dev->ops = &g_sd_fileOps;
+    dev->priv = image;
+}
+#endif
+
+#ifdef SD_RAM_DISK
+void SDRamDevice (sd_block_dev *dev, sd_ram_disk *disk, uint8_t mem[],
+        const uint32_t sectors) {
+    disk->mem = mem;
+    disk->sectors = sectors;
+    dev->ops = &g_sd_ramOps;
+    dev->priv = disk;
+}
+
+uint8_t SDRamFormat (const sd_ram_disk *disk) {
+    uint8_t *mem = disk->mem;
+    uint8_t clusterShift = 0;
+    uint32_t clusters, fatSectors;
+    const uint32_t rootSectors = (SD_RAM_ROOT_ENTRIES * SD_FILE_ENTRY_LENGTH)
+            >> SD_SECTOR_SIZE_SHIFT;
+
+    // Boot sector, FAT, root directory and at least one cluster
+    if (3 + rootSectors > disk->sectors)
+        return SD_INVALID_FILESYSTEM;
+
+    // Clusters are doubled in size until a FAT16 table can address them all
+    while (1) {
+        clusters = (disk->sectors - 1 - rootSectors) >> clusterShift;
+        fatSectors = ((clusters + 2) * SD_FAT_16 + SD_SECTOR_SIZE - 1)
+                >> SD_SECTOR_SIZE_SHIFT;
+        clusters = (disk->sectors - 1 - rootSectors - fatSectors)
+                >> clusterShift;
+        if (SD_FAT16_CLSTR_CNT > clusters)
+            break;
+        if (7 == clusterShift)
+            return SD_INVALID_FILESYSTEM;
+        ++clusterShift;
     }
-    f->firstAllocUnit = f->buf->curAllocUnit;
-    f->curCluster = 0;
-    f->buf->curClusterStartAddr = SDGetSectorFromAlloc(f->buf->curAllocUnit);
-    f->dirSectorAddr = g_sd_buf.curClusterStartAddr + g_sd_buf.curSectorOffset;
-    f->fileEntryOffset = fileEntryOffset;
-    if ((err = SDGetFATValue(f->buf->curAllocUnit, &(f->buf->nextAllocUnit))))
-        SDError(err);
-    f->buf->curSectorOffset = 0;
-    f->length = SDReadDat32(
-            &(g_sd_buf.buf[fileEntryOffset + SD_FILE_LEN_OFFSET]));
-#ifdef SD_FILE_WRITE
-    // Determine the number of sectors currently allocated to this file; useful
-    // in the case that the file needs to be extended
-    f->maxSectors = f->length >> SD_SECTOR_SIZE_SHIFT;
-    if (!(f->maxSectors))
-        f->maxSectors = 1 << g_sd_sectorsPerCluster_shift;
-    while (f->maxSectors % (1 << g_sd_sectorsPerCluster_shift))
-        ++(f->maxSectors);
-    f->buf->mod = 0;
+
+    memset(mem, 0, (1 + fatSectors + rootSectors) << SD_SECTOR_SIZE_SHIFT);
+
+    mem[SD_BOOT_SECTOR_ID_ADDR] = SD_BOOT_SECTOR_ID;
+    SDWriteDat16(&(mem[SD_BYTES_PER_SCTR_ADDR]), SD_SECTOR_SIZE);
+    mem[SD_CLUSTER_SIZE_ADDR] = 1 << clusterShift;
+    SDWriteDat16(&(mem[SD_RSVD_SCTR_CNT_ADDR]), 1);
+    // Memory needs no second copy of the FAT
+    mem[SD_NUM_FATS_ADDR] = 1;
+    SDWriteDat16(&(mem[SD_ROOT_ENTRY_CNT_ADDR]), SD_RAM_ROOT_ENTRIES);
+    if (0x10000 > disk->sectors)
+        SDWriteDat16(&(mem[SD_TOT_SCTR_16_ADDR]), (uint16_t) disk->sectors);
+    else
+        SDWriteDat32(&(mem[SD_TOT_SCTR_32_ADDR]), disk->sectors);
+    mem[SD_MEDIA_ADDR] = SD_MEDIA_FIXED;
+    SDWriteDat16(&(mem[SD_FAT_SIZE_16_ADDR]), (uint16_t) fatSectors);
+    SDWriteDat16(&(mem[SD_BOOT_SIGNATURE_ADDR]), SD_BOOT_SIGNATURE);
+
+    // The first two FAT entries hold the media descriptor and an end-of-chain
+    // marker
+    SDWriteDat16(&(mem[SD_SECTOR_SIZE]), 0xff00 | SD_MEDIA_FIXED);
+    SDWriteDat16(&(mem[SD_SECTOR_SIZE + SD_FAT_16]), (uint16_t) SD_EOC_END);
+
+    return 0;
+}
+
+uint8_t SDRamCopy (const sd_ram_disk *disk, const char *name, sd_file *f) {
+    uint8_t err;
+    uint16_t i, rootEntries;
+    uint32_t allocUnit, next, first, length, bytes, clusterBytes, endAllocUnit;
+    uint32_t rawName[SD_SHORT_NAME_WORDS];
+    const uint8_t *mem = disk->mem;
+    const uint8_t *fat, *entry, *data;
+
+    if ((err = SDNormalizeName(name, (char *) rawName)))
+        return err;
+
+    // Find the FAT, root directory and data region from the boot sector
+    fat = mem + (SDReadDat16(&(mem[SD_RSVD_SCTR_CNT_ADDR]))
+            << SD_SECTOR_SIZE_SHIFT);
+    entry = fat + ((mem[SD_NUM_FATS_ADDR]
+            * SDReadDat16(&(mem[SD_FAT_SIZE_16_ADDR]))) << SD_SECTOR_SIZE_SHIFT);
+    rootEntries = SDReadDat16(&(mem[SD_ROOT_ENTRY_CNT_ADDR]));
+    data = entry + rootEntries * SD_FILE_ENTRY_LENGTH;
+    clusterBytes = mem[SD_CLUSTER_SIZE_ADDR] << SD_SECTOR_SIZE_SHIFT;
+    endAllocUnit = 2 + ((disk->sectors << SD_SECTOR_SIZE_SHIFT)
+            - (uint32_t) (data - mem)) / clusterBytes;
+
+    for (i = 0; ; ++i, entry += SD_FILE_ENTRY_LENGTH) {
+        if (rootEntries == i || !entry[0])
+            return SD_FILENAME_NOT_FOUND;
+        if (SDNameMatches(entry, rawName) && !(entry[SD_FILE_ATTRIBUTE_OFFSET]
+                & (SD_SUB_DIR | SD_VOLUME_ID)))
+            break;
+    }
+
+    length = SDReadDat32(&(entry[SD_FILE_LEN_OFFSET]));
+    allocUnit = SDReadDat16(&(entry[SD_FILE_START_CLSTR_LOW]));
+    while (length) {
+        // Gather a run of consecutive clusters, which lie in one piece of
+        // memory
+        first = allocUnit;
+        bytes = 0;
+        do {
+            if (2 > allocUnit || endAllocUnit <= allocUnit)
+                return SD_CORRUPT_CLUSTER;
+            bytes += clusterBytes;
+            next = SDReadDat16(&(fat[allocUnit * SD_FAT_16]));
+        } while (bytes < length && ++allocUnit == next);
+        allocUnit = next;
+
+        if (bytes > length)
+            bytes = length;
+        if ((err = SDfwrite(data + (first - 2) * clusterBytes, bytes, f)))
+            return err;
+        length -= bytes;
+    }
+
+    return 0;
+}
 #endif
-    if ((err = SDReadDataBlock(f->buf->curClusterStartAddr, f->buf->buf)))
-        SDError(err);
+
+uint8_t SDchdir (const char *d) {
+    return SDchdirVol(g_sd_curVol, d);
+}
+
+uint8_t SDchdirVol (sd_volume *vol, const char *d) {
+    uint8_t err;
+    uint32_t cwd;
+
+    SDUseVolume(vol);
+    cwd = g_sd_vol->dir_firstAllocUnit;
+
+    // Every component of the path is entered, the last one included
+    if ((err = SDWalkPath(d, NULL))) {
+        g_sd_vol->dir_firstAllocUnit = cwd;
+        return err;
+    }
 
 #if (defined SD_VERBOSE && defined SD_DEBUG)
-    printf("Opening file from...\n");
-    printf("\tAllocation unit 0x%08X\n", f->buf->curAllocUnit);
-    printf("\tNext allocation unit 0x%08X\n", f->buf->nextAllocUnit);
-    printf("\tCluster starting address 0x%08X\n", f->buf->curClusterStartAddr);
-    printf("\tSector offset 0x%04X\n", f->buf->curSectorOffset);
-    printf("\tFile length 0x%08X\n", f->length);
-    printf("\tMax sectors 0x%08X\n", f->maxSectors);
-#ifdef SD_VERBOSE_BLOCKS
-    printf("And the first file sector looks like....\n");
-    SDPrintHexBlock(f->buf->buf, SD_SECTOR_SIZE);
-    putchar('\n');
+    printf("Changed directory to allocation unit 0x%08X\n",
+            g_sd_vol->dir_firstAllocUnit);
 #endif
+
+#ifdef SD_DIR_INDEX
+    // The index follows the working directory and is rebuilt the first time
+    // the new one is searched
+    if (cwd != g_sd_vol->dir_firstAllocUnit) {
+        g_sd_vol->dirIndexDir = g_sd_vol->dir_firstAllocUnit;
+        g_sd_vol->dirIndexBuilt = 0;
+    }
 #endif
 
     return 0;
 }
 
+uint8_t SDfopen (const char *name, sd_file *f, const sd_file_mode mode) {
+    return SDfopenVol(g_sd_curVol, name, f, mode);
+}
+
+uint8_t SDfopenVol (sd_volume *vol, const char *name, sd_file *f,
+        const sd_file_mode mode) {
+    uint8_t err;
+    uint32_t cwd;
+
+    SDUseVolume(vol);
+    cwd = g_sd_vol->dir_firstAllocUnit;
+
+    // Open the file from within its own directory, then return to the working
+    // directory; the file remembers where its directory entry lives
+    if (!(err = SDWalkPath(name, &name)))
+        err = SDOpenEntry(name, f, mode);
+    g_sd_vol->dir_firstAllocUnit = cwd;
+    f->vol = g_sd_vol;
+
+    return err;
+}
+
 #ifdef SD_FILE_WRITE
 uint8_t SDfclose (sd_file *f) {
     uint8_t err;
+    uint32_t clusters;
 
+    g_sd_vol = f->vol;
 #if (defined SD_VERBOSE && defined SD_DEBUG)
     printf("Closing file...\n");
 #endif
-    // If the currently loaded sector has been modified, save the changes
-    if ((f->buf->id == f->id) && f->buf->mod) {
-        if ((err = SDWriteDataBlock(
-                f->buf->curClusterStartAddr + f->buf->curSectorOffset,
-                f->buf->buf)))
+#ifdef SD_READ_AHEAD
+    SDCancelReadAhead(f);
+#endif
+    // Release any space reserved by SDfallocate() beyond the file's length
+    clusters = (f->length
+            + (SD_SECTOR_SIZE << g_sd_vol->sectorsPerCluster_shift) - 1)
+            >> (SD_SECTOR_SIZE_SHIFT + g_sd_vol->sectorsPerCluster_shift);
+    if (!clusters)
+        clusters = 1;
+    if ((f->maxSectors >> g_sd_vol->sectorsPerCluster_shift) > clusters)
+        if ((err = SDReleaseClusters(f, clusters)))
             SDError(err);
-        f->buf->mod = 0;
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-        printf("Modified sector in file has been saved...\n");
-        printf("\tDestination address: 0x%08X / %u\n",
-                f->buf->curClusterStartAddr + f->buf->curSectorOffset,
-                f->buf->curClusterStartAddr + f->buf->curSectorOffset);
-        printf("\tFile first sector address: 0x%08X / %u\n",
-                SDGetSectorFromAlloc(f->firstAllocUnit),
-                SDGetSectorFromAlloc(f->firstAllocUnit));
+
+    // The directory sector is left in the directory buffer to be saved along
+    // with any other file's length that lives in the same sector
+    if ((err = SDFlushFile(f)))
+        SDError(err);
+
+#ifdef SD_TAIL_CACHE
+    // A file without checkpoints has nothing to check its tail against later
+    if (f->tailAllocUnit && f->checkpointCount)
+        SDTailCacheInsert(f);
+#endif
+
+#ifdef SD_BUFFER_POOL
+    // Return a borrowed buffer to the pool, first in line to be reused
+    if (SDIsPoolBuf(f->buf)) {
+        if (f->buf->id == f->id) {
+            f->buf->id = SD_FOLDER_ID;
+            f->buf->lastUse = 0;
+        }
+        f->buf = NULL;
+    } else if (g_sd_vol->ownBuf == f->buf && f->buf->id == f->id)
+        // The directory may have its own buffer back
+        f->buf->id = SD_FOLDER_ID;
 #endif
+
+    return 0;
+}
+
+uint8_t SDfflush (sd_file *f) {
+    uint8_t err;
+
+    g_sd_vol = f->vol;
+    if ((err = SDFlushFile(f)))
+        return err;
+
+    return SDWriteBackBuf(g_sd_vol->buf);
+}
+
+void SDfsetsync (sd_file *f, const sd_sync_policy policy, const uint32_t bytes,
+        const uint32_t ms) {
+    f->sync = policy;
+    f->syncBytes = bytes;
+    f->syncTicks = (CLKFREQ / 1000) * ms;
+    f->unsynced = 0;
+    f->lastSync = CNT;
+}
+
+uint8_t SDfallocate (sd_file *f, const uint32_t bytes) {
+    uint8_t err;
+    uint32_t clusters, first, allocUnit;
+    const uint8_t clusterShift = SD_SECTOR_SIZE_SHIFT
+            + f->vol->sectorsPerCluster_shift;
+
+    g_sd_vol = f->vol;
+    clusters = (bytes + (1 << clusterShift) - 1) >> clusterShift;
+    if (clusters <= (f->maxSectors >> g_sd_vol->sectorsPerCluster_shift))
+        return 0;
+
+    // Position the buffer on the file's last cluster; whatever chain follows
+    // it (left behind by an interrupted preallocation) is counted first
+    if (f->buf->id != f->id)
+        if ((err = SDReloadBuf(f)))
+            return err;
+    if ((err = SDWriteBackBuf(f->buf)))
+        return err;
+    if ((err = SDFindClusterFromOffset(f, f->maxSectors - 1)))
+        return err;
+    f->curSector = SD_INVALID_SECTOR;
+    while (((uint32_t) SD_EOC_BEG) > f->buf->nextAllocUnit) {
+        f->maxSectors += 1 << g_sd_vol->sectorsPerCluster_shift;
+        if ((err = SDFindClusterFromOffset(f, f->maxSectors - 1)))
+            return err;
     }
+    if (clusters <= (f->maxSectors >> g_sd_vol->sectorsPerCluster_shift))
+        return 0;
+    clusters -= f->maxSectors >> g_sd_vol->sectorsPerCluster_shift;
 
-    // If we modified the length of the file...
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-    printf("Closing file and \"f->mod\" value is %u\n", f->mod);
-    printf("File length is: 0x%08X / %u\n", f->length, f->length);
+    // Find a run directly after the last cluster if possible
+    if ((err = SDFindFreeRun(f->buf->curAllocUnit + 1, clusters, &first)))
+        return err;
+
+    // Chain the run together, end it, and then link it to the file
+    for (allocUnit = first; allocUnit < first + clusters - 1; ++allocUnit)
+        if ((err = SDSetFATValue(allocUnit, allocUnit + 1)))
+            return err;
+    if ((err = SDSetFATValue(allocUnit, (uint32_t) SD_EOC_END)))
+        return err;
+    if ((err = SDSetFATValue(f->buf->curAllocUnit, first)))
+        return err;
+    f->buf->nextAllocUnit = first;
+    f->maxSectors += clusters << g_sd_vol->sectorsPerCluster_shift;
+    f->tailAllocUnit = first + clusters - 1;
+
+    return 0;
+}
+
+uint8_t SDftruncate (sd_file *f, const uint32_t length) {
+    uint8_t err;
+    uint32_t clusters;
+    const uint8_t clusterShift = SD_SECTOR_SIZE_SHIFT
+            + f->vol->sectorsPerCluster_shift;
+
+    g_sd_vol = f->vol;
+    if (length >= f->length)
+        return 0;
+
+#ifdef SD_READ_AHEAD
+    SDCancelReadAhead(f);
 #endif
-    if (f->mod) {
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-        printf("File length has been modified - write it to the directory\n");
+
+    clusters = (length + (1 << clusterShift) - 1) >> clusterShift;
+    if (!clusters)
+        clusters = 1;
+
+    if ((f->maxSectors >> g_sd_vol->sectorsPerCluster_shift) > clusters) {
+        // A modified sector is saved now rather than written over the freed
+        // clusters later
+        if (f->buf->id == f->id)
+            if ((err = SDWriteBackBuf(f->buf)))
+                return err;
+
+        // The shorter length reaches the card before any cluster is freed, so
+        // that a power loss can only leave lost clusters behind, never an
+        // entry reaching into free ones
+        f->length = length;
+        if ((err = SDWriteFileLength(f)))
+            return err;
+        if ((err = SDWriteBackBuf(g_sd_vol->buf)))
+            return err;
+
+        if ((err = SDReleaseClusters(f, clusters)))
+            return err;
+#ifdef SD_SEEK_CHECKPOINTS
+        SDCheckpointTruncate(f, clusters);
 #endif
-        // Then check if the directory sector is still loaded...
-        if ((g_sd_buf.curClusterStartAddr + g_sd_buf.curSectorOffset)
-                != f->dirSectorAddr) {
-            // If it isn't, load it...
-            if (g_sd_buf.mod)
-                // And if it's been modified since the last read, save it...
-                if ((err = SDWriteDataBlock(
-                        g_sd_buf.curClusterStartAddr + g_sd_buf.curSectorOffset,
-                        g_sd_buf.buf)))
-                    SDError(err);
-            if ((err = SDReadDataBlock(f->dirSectorAddr, g_sd_buf.buf)))
-                SDError(err);
+
+        // A buffer left in a freed cluster starts over from the first one;
+        // the next access loads whichever sector it needs
+        if (f->buf->id == f->id && f->curCluster >= clusters) {
+            f->curCluster = 0;
+            f->buf->curAllocUnit = f->firstAllocUnit;
+            f->buf->curClusterStartAddr = SDGetSectorFromAlloc(
+                    f->firstAllocUnit);
+            if ((err = SDGetFATValue(f->firstAllocUnit,
+                    &(f->buf->nextAllocUnit))))
+                return err;
         }
-        // Finally, edit the length of the file
-        SDWriteDat32(&(g_sd_buf.buf[f->fileEntryOffset + SD_FILE_LEN_OFFSET]),
-                f->length);
-        g_sd_buf.mod = 01;
+        if (SD_INVALID_SECTOR != f->curSector
+                && f->maxSectors <= f->curSector)
+            f->curSector = SD_INVALID_SECTOR;
     }
 
-    return 0;
+    f->length = length;
+    if (f->rPtr > length)
+        f->rPtr = length;
+    if (f->wPtr > length)
+        f->wPtr = length;
+    f->mod = 1;
+
+    return SDCheckSync(f, 0);
+}
+
+uint8_t SDremove (const char *name) {
+    return SDremoveVol(g_sd_curVol, name);
+}
+
+uint8_t SDremoveVol (sd_volume *vol, const char *name) {
+    uint8_t err;
+    uint32_t cwd;
+
+    SDUseVolume(vol);
+    cwd = g_sd_vol->dir_firstAllocUnit;
+
+    // Like SDfopen(), the file is found from within its own directory
+    if (!(err = SDWalkPath(name, &name)))
+        err = SDRemoveEntry(name);
+    g_sd_vol->dir_firstAllocUnit = cwd;
+
+    return err;
 }
 
 uint8_t SDfputc (const char c, sd_file *f) {
@@ -655,6 +1118,8 @@ uint8_t SDfputc (const char c, sd_file *f) {
     // Determine the needed file sector
     uint32_t sectorOffset = (f->wPtr >> SD_SECTOR_SIZE_SHIFT);
 
+    g_sd_vol = f->vol;
+
     // Determine if the correct sector is loaded
     if (f->buf->id != f->id)
         if ((err = SDReloadBuf(f)))
@@ -673,11 +1138,9 @@ uint8_t SDfputc (const char c, sd_file *f) {
 #endif
 
         // If the sector needed exceeds the available sectors, extend the file
-        if (f->maxSectors == sectorOffset) {
-            if ((err = SDExtendFAT(f->buf)))
+        if (f->maxSectors == sectorOffset)
+            if ((err = SDExtendFile(f)))
                 SDError(err);
-            f->maxSectors += 1 << g_sd_sectorsPerCluster_shift;
-        }
 
 #if (defined SD_VERBOSE && defined SD_DEBUG)
         printf("Loading new file sector at file-offset: 0x%08X / %u\n",
@@ -696,18 +1159,101 @@ uint8_t SDfputc (const char c, sd_file *f) {
     }
     f->buf->buf[sectorPtr] = c;
     f->buf->mod = 1;
+    f->buf->vol = f->vol;
 
-    return 0;
+    return SDCheckSync(f, 1);
 }
 
 uint8_t SDfputs (char *s, sd_file *f) {
+    return SDfwrite((uint8_t *) s, strlen(s), f);
+}
+
+uint8_t SDfwrite (const uint8_t dat[], uint32_t bytes, sd_file *f) {
     uint8_t err;
+    uint16_t sectorPtr;
+    uint32_t sectorOffset, chunk;
+#ifdef SD_MULTI_BLOCK
+    uint32_t address, sectors;
+#endif
+    const uint32_t total = bytes;
+
+    g_sd_vol = f->vol;
 
-    while (*s)
-        if ((err = SDfputc(*(s++), f)))
+    // Determine if the buffer is holding another file's sector
+    if (f->buf->id != f->id)
+        if ((err = SDReloadBuf(f)))
             SDError(err);
 
-    return 0;
+    while (bytes) {
+        sectorPtr = f->wPtr % SD_SECTOR_SIZE;
+        sectorOffset = f->wPtr >> SD_SECTOR_SIZE_SHIFT;
+
+        // If the sector needed exceeds the available sectors, extend the file
+        if (f->maxSectors == sectorOffset)
+            if ((err = SDExtendFile(f)))
+                SDError(err);
+
+        if (!sectorPtr && SD_SECTOR_SIZE <= bytes) {
+            // Whole sector - send it straight from the caller's memory. The
+            // buffer's copy (if it holds this sector) would be stale, so it is
+            // saved and then disowned
+#ifdef SD_MULTI_BLOCK
+            if (f->curSector >= sectorOffset && f->curSector
+                    < sectorOffset + (bytes >> SD_SECTOR_SIZE_SHIFT))
+#else
+            if (sectorOffset == f->curSector)
+#endif
+                f->buf->mod = 0;
+#ifdef SD_READ_AHEAD
+            SDCancelReadAhead(f);
+#endif
+            if ((err = SDWriteBackBuf(f->buf)))
+                SDError(err);
+            if ((err = SDFindClusterFromOffset(f, sectorOffset)))
+                SDError(err);
+            f->curSector = SD_INVALID_SECTOR;
+#ifdef SD_MULTI_BLOCK
+            // Every whole sector that lands in clusters stored consecutively
+            // on the card is written with a single command. Sectors beyond
+            // the file's clusters wait for the next extension
+            address = f->buf->curClusterStartAddr
+                    + sectorOffset % (1 << g_sd_vol->sectorsPerCluster_shift);
+            if ((err = SDFindExtent(f, sectorOffset,
+                    bytes >> SD_SECTOR_SIZE_SHIFT, &sectors)))
+                SDError(err);
+            if ((err = SDWriteDataBlocks(address, sectors, (uint8_t *) dat)))
+                SDError(err);
+            chunk = sectors << SD_SECTOR_SIZE_SHIFT;
+#else
+            if ((err = SDWriteDataBlock(f->buf->curClusterStartAddr
+                    + sectorOffset % (1 << g_sd_vol->sectorsPerCluster_shift),
+                    (uint8_t *) dat)))
+                SDError(err);
+            chunk = SD_SECTOR_SIZE;
+#endif
+        } else {
+            // Partial sector - merge into the buffer
+            if (sectorOffset != f->curSector)
+                if ((err = SDLoadSectorFromOffset(f, sectorOffset)))
+                    SDError(err);
+            chunk = SD_SECTOR_SIZE - sectorPtr;
+            if (chunk > bytes)
+                chunk = bytes;
+            memcpy(&(f->buf->buf[sectorPtr]), dat, chunk);
+            f->buf->mod = 1;
+            f->buf->vol = f->vol;
+        }
+
+        dat += chunk;
+        bytes -= chunk;
+        f->wPtr += chunk;
+        if (f->wPtr > f->length) {
+            f->length = f->wPtr;
+            f->mod = 1;
+        }
+    }
+
+    return SDCheckSync(f, total);
 }
 #endif
 
@@ -718,10 +1264,12 @@ char SDfgetc (sd_file *f) {
     // Determine if the currently loaded sector is what we need
     uint32_t sectorOffset = (f->rPtr >> SD_SECTOR_SIZE_SHIFT);
 
+    g_sd_vol = f->vol;
+
     // Determine if the correct sector is loaded
     if (f->buf->id != f->id)
         SDReloadBuf(f);
-    else if (sectorOffset != f->curSector) {
+    if (sectorOffset != f->curSector) {
 #if (defined SD_VERBOSE && defined SD_DEBUG)
         printf("File sector offset: 0x%08X / %u\n", sectorOffset, sectorOffset);
 #endif
@@ -729,6 +1277,10 @@ char SDfgetc (sd_file *f) {
     }
     ++(f->rPtr);
     c = f->buf->buf[ptr];
+#ifdef SD_READ_AHEAD
+    if (SD_SECTOR_SIZE / 2 == ptr)
+        SDReadAhead(f);
+#endif
     return c;
 }
 
@@ -752,6 +1304,87 @@ char * SDfgets (char s[], uint32_t size, sd_file *f) {
     return (0 < count) ? s : NULL;
 }
 
+uint8_t SDfread (uint8_t dat[], uint32_t bytes, sd_file *f,
+        uint32_t *bytesRead) {
+    uint8_t err;
+    uint16_t sectorPtr;
+    uint32_t sectorOffset, chunk;
+#ifdef SD_MULTI_BLOCK
+    uint32_t address, sectors;
+#endif
+
+    g_sd_vol = f->vol;
+    *bytesRead = 0;
+
+    // Never read past the end of the file
+    if (f->rPtr >= f->length)
+        return 0;
+    if (bytes > f->length - f->rPtr)
+        bytes = f->length - f->rPtr;
+
+    // Determine if the buffer is holding another file's sector
+    if (f->buf->id != f->id)
+        if ((err = SDReloadBuf(f)))
+            SDError(err);
+
+    while (bytes) {
+        sectorPtr = f->rPtr % SD_SECTOR_SIZE;
+        sectorOffset = f->rPtr >> SD_SECTOR_SIZE_SHIFT;
+
+        if (!sectorPtr && SD_SECTOR_SIZE <= bytes
+                && sectorOffset != f->curSector) {
+            // Whole sector that isn't already buffered - read it straight into
+            // the caller's memory
+#ifdef SD_FILE_WRITE
+            if ((err = SDWriteBackBuf(f->buf)))
+                SDError(err);
+#endif
+            if ((err = SDFindClusterFromOffset(f, sectorOffset)))
+                SDError(err);
+            f->curSector = SD_INVALID_SECTOR;
+#ifdef SD_MULTI_BLOCK
+            // Every whole sector stored consecutively on the card is read
+            // with a single command
+            address = f->buf->curClusterStartAddr
+                    + sectorOffset % (1 << g_sd_vol->sectorsPerCluster_shift);
+            if ((err = SDFindExtent(f, sectorOffset,
+                    bytes >> SD_SECTOR_SIZE_SHIFT, &sectors)))
+                SDError(err);
+            if ((err = SDReadDataBlocks(address, sectors, dat)))
+                SDError(err);
+            chunk = sectors << SD_SECTOR_SIZE_SHIFT;
+#else
+            if ((err = SDReadDataBlock(f->buf->curClusterStartAddr
+                    + sectorOffset % (1 << g_sd_vol->sectorsPerCluster_shift),
+                    dat)))
+                SDError(err);
+            chunk = SD_SECTOR_SIZE;
+#endif
+        } else {
+            // Partial (or already buffered) sector - copy out of the buffer
+            if (sectorOffset != f->curSector)
+                if ((err = SDLoadSectorFromOffset(f, sectorOffset)))
+                    SDError(err);
+            chunk = SD_SECTOR_SIZE - sectorPtr;
+            if (chunk > bytes)
+                chunk = bytes;
+            memcpy(dat, &(f->buf->buf[sectorPtr]), chunk);
+#ifdef SD_READ_AHEAD
+            if (SD_SECTOR_SIZE / 2 < sectorPtr + chunk)
+                if ((err = SDReadAhead(f)))
+                    SDError(err);
+#endif
+        }
+
+        dat += chunk;
+        bytes -= chunk;
+        f->rPtr += chunk;
+        *bytesRead += chunk;
+    }
+
+    return 0;
+}
+
 inline uint8_t SDfeof (sd_file *f) {
     return f->length == f->rPtr;
 }
@@ -802,28 +1435,196 @@ file_pos SDftellw (const sd_file *f) {
     return f->wPtr;
 }
 
-#ifdef SD_SHELL
-uint8_t SD_Shell (sd_file *f) {
-    char usrInput[SD_SHELL_INPUT_LEN] = "";
-    char cmd[SD_SHELL_CMD_LEN] = "";
-    char arg[SD_SHELL_ARG_LEN] = "";
-    char uppercaseName[SD_SHELL_ARG_LEN] = "";
-    uint8_t i, j, err;
+#ifdef SD_RAW_BLOCKS
+uint8_t SDRawRegion (sd_raw_region *r, const uint32_t first,
+        const uint32_t count) {
+    uint8_t err;
 
-    printf("Welcome to David's quick shell! "
-            "There is no help, nor much to do.\n");
-    printf("Have fun...\n");
+    g_sd_vol = g_sd_curVol;
+    if (!count || first + count < first)
+        return SD_RAW_OUT_OF_RANGE;
+    if ((err = SDRawCheckRange(first, count)))
+        return err;
 
-    // Loop until the user types the SD_SHELL_EXIT string
-    while (strcmp(usrInput, SD_SHELL_EXIT)) {
-        printf(">>> ");
-        gets(usrInput);
+    r->first = first;
+    r->count = count;
+    return 0;
+}
 
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-        printf("Received \"%s\" as the complete line\n", usrInput);
-#endif
+uint8_t SDRawPartition (sd_raw_region *r, const uint8_t partition) {
+    uint8_t err, type;
+    uint32_t first, count;
 
-        // Retrieve command
+    g_sd_vol = g_sd_curVol;
+    if (SD_PARTITION_ENTRIES <= partition)
+        return SD_RAW_OUT_OF_RANGE;
+
+    // Sector 0 is read into a raw buffer borrowed from the FAT
+    if ((err = SDRawReadMBR()))
+        return err;
+    type = g_sd_vol->fat[SD_PARTITION_TABLE_ADDR
+            + partition * SD_PARTITION_ENTRY_SIZE + SD_PARTITION_TYPE_OFFSET];
+    first = SDReadDat32(&(g_sd_vol->fat[SD_PARTITION_TABLE_ADDR
+            + partition * SD_PARTITION_ENTRY_SIZE + SD_PARTITION_LBA_OFFSET]));
+    count = SDReadDat32(&(g_sd_vol->fat[SD_PARTITION_TABLE_ADDR
+            + partition * SD_PARTITION_ENTRY_SIZE + SD_PARTITION_SIZE_OFFSET]));
+    if (SD_BOOT_SECTOR_ID == g_sd_vol->fat[SD_BOOT_SECTOR_ID_ADDR])
+        type = 0;
+    if ((err = SDRawRestoreFAT()))
+        return err;
+
+    // An unpartitioned card or an unused entry has nothing to offer
+    if (!type)
+        return SD_RAW_OUT_OF_RANGE;
+    if (SDIsFATPartition(type))
+        return SD_RAW_PROTECTED;
+
+    return SDRawRegion(r, first, count);
+}
+
+uint8_t SDRawRead (const sd_raw_region *r, const uint32_t block,
+        const uint32_t count, uint8_t dat[]) {
+    if (block >= r->count || count > r->count - block)
+        return SD_RAW_OUT_OF_RANGE;
+
+    g_sd_vol = g_sd_curVol;
+    return SDReadDataBlocks(r->first + block, count, dat);
+}
+
+uint8_t SDRawWrite (const sd_raw_region *r, const uint32_t block,
+        const uint32_t count, const uint8_t dat[]) {
+    uint8_t err;
+
+    if (block >= r->count || count > r->count - block)
+        return SD_RAW_OUT_OF_RANGE;
+
+    g_sd_vol = g_sd_curVol;
+    if ((err = SDRawCheckVolume(r->first + block, count)))
+        return err;
+    return SDWriteDataBlocks(r->first + block, count, (uint8_t *) dat);
+}
+
+uint8_t SDRawErase (const sd_raw_region *r, const uint32_t block,
+        const uint32_t count) {
+    uint8_t err;
+
+    if (block >= r->count || count > r->count - block)
+        return SD_RAW_OUT_OF_RANGE;
+
+    g_sd_vol = g_sd_curVol;
+    if ((err = SDRawCheckVolume(r->first + block, count)))
+        return err;
+    return SDEraseDataBlocks(r->first + block, count);
+}
+
+#ifdef SD_RING_LOG
+uint8_t SDRingOpen (sd_ring_log *log, const sd_raw_region *region) {
+    uint8_t err;
+    uint32_t first, lo, hi, mid;
+
+    log->region = *region;
+    log->next = 0;
+
+    // Slot 0 begins every lap around the ring; if it holds no record, nothing
+    // has been appended yet
+    if ((err = SDRingReadSlot(log, 0, &first)))
+        return err;
+    if (SD_RING_NO_RECORD == first)
+        return 0;
+
+    // The slots of the current lap hold consecutive sequence numbers from
+    // slot 0 on; the rest hold older records or none. Binary search for the
+    // last slot of the current lap
+    lo = 0;
+    hi = log->region.count - 1;
+    while (lo < hi) {
+        mid = lo + ((hi - lo + 1) >> 1);
+        if ((err = SDRingReadSlot(log, mid, &log->next)))
+            return err;
+        if (first + mid == log->next)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    log->next = first + lo + 1;
+
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    printf("Ring log resumes at record %u\n", log->next);
+#endif
+
+    return 0;
+}
+
+uint8_t SDRingAppend (sd_ring_log *log, const uint8_t dat[],
+        const uint16_t bytes) {
+    uint8_t err;
+
+    if (SD_RING_RECORD_SIZE < bytes)
+        return SD_INVALID_NUM_BYTES;
+
+    SDWriteDat32(&(log->buf[SD_RING_MAGIC_ADDR]), SD_RING_MAGIC);
+    SDWriteDat32(&(log->buf[SD_RING_SEQUENCE_ADDR]), log->next);
+    SDWriteDat16(&(log->buf[SD_RING_BYTES_ADDR]), bytes);
+    memcpy(&(log->buf[SD_RING_HEADER_SIZE]), dat, bytes);
+
+    if ((err = SDRawWrite(&(log->region), log->next % log->region.count, 1,
+            log->buf)))
+        return err;
+    ++(log->next);
+
+    return 0;
+}
+
+uint8_t SDRingRead (sd_ring_log *log, const uint32_t sequence,
+        uint8_t dat[], uint16_t *bytes) {
+    uint8_t err;
+    uint32_t stored;
+
+    // Only the latest lap is kept
+    if (sequence >= log->next || log->next - sequence > log->region.count)
+        return SD_RAW_OUT_OF_RANGE;
+
+    if ((err = SDRingReadSlot(log, sequence % log->region.count, &stored)))
+        return err;
+    if (sequence != stored)
+        return SD_RAW_OUT_OF_RANGE;
+
+    *bytes = SDReadDat16(&(log->buf[SD_RING_BYTES_ADDR]));
+    if (SD_RING_RECORD_SIZE < *bytes)
+        *bytes = SD_RING_RECORD_SIZE;
+    memcpy(dat, &(log->buf[SD_RING_HEADER_SIZE]), *bytes);
+
+    return 0;
+}
+#endif
+#endif
+
+#ifdef SD_SHELL
+uint8_t SD_Shell (sd_file *f) {
+    return SD_ShellVol(g_sd_curVol, f);
+}
+
+uint8_t SD_ShellVol (sd_volume *vol, sd_file *f) {
+    char usrInput[SD_SHELL_INPUT_LEN] = "";
+    char cmd[SD_SHELL_CMD_LEN] = "";
+    char arg[SD_SHELL_ARG_LEN] = "";
+    char uppercaseName[SD_SHELL_ARG_LEN] = "";
+    uint8_t i, j, err;
+
+    printf("Welcome to David's quick shell! "
+            "There is no help, nor much to do.\n");
+    printf("Have fun...\n");
+
+    // Loop until the user types the SD_SHELL_EXIT string
+    while (strcmp(usrInput, SD_SHELL_EXIT)) {
+        printf(">>> ");
+        gets(usrInput);
+
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+        printf("Received \"%s\" as the complete line\n", usrInput);
+#endif
+
+        // Retrieve command
         for (i = 0; (0 != usrInput[i] && ' ' != usrInput[i]); ++i)
             cmd[i] = usrInput[i];
 
@@ -852,18 +1653,22 @@ uint8_t SD_Shell (sd_file *f) {
 
         // Interpret the command
         if (!strcmp(cmd, SD_SHELL_LS))
-            err = SD_Shell_ls();
+            err = SD_Shell_lsVol(vol, uppercaseName);
         else if (!strcmp(cmd, SD_SHELL_CAT))
-            err = SD_Shell_cat(uppercaseName, f);
+            err = SD_Shell_catVol(vol, uppercaseName, f);
         else if (!strcmp(cmd, SD_SHELL_CD))
-            err = SDchdir(uppercaseName);
+            err = SDchdirVol(vol, uppercaseName);
 #ifdef SD_FILE_WRITE
         else if (!strcmp(cmd, SD_SHELL_TOUCH))
-            err = SD_Shell_touch(uppercaseName);
+            err = SD_Shell_touchVol(vol, uppercaseName);
+        else if (!strcmp(cmd, SD_SHELL_RM))
+            err = SDremoveVol(vol, uppercaseName);
 #endif
 #ifdef SD_VERBOSE_BLOCKS
-        else if (!strcmp(cmd, "d"))
-            SDPrintHexBlock(g_sd_buf.buf, SD_SECTOR_SIZE);
+        else if (!strcmp(cmd, "d")) {
+            SDUseVolume(vol);
+            SDPrintHexBlock(g_sd_vol->buf->buf, SD_SECTOR_SIZE);
+        }
 #endif
         else if (!strcmp(cmd, SD_SHELL_EXIT))
             break;
@@ -891,28 +1696,56 @@ uint8_t SD_Shell (sd_file *f) {
     return 0;
 }
 
-uint8_t SD_Shell_ls (void) {
+uint8_t SD_Shell_ls (const char *name) {
+    return SD_Shell_lsVol(g_sd_curVol, name);
+}
+
+uint8_t SD_Shell_lsVol (sd_volume *vol, const char *name) {
     uint8_t err;
     uint16_t fileEntryOffset = 0;
     char string[SD_FILENAME_STR_LEN];  // Allocate space for a filename string
+    uint32_t rawName[SD_SHORT_NAME_WORDS];
+
+    SDUseVolume(vol);
+
+#ifdef SD_BUFFER_POOL
+    if ((err = SDClaimDirBuf()))
+        return err;
+#endif
+
+    // Normalize the filter (if any) once rather than formatting every entry
+    if (name[0])
+        if ((err = SDNormalizeName(name, (char *) rawName)))
+            return err;
 
     // If we aren't looking at the beginning of a cluster, we must backtrack to
     // the beginning and then begin listing files
-    if (g_sd_buf.curSectorOffset
-            || (SDGetSectorFromAlloc(g_sd_dir_firstAllocUnit)
-                    != g_sd_buf.curClusterStartAddr)) {
+    if (g_sd_vol->buf->curSectorOffset
+            || (g_sd_vol->dir_firstAllocUnit != g_sd_vol->buf->curAllocUnit)
+            || (SDGetSectorFromAlloc(g_sd_vol->dir_firstAllocUnit)
+                    != g_sd_vol->buf->curClusterStartAddr)) {
 #if (defined SD_VERBOSE && defined SD_DEBUG)
         printf("'ls' requires a backtrack to beginning of directory's "
                 "cluster\n");
 #endif
-        g_sd_buf.curClusterStartAddr = SDGetSectorFromAlloc(
-                g_sd_dir_firstAllocUnit);
-        g_sd_buf.curSectorOffset = 0;
-        g_sd_buf.curAllocUnit = g_sd_dir_firstAllocUnit;
-        if ((err = SDGetFATValue(g_sd_buf.curAllocUnit,
-                &(g_sd_buf.nextAllocUnit))))
+#ifdef SD_FILE_WRITE
+        // Save the current buffer; it may hold an entry just written by touch
+        if (g_sd_vol->buf->mod) {
+            if ((err = SDWriteDataBlock(g_sd_vol->buf->curClusterStartAddr
+                    + g_sd_vol->buf->curSectorOffset, g_sd_vol->buf->buf)))
+                return err;
+            g_sd_vol->buf->mod = 0;
+        }
+#endif
+        g_sd_vol->buf->curClusterStartAddr = SDGetSectorFromAlloc(
+                g_sd_vol->dir_firstAllocUnit);
+        g_sd_vol->buf->curSectorOffset = 0;
+        g_sd_vol->buf->curAllocUnit = g_sd_vol->dir_firstAllocUnit;
+        if ((err = SDGetFATValue(g_sd_vol->buf->curAllocUnit,
+                &(g_sd_vol->buf->nextAllocUnit))))
             return err;
-        if ((err = SDReadDataBlock(g_sd_buf.curClusterStartAddr, g_sd_buf.buf)))
+        if ((err = SDReadDataBlock(g_sd_vol->buf->curClusterStartAddr,
+                g_sd_vol->buf->buf)))
             return err;
     }
 
@@ -920,13 +1753,16 @@ uint8_t SD_Shell_ls (void) {
     // one
     // Function will exit normally without an error code if the file is not
     // found
-    while (g_sd_buf.buf[fileEntryOffset]) {
+    while (g_sd_vol->buf->buf[fileEntryOffset]) {
         // Check if file is valid, retrieve the name if it is
-        if ((SD_DELETED_FILE_MARK != g_sd_buf.buf[fileEntryOffset])
+        if ((SD_DELETED_FILE_MARK != g_sd_vol->buf->buf[fileEntryOffset])
                 && !(SD_SYSTEM_FILE
-                        & g_sd_buf.buf[fileEntryOffset
-                                + SD_FILE_ATTRIBUTE_OFFSET]))
-            SDPrintFileEntry(&(g_sd_buf.buf[fileEntryOffset]), string);
+                        & g_sd_vol->buf->buf[fileEntryOffset
+                                + SD_FILE_ATTRIBUTE_OFFSET])
+                && (!name[0]
+                        || SDNameMatches(&(g_sd_vol->buf->buf[fileEntryOffset]),
+                                rawName)))
+            SDPrintFileEntry(&(g_sd_vol->buf->buf[fileEntryOffset]), string);
 
         // Increment to the next file
         fileEntryOffset += SD_FILE_ENTRY_LENGTH;
@@ -935,7 +1771,7 @@ uint8_t SD_Shell_ls (void) {
         if (SD_SECTOR_SIZE == fileEntryOffset) {
             // Last entry in the sector, attempt to load a new sector
             // Possible error value includes end-of-chain marker
-            if ((err = SDLoadNextSector(&g_sd_buf))) {
+            if ((err = SDLoadNextSector(g_sd_vol->buf))) {
                 if ((uint8_t) SD_EOC_END == err)
                     break;
                 else
@@ -950,10 +1786,14 @@ uint8_t SD_Shell_ls (void) {
 }
 
 uint8_t SD_Shell_cat (const char *name, sd_file *f) {
+    return SD_Shell_catVol(g_sd_curVol, name, f);
+}
+
+uint8_t SD_Shell_catVol (sd_volume *vol, const char *name, sd_file *f) {
     uint8_t err;
 
     // Attempt to find the file
-    if ((err = SDfopen(name, f, SD_FILE_MODE_R))) {
+    if ((err = SDfopenVol(vol, name, f, SD_FILE_MODE_R))) {
         if ((uint8_t) SD_EOC_END == err)
             return err;
         else
@@ -974,9 +1814,15 @@ uint8_t SD_Shell_cat (const char *name, sd_file *f) {
 
 #ifdef SD_FILE_WRITE
 uint8_t SD_Shell_touch (const char name[]) {
+    return SD_Shell_touchVol(g_sd_curVol, name);
+}
+
+uint8_t SD_Shell_touchVol (sd_volume *vol, const char name[]) {
     uint8_t err;
     uint16_t fileEntryOffset;
 
+    SDUseVolume(vol);
+
     // Attempt to find the file if it already exists
     if ((err = SDFind(name, &fileEntryOffset))) {
         // Error occured - hopefully it was a "file not found" error
@@ -1032,6 +1878,170 @@ uint8_t SDPrintHexBlock (uint8_t *dat, uint16_t bytes) {
 /************************************
  *** Private Function Definitions ***
  ************************************/
+#ifdef SD_CARD
+uint8_t SDIsReady (void) {
+    uint8_t k;
+    uint8_t response[SD_RESPONSE_LEN_R3 - 1];
+
+    // Clock out anything left over from before the reset
+    GPIOPinSet(g_sd_curCard->cs);
+    for (k = 0; k < 5; ++k)
+        if (SPIShiftOut(16, -1))
+            return 0;
+    if (SPIWait())
+        return 0;
+
+    // An initialized card answers CMD58 with the active response and an OCR
+    // showing that power-up is complete
+    GPIOPinClear(g_sd_curCard->cs);
+    if (SDSendCommand(SD_CMD_READ_OCR, 0, SD_CRC_OTHER))
+        return 0;
+    // A card that is not yet in SPI mode never answers; rather than waiting
+    // for SDGetResponse() to time out, give up after the longest time a card
+    // may take to respond
+    for (k = 0; k < SD_RESPONSE_MAX_DELAY; ++k) {
+        if (SPIShiftIn(8, &g_sd_firstByteResponse,
+                sizeof(g_sd_firstByteResponse)))
+            return 0;
+        if (0xff != g_sd_firstByteResponse)
+            break;
+    }
+    if (0xff == g_sd_firstByteResponse)
+        return 0;
+    for (k = 0; k < sizeof(response); ++k)
+        if (SPIShiftIn(8, &(response[k]), sizeof(response[k])))
+            return 0;
+    if (SPIShiftOut(8, 0xff))
+        return 0;
+
+    return SD_RESPONSE_ACTIVE == g_sd_firstByteResponse
+            && (SD_OCR_POWER_UP & response[0]) && (SD_OCR_CCS & response[0]);
+}
+
+uint8_t SDReset (void) {
+    uint8_t i, j, k, err;
+    uint8_t response[16];
+    uint32_t delay, waited;
+
+    for (i = 0; i < 10; ++i) {
+        // Initialization loop (reset SD card); retry with a growing delay
+        delay = MILLISECOND;
+        for (j = 0; j < 10; ++j) {
+            // Send at least 72 clock cycles to enable the SD card
+            GPIOPinSet(g_sd_curCard->cs);
+            for (k = 0; k < 5; ++k)
+                checkErrors(SPIShiftOut(16, -1));
+            checkErrors(SPIWait());
+
+            GPIOPinClear(g_sd_curCard->cs);
+            // Send SD into idle state, retrieve a response and ensure it is the "idle" response
+            if ((err = SDSendCommand(SD_CMD_IDLE, 0, SD_CRC_IDLE)))
+                return err;
+            SDGetResponse(SD_RESPONSE_LEN_R1, response);
+            if (SD_RESPONSE_IDLE == g_sd_firstByteResponse)
+                break;
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+            printf("Failed attempt at CMD0: 0x%02X\n", g_sd_firstByteResponse);
+#endif
+            waitcnt(delay + CNT);
+            if (SD_INIT_DELAY_MAX > delay)
+                delay <<= 1;
+        }
+        if (SD_RESPONSE_IDLE != g_sd_firstByteResponse)
+            return SD_INVALID_INIT;
+
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+        printf("SD card in idle state. Now sending CMD8...\n");
+#endif
+
+        // Set voltage to 3.3V and ensure response is R7
+        if ((err = SDSendCommand(SD_CMD_SDHC, SD_CMD_VOLT_ARG, SD_CRC_SDHC)))
+            return err;
+        if ((err = SDGetResponse(SD_RESPONSE_LEN_R7, response)))
+            return err;
+        if ((SD_RESPONSE_IDLE == g_sd_firstByteResponse)
+                && (0x01 == response[2]) && (0xAA == response[3]))
+            break;
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+        printf("Failed attempt at CMD8\n");
+#endif
+    }
+
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    printf("CMD8 succeeded. Requesting operating conditions...\n");
+#endif
+
+    // Request operating conditions register and ensure response begins with R1
+    if ((err = SDSendCommand(SD_CMD_READ_OCR, 0, SD_CRC_OTHER)))
+        return err;
+    if ((err = SDGetResponse(SD_RESPONSE_LEN_R3, response)))
+        return err;
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    SDPrintHexBlock(response, SD_RESPONSE_LEN_R3);
+#endif
+    if (SD_RESPONSE_IDLE != g_sd_firstByteResponse)
+        return SD_INVALID_INIT;
+
+    // Spin up the card and bring to active state; poll quickly at first and
+    // back off for slow cards, giving up after one second
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    printf("OCR read successfully. Sending into active state...\n");
+#endif
+    delay = MILLISECOND;
+    waited = 0;
+    while (1) {
+        if ((err = SDSendCommand(SD_CMD_APP, 0, SD_CRC_OTHER)))
+            return err;
+        if ((err = SDGetResponse(1, response)))
+            return err;
+        if ((err = SDSendCommand(SD_CMD_WR_OP, BIT_30, SD_CRC_OTHER)))
+            return err;
+        SDGetResponse(1, response);
+        if (SD_RESPONSE_ACTIVE == g_sd_firstByteResponse)
+            break;
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+        printf("Failed attempt at active state: 0x%02X\n",
+                g_sd_firstByteResponse);
+#endif
+        if (SECOND <= waited)
+            return SD_INVALID_RESPONSE;
+        waitcnt(delay + CNT);
+        waited += delay;
+        if (SD_INIT_DELAY_MAX > delay)
+            delay <<= 1;
+    }
+
+    return 0;
+}
+
+#ifdef SD_AU_ALIGN
+uint8_t SDReadAUSize (void) {
+    uint8_t err;
+    uint8_t status[SD_STATUS_LEN];
+
+    GPIOPinClear(g_sd_curCard->cs);
+    if ((err = SDSendCommand(SD_CMD_APP, 0, SD_CRC_OTHER)))
+        return err;
+    if ((err = SDGetResponse(SD_RESPONSE_LEN_R1, status)))
+        return err;
+    // The second byte of the R2 response is skipped while waiting for the
+    // data start ID
+    if ((err = SDSendCommand(SD_CMD_SD_STATUS, 0, SD_CRC_OTHER)))
+        return err;
+    if ((err = SDReadBlock(SD_STATUS_LEN, status)))
+        return err;
+    GPIOPinSet(g_sd_curCard->cs);
+
+    g_sd_curCard->auShift =
+            g_sd_auSizeShift[status[SD_STATUS_AU_SIZE_ADDR] >> 4];
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    printf("Allocation unit: %u sectors\n", 1 << g_sd_curCard->auShift);
+#endif
+
+    return 0;
+}
+#endif
+
 uint8_t SDSendCommand (const uint8_t cmd, const uint32_t arg, const uint8_t crc) {
     uint8_t err;
 
@@ -1086,80 +2096,43 @@ uint8_t SDGetResponse (uint8_t bytes, uint8_t *dat) {
 }
 
 uint8_t SDReadBlock (uint16_t bytes, uint8_t *dat) {
-    uint8_t i, err, checksum;
-    uint32_t timeout;
-
-    // Read first byte - the R1 response
-    timeout = SD_RESPONSE_TIMEOUT + CNT;
-    do {
-        if ((err = SPIShiftIn(8, &g_sd_firstByteResponse,
-                sizeof(g_sd_firstByteResponse))))
-            return err;
+    uint8_t err;
 
-        // Check for timeout
-        if (0 < (timeout - CNT) && (timeout - CNT) < SD_WIGGLE_ROOM)
-            return SD_READ_TIMEOUT;
-    } while (0xff == g_sd_firstByteResponse);  // wait for transmission end
+    if ((err = SDReadBlockStart(dat)))
+        return err;
+    if ((err = SDReadBlockData(bytes, dat)))
+        return err;
 
-    // Ensure this response is "active"
-    if (SD_RESPONSE_ACTIVE == g_sd_firstByteResponse) {
-        // Ignore blank data again
-        timeout = SD_RESPONSE_TIMEOUT + CNT;
-        do {
-            if ((err = SPIShiftIn(8, dat, sizeof(*dat))))
-                return err;
+    return SDReadBlockEnd();
+}
 
-            // Check for timeout
-            if ((timeout - CNT) < SD_WIGGLE_ROOM)
-                return SD_READ_TIMEOUT;
-        } while (SD_DATA_START_ID != *dat);  // wait for transmission end
+uint8_t SDReadBlockData (uint16_t bytes, uint8_t *dat) {
+#if (defined SD_DEBUG)
+    uint8_t err;
+#endif
 
-        // Check for the data start identifier and continue reading data
-        if (SD_DATA_START_ID == *dat) {
-            // Read in requested data bytes
+    // Read in requested data bytes
 #if (defined SPI_FAST_SECTOR)
-            if (SD_SECTOR_SIZE == bytes) {
-                SPIShiftIn_sector(dat, 1);
-                bytes = 0;
-            }
+    if (SD_SECTOR_SIZE == bytes) {
+        SPIShiftIn_sector(dat, 1);
+        bytes = 0;
+    }
 #endif
-            while (bytes--) {
+    while (bytes--) {
 #if (defined SD_DEBUG)
-                if ((err = SPIShiftIn(8, dat++, sizeof(*dat))))
-                    return err;
+        if ((err = SPIShiftIn(8, dat++, sizeof(*dat))))
+            return err;
 #elif (defined SPI_FAST)
-                SPIShiftIn_fast(8, dat++, sizeof(*dat));
+        SPIShiftIn_fast(8, dat++, sizeof(*dat));
 #else
-                SPIShiftIn(8, dat++, SD_SPI_BYTE_IN_SZ);
+        SPIShiftIn(8, dat++, SD_SPI_BYTE_IN_SZ);
 #endif
-            }
-
-            // Read two more bytes for checksum - throw away data
-            for (i = 0; i < 2; ++i) {
-                timeout = SD_RESPONSE_TIMEOUT + CNT;
-                do {
-                    if ((err = SPIShiftIn(8, &checksum, sizeof(checksum))))
-                        return err;
-
-                    // Check for timeout
-                    if ((timeout - CNT) < SD_WIGGLE_ROOM)
-                        return SD_READ_TIMEOUT;
-                } while (0xff == checksum);  // wait for transmission end
-            }
-
-            // Send final 0xff
-            if ((err = SPIShiftOut(8, 0xff)))
-                return err;
-        } else {
-            return SD_INVALID_DAT_STRT_ID;
-        }
-    } else
-        return SD_INVALID_RESPONSE;
+    }
 
     return 0;
 }
 
-uint8_t SDWriteBlock (uint16_t bytes, uint8_t *dat) {
+uint8_t SDReadBlockStart (uint8_t *dat) {
     uint8_t err;
     uint32_t timeout;
 
@@ -1175,58 +2148,146 @@ uint8_t SDWriteBlock (uint16_t bytes, uint8_t *dat) {
             return SD_READ_TIMEOUT;
     } while (0xff == g_sd_firstByteResponse);  // wait for transmission end
 
-// Ensure this response is "active"
-    if (SD_RESPONSE_ACTIVE == g_sd_firstByteResponse) {
-        // Received "active" response
+    // Ensure this response is "active"
+    if (SD_RESPONSE_ACTIVE != g_sd_firstByteResponse)
+        return SD_INVALID_RESPONSE;
+
+    return SDReadDataToken(dat);
+}
+
+uint8_t SDReadDataToken (uint8_t *dat) {
+    uint8_t err;
+    uint32_t timeout;
 
-        // Send data Start ID
-        if ((err = SPIShiftOut(8, SD_DATA_START_ID)))
+    // Ignore blank data again
+    timeout = SD_RESPONSE_TIMEOUT + CNT;
+    do {
+        if ((err = SPIShiftIn(8, dat, sizeof(*dat))))
             return err;
 
-        // Send all bytes
-        while (bytes--) {
-#if (defined SD_DEBUG)
-            if ((err = SPIShiftOut(8, *(dat++))))
-                return err;
-#elif (defined SPI_FAST)
-            SPIShiftOut_fast(8, *(dat++));
-#else
-            SPIShiftOut(8, *(dat++));
-#endif
-        }
+        // Check for timeout
+        if ((timeout - CNT) < SD_WIGGLE_ROOM)
+            return SD_READ_TIMEOUT;
+    } while (SD_DATA_START_ID != *dat);  // wait for transmission end
 
-        // Receive and digest response token
+    // Check for the data start identifier
+    if (SD_DATA_START_ID != *dat)
+        return SD_INVALID_DAT_STRT_ID;
+
+    return 0;
+}
+
+uint8_t SDReadBlockEnd (void) {
+    uint8_t i, err, checksum;
+    uint32_t timeout;
+
+    // Read two more bytes for checksum - throw away data
+    for (i = 0; i < 2; ++i) {
         timeout = SD_RESPONSE_TIMEOUT + CNT;
         do {
-            if ((err = SPIShiftIn(8, &g_sd_firstByteResponse,
-                    sizeof(g_sd_firstByteResponse))))
+            if ((err = SPIShiftIn(8, &checksum, sizeof(checksum))))
                 return err;
 
             // Check for timeout
-            if (0 < (timeout - CNT) && (timeout - CNT) < SD_WIGGLE_ROOM)
+            if ((timeout - CNT) < SD_WIGGLE_ROOM)
                 return SD_READ_TIMEOUT;
-        } while (0xff == g_sd_firstByteResponse);  // wait for transmission end
-        if (SD_RSPNS_TKN_ACCPT
-                != (g_sd_firstByteResponse & (uint8_t) SD_RSPNS_TKN_BITS))
-            return SD_INVALID_RESPONSE;
+        } while (0xff == checksum);  // wait for transmission end
+    }
+
+    // Send final 0xff
+    return SPIShiftOut(8, 0xff);
+}
+
+#ifdef SD_MULTI_BLOCK
+uint8_t SDReadBlockCrc (void) {
+    uint8_t err, checksum;
+
+    // Inside a run of blocks the checksum is followed directly by the next
+    // block's start token, so exactly two bytes are read and no byte is
+    // skipped - a checksum byte may well be 0xff
+    if ((err = SPIShiftIn(8, &checksum, sizeof(checksum))))
+        return err;
+    return SPIShiftIn(8, &checksum, sizeof(checksum));
+}
+#endif
+
+uint8_t SDWriteBlock (uint16_t bytes, uint8_t *dat) {
+    uint8_t err;
+    uint32_t timeout;
+
+    // Read first byte - the R1 response
+    timeout = SD_RESPONSE_TIMEOUT + CNT;
+    do {
+        if ((err = SPIShiftIn(8, &g_sd_firstByteResponse,
+                sizeof(g_sd_firstByteResponse))))
+            return err;
+
+        // Check for timeout
+        if (0 < (timeout - CNT) && (timeout - CNT) < SD_WIGGLE_ROOM)
+            return SD_READ_TIMEOUT;
+    } while (0xff == g_sd_firstByteResponse);  // wait for transmission end
+
+// Ensure this response is "active"
+    if (SD_RESPONSE_ACTIVE == g_sd_firstByteResponse)
+        // Received "active" response
+        return SDWriteBlockData(SD_DATA_START_ID, bytes, dat);
+
+    return 0;
+}
+
+uint8_t SDWriteBlockData (const uint8_t token, uint16_t bytes, uint8_t *dat) {
+    uint8_t err;
+    uint32_t timeout;
+
+    // Send data Start ID
+    if ((err = SPIShiftOut(8, token)))
+        return err;
+
+    // Send all bytes
+    while (bytes--) {
+#if (defined SD_DEBUG)
+        if ((err = SPIShiftOut(8, *(dat++))))
+            return err;
+#elif (defined SPI_FAST)
+        SPIShiftOut_fast(8, *(dat++));
+#else
+        SPIShiftOut(8, *(dat++));
+#endif
     }
 
+    // Receive and digest response token
+    timeout = SD_RESPONSE_TIMEOUT + CNT;
+    do {
+        if ((err = SPIShiftIn(8, &g_sd_firstByteResponse,
+                sizeof(g_sd_firstByteResponse))))
+            return err;
+
+        // Check for timeout
+        if (0 < (timeout - CNT) && (timeout - CNT) < SD_WIGGLE_ROOM)
+            return SD_READ_TIMEOUT;
+    } while (0xff == g_sd_firstByteResponse);  // wait for transmission end
+    if (SD_RSPNS_TKN_ACCPT
+            != (g_sd_firstByteResponse & (uint8_t) SD_RSPNS_TKN_BITS))
+        return SD_INVALID_RESPONSE;
+
     return 0;
 }
 
-uint8_t SDReadDataBlock (uint32_t address, uint8_t *dat) {
+uint8_t SDCardRead (sd_block_dev *dev, uint32_t address, uint8_t *dat) {
     uint8_t err;
-    uint8_t temp = 0;
+
+    if ((err = SDSelectCard(dev)))
+        return err;
 
     // Wait until the SD card is no longer busy
-    while (!temp)
-        SPIShiftIn(8, &temp, 1);
+    if ((err = SDWaitWhileBusy()))
+        return err;
 
 #if (defined SD_DEBUG && defined SD_VERBOSE)
     printf("Reading block at sector address: 0x%08X / %u\n", address, address);
 #endif
 
-    GPIOPinClear(g_sd_cs);
+    GPIOPinClear(g_sd_curCard->cs);
     if ((err = SDSendCommand(SD_CMD_RD_BLOCK, address,
     SD_CRC_OTHER)))
         return err;
@@ -1237,178 +2298,706 @@ uint8_t SDReadDataBlock (uint32_t address, uint8_t *dat) {
 #endif
         return err;
     }
-    GPIOPinSet(g_sd_cs);
+    GPIOPinSet(g_sd_curCard->cs);
 
     return 0;
 }
 
-uint8_t SDWriteDataBlock (uint32_t address, uint8_t *dat) {
+uint8_t SDCardWrite (sd_block_dev *dev, uint32_t address, uint8_t *dat) {
     uint8_t err;
-    uint8_t temp = 0;
+
+    if ((err = SDSelectCard(dev)))
+        return err;
 
     // Wait until the SD card is no longer busy
-    while (!temp)
-        SPIShiftIn(8, &temp, 1);
+    if ((err = SDWaitWhileBusy()))
+        return err;
 
 #if (defined SD_DEBUG && defined SD_VERBOSE)
     printf("Writing block at address: 0x%08X / %u\n", address, address);
 #endif
 
-    GPIOPinClear(g_sd_cs);
+    GPIOPinClear(g_sd_curCard->cs);
     if ((err = SDSendCommand(SD_CMD_WR_BLOCK, address,
     SD_CRC_OTHER)))
         return err;
 
     if ((err = SDWriteBlock(SD_SECTOR_SIZE, dat)))
         return err;
-    GPIOPinSet(g_sd_cs);
+    GPIOPinSet(g_sd_curCard->cs);
+
+    // The card now programs the sector; that is left for the next access to
+    // wait on so the caller may carry on in the meantime
+    g_sd_curCard->busy = SD_BUSY_PROGRAMMING;
 
     return 0;
 }
 
-uint16_t SDReadDat16 (const uint8_t buf[]) {
-    return (buf[1] << 8) + buf[0];
+#ifdef SD_MULTI_BLOCK
+uint8_t SDCardReadMulti (sd_block_dev *dev, uint32_t address, uint32_t count,
+        uint8_t *dat) {
+    uint8_t err;
+
+    if ((err = SDSelectCard(dev)))
+        return err;
+
+    // Wait until the SD card is no longer busy
+    if ((err = SDWaitWhileBusy()))
+        return err;
+
+#if (defined SD_DEBUG && defined SD_VERBOSE)
+    printf("Reading %u blocks at sector address: 0x%08X / %u\n", count,
+            address, address);
+#endif
+
+    GPIOPinClear(g_sd_curCard->cs);
+    if ((err = SDSendCommand(SD_CMD_RD_MULTI, address, SD_CRC_OTHER)))
+        return err;
+
+    // Only the first block is preceded by an R1 response; the card sends the
+    // following ones until it is told to stop
+    if ((err = SDReadBlockStart(dat)))
+        return err;
+    while (count--) {
+        if ((err = SDReadBlockData(SD_SECTOR_SIZE, dat))
+                || (err = SDReadBlockCrc())) {
+#ifdef SD_DEBUG
+            g_sd_sectorRdAddress = address;
+#endif
+            return err;
+        }
+        dat += SD_SECTOR_SIZE;
+        ++address;
+        if (count)
+            if ((err = SDReadDataToken(dat)))
+                return err;
+    }
+
+    // Whatever the card has begun sending of the next block is discarded
+    if ((err = SDSendCommand(SD_CMD_STOP_TRANS, 0, SD_CRC_OTHER)))
+        return err;
+    if ((err = SPIShiftIn(8, &g_sd_firstByteResponse,
+            sizeof(g_sd_firstByteResponse))))
+        return err;
+    if ((err = SDGetResponse(SD_RESPONSE_LEN_R1, &g_sd_firstByteResponse)))
+        return err;
+    GPIOPinSet(g_sd_curCard->cs);
+
+    // CMD12 may be followed by a short busy period; like a write, it is left
+    // for the next access
+    g_sd_curCard->busy = SD_BUSY_PROGRAMMING;
+
+    return 0;
 }
 
-uint32_t SDReadDat32 (const uint8_t buf[]) {
-    return (buf[3] << 24) + (buf[2] << 16) + (buf[1] << 8) + buf[0];
+#if (defined SD_FILE_WRITE || defined SD_RAW_BLOCKS)
+uint8_t SDCardWriteMulti (sd_block_dev *dev, uint32_t address, uint32_t count,
+        uint8_t *dat) {
+    uint8_t err;
+
+    if ((err = SDSelectCard(dev)))
+        return err;
+
+    // Wait until the SD card is no longer busy
+    if ((err = SDWaitWhileBusy()))
+        return err;
+
+#if (defined SD_DEBUG && defined SD_VERBOSE)
+    printf("Writing %u blocks at address: 0x%08X / %u\n", count, address,
+            address);
+#endif
+
+    GPIOPinClear(g_sd_curCard->cs);
+    if ((err = SDSendCommand(SD_CMD_WR_MULTI, address, SD_CRC_OTHER)))
+        return err;
+    if ((err = SDGetResponse(SD_RESPONSE_LEN_R1, &g_sd_firstByteResponse)))
+        return err;
+
+    // The card stays selected while it programs each block, so that the
+    // transfer is not ended
+    while (count--) {
+        if ((err = SDWriteBlockData(SD_DATA_MULTI_ID, SD_SECTOR_SIZE, dat)))
+            return err;
+        if ((err = SDPollWhileBusy(SD_PROGRAM_TIMEOUT)))
+            return err;
+        dat += SD_SECTOR_SIZE;
+    }
+
+    // End the transfer; the card is busy again one byte later
+    if ((err = SPIShiftOut(8, SD_STOP_TRAN_ID)))
+        return err;
+    if ((err = SPIShiftIn(8, &g_sd_firstByteResponse,
+            sizeof(g_sd_firstByteResponse))))
+        return err;
+    GPIOPinSet(g_sd_curCard->cs);
+
+    g_sd_curCard->busy = SD_BUSY_PROGRAMMING;
+
+    return 0;
 }
+#endif
+#endif
 
-#ifdef SD_FILE_WRITE
-void SDWriteDat16 (uint8_t buf[], const uint16_t dat) {
-    buf[1] = (uint8_t) (dat >> 8);
-    buf[0] = (uint8_t) dat;
+#if (defined SD_ERASE_FREED || defined SD_RAW_BLOCKS)
+uint8_t SDCardErase (sd_block_dev *dev, const uint32_t address,
+        const uint32_t count) {
+    uint8_t err;
+
+    if (!count)
+        return 0;
+
+    if ((err = SDSelectCard(dev)))
+        return err;
+    if ((err = SDWaitWhileBusy()))
+        return err;
+
+#if (defined SD_DEBUG && defined SD_VERBOSE)
+    printf("Erasing %u sectors from address: 0x%08X / %u\n", count, address,
+            address);
+#endif
+
+    // A card that refuses the range must not be counted as erased
+    GPIOPinClear(g_sd_curCard->cs);
+    err = SDSendEraseCommand(SD_CMD_ERASE_START, address);
+    if (!err)
+        err = SDSendEraseCommand(SD_CMD_ERASE_END, address + count - 1);
+    if (!err)
+        err = SDSendEraseCommand(SD_CMD_ERASE, 0);
+    GPIOPinSet(g_sd_curCard->cs);
+    if (err)
+        return err;
+
+    g_sd_curCard->busy = SD_BUSY_ERASING;
+
+    return 0;
 }
 
-void SDWriteDat32 (uint8_t buf[], const uint32_t dat) {
-    buf[3] = (uint8_t) (dat >> 24);
-    buf[2] = (uint8_t) (dat >> 16);
-    buf[1] = (uint8_t) (dat >> 8);
-    buf[0] = (uint8_t) dat;
+uint8_t SDSendEraseCommand (const uint8_t cmd, const uint32_t arg) {
+    uint8_t err;
+
+    if ((err = SDSendCommand(cmd, arg, SD_CRC_OTHER)))
+        return err;
+    if ((err = SDGetResponse(SD_RESPONSE_LEN_R1, &g_sd_firstByteResponse)))
+        return err;
+
+    // An idle card or one with an error bit set did not accept the command
+    if (SD_RESPONSE_ACTIVE != g_sd_firstByteResponse)
+        return SD_INVALID_RESPONSE;
+
+    return 0;
 }
 #endif
 
-uint32_t SDGetSectorFromPath (const char *path) {
-    // TODO: Return an actual path
+uint8_t SDCardSync (sd_block_dev *dev) {
+    uint8_t err;
+
+    if ((err = SDSelectCard(dev)))
+        return err;
+
+    // Everything written has been programmed once the card is no longer busy
+    return SDWaitWhileBusy();
+}
+
+uint8_t SDSelectCard (sd_block_dev *dev) {
+#ifdef SD_READ_AHEAD
+    uint8_t err;
 
-    /*if ('/' == path[0]) {
-     } // Start from the root address
-     else {
-     } // Start from the current directory*/
+    // The SPI cog may still be receiving a sector read ahead, whichever card
+    // it comes from
+    if ((err = SDFinishReadDataBlock()))
+        return err;
+#endif
 
-    return g_sd_rootAddr;
+    g_sd_curCard = (sd_card *) dev->priv;
+    return 0;
 }
+#endif
 
-uint32_t SDGetSectorFromAlloc (uint32_t allocUnit) {
-    if (SD_FAT_32 == g_sd_filesystem)
-        allocUnit -= g_sd_rootAllocUnit;
-    else
-        allocUnit -= 2;
-    allocUnit <<= g_sd_sectorsPerCluster_shift;
-    allocUnit += g_sd_firstDataAddr;
-    return allocUnit;
+uint8_t SDReadDataBlock (uint32_t address, uint8_t *dat) {
+    return g_sd_vol->dev->ops->read(g_sd_vol->dev, address, dat);
 }
 
-uint8_t SDGetFATValue (const uint32_t fatEntry, uint32_t *value) {
+uint8_t SDWriteDataBlock (uint32_t address, uint8_t *dat) {
+    return g_sd_vol->dev->ops->write(g_sd_vol->dev, address, dat);
+}
+
+#if (defined SD_MULTI_BLOCK || defined SD_RAW_BLOCKS)
+uint8_t SDReadDataBlocks (uint32_t address, uint32_t count, uint8_t *dat) {
     uint8_t err;
-    uint32_t firstAvailableAllocUnit;
 
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-    printf("Reading from the FAT...\n");
-    printf("\tLooking for entry: 0x%08X / %u\n", fatEntry, fatEntry);
+    // A device without multi-block transfers is given one block at a time
+    if (1 == count || NULL == g_sd_vol->dev->ops->readMulti) {
+        while (count--) {
+            if ((err = g_sd_vol->dev->ops->read(g_sd_vol->dev, address++, dat)))
+                return err;
+            dat += SD_SECTOR_SIZE;
+        }
+        return 0;
+    }
+
+    return g_sd_vol->dev->ops->readMulti(g_sd_vol->dev, address, count, dat);
+}
 #endif
 
-    // Do we need to load a new fat sector?
-    if ((fatEntry >> g_sd_entriesPerFatSector_Shift) != g_sd_curFatSector) {
-#ifdef SD_FILE_WRITE
-        // If the currently loaded FAT sector has been modified, save it
-        if (g_sd_fatMod) {
-            SDWriteDataBlock(g_sd_curFatSector + g_sd_fatStart, g_sd_fat);
-            SDWriteDataBlock(g_sd_curFatSector + g_sd_fatStart + g_sd_fatSize,
-                    g_sd_fat);
-            g_sd_fatMod = 0;
+#if ((defined SD_MULTI_BLOCK && defined SD_FILE_WRITE) || defined SD_RAW_BLOCKS)
+uint8_t SDWriteDataBlocks (uint32_t address, uint32_t count, uint8_t *dat) {
+    uint8_t err;
+
+    if (1 == count || NULL == g_sd_vol->dev->ops->writeMulti) {
+        while (count--) {
+            if ((err = g_sd_vol->dev->ops->write(g_sd_vol->dev, address++,
+                    dat)))
+                return err;
+            dat += SD_SECTOR_SIZE;
         }
-#endif
-        // Need new sector, load it
-        g_sd_curFatSector = fatEntry >> g_sd_entriesPerFatSector_Shift;
-        if ((err = SDReadDataBlock(g_sd_curFatSector + g_sd_fatStart, g_sd_fat)))
-            return err;
-#if (defined SD_VERBOSE_BLOCKS && defined SD_VERBOSE && defined SD_DEBUG)
-        SDPrintHexBlock(g_sd_fat, SD_SECTOR_SIZE);
-#endif
+        return 0;
     }
-    firstAvailableAllocUnit = g_sd_curFatSector
-            << g_sd_entriesPerFatSector_Shift;
 
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-    printf("\tLooks like I need FAT sector: 0x%08X / %u\n", g_sd_curFatSector,
-            g_sd_curFatSector);
-    printf("\tWith an offset of: 0x%04X / %u\n",
-            (fatEntry - firstAvailableAllocUnit) << 2,
-            (fatEntry - firstAvailableAllocUnit) << 2);
+    return g_sd_vol->dev->ops->writeMulti(g_sd_vol->dev, address, count, dat);
+}
 #endif
 
-    // The necessary FAT sector has been loaded and the next allocation unit is
-    // known, proceed with loading the next data sector and incrementing the
-    // cluster variables
+#if (defined SD_ERASE_FREED || defined SD_RAW_BLOCKS)
+uint8_t SDEraseDataBlocks (const uint32_t address, const uint32_t count) {
+    // Erasing only speeds up later writes; a device that can not erase keeps
+    // the old data
+    if (NULL == g_sd_vol->dev->ops->erase)
+        return 0;
 
-    // Retrieve the next allocation unit number
-    if (SD_FAT_16 == g_sd_filesystem)
-        *value = SDReadDat16(
-                &g_sd_fat[(fatEntry - firstAvailableAllocUnit) << 1]);
-    else
-        /* Implied check for (SD_FAT_32 == g_sd_filesystem) */
-        *value = SDReadDat32(
-                &g_sd_fat[(fatEntry - firstAvailableAllocUnit) << 2]);
-    // Clear the highest 4 bits - they are always reserved
-    *value &= 0x0FFFFFFF;  
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-    printf("\tReceived value: 0x%08X / %u\n", *value, *value);
+    return g_sd_vol->dev->ops->erase(g_sd_vol->dev, address, count);
+}
 #endif
 
+uint8_t SDSyncDevice (void) {
+    if (NULL == g_sd_vol->dev->ops->sync)
+        return 0;
+
+    return g_sd_vol->dev->ops->sync(g_sd_vol->dev);
+}
+
+#ifdef SD_BLOCK_FILE
+uint8_t SDFileRead (sd_block_dev *dev, uint32_t address, uint8_t *dat) {
+    return SDFileReadMulti(dev, address, 1, dat);
+}
+
+uint8_t SDFileWrite (sd_block_dev *dev, uint32_t address, uint8_t *dat) {
+    return SDFileWriteMulti(dev, address, 1, dat);
+}
+
+uint8_t SDFileReadMulti (sd_block_dev *dev, uint32_t address, uint32_t count,
+        uint8_t *dat) {
+    FILE *image = (FILE *) dev->priv;
+
+    // fseek() takes a long; a sector past its reach can not be addressed
+    if (address > LONG_MAX / SD_SECTOR_SIZE
+            || fseek(image, (long) address * SD_SECTOR_SIZE, SEEK_SET)
+            || count != fread(dat, SD_SECTOR_SIZE, count, image))
+        return SD_DEVICE_ERROR;
+
     return 0;
 }
 
-uint8_t SDLoadNextSector (sd_buffer *buf) {
-#ifdef SD_FILE_WRITE
-    if (buf->mod)
-        SDWriteDataBlock(buf->curClusterStartAddr + buf->curSectorOffset,
-                buf->buf);
+uint8_t SDFileWriteMulti (sd_block_dev *dev, uint32_t address, uint32_t count,
+        uint8_t *dat) {
+    FILE *image = (FILE *) dev->priv;
+
+    if (address > LONG_MAX / SD_SECTOR_SIZE
+            || fseek(image, (long) address * SD_SECTOR_SIZE, SEEK_SET)
+            || count != fwrite(dat, SD_SECTOR_SIZE, count, image))
+        return SD_DEVICE_ERROR;
+
+    return 0;
+}
+
+uint8_t SDFileSync (sd_block_dev *dev) {
+    return fflush((FILE *) dev->priv) ? SD_DEVICE_ERROR : 0;
+}
 #endif
 
-    // Check for the end-of-chain marker (end of file)
-    if (((uint32_t) SD_EOC_BEG) <= buf->nextAllocUnit)
-        return SD_EOC_END;
+#ifdef SD_RAM_DISK
+uint8_t SDRamReadMulti (sd_block_dev *dev, uint32_t address, uint32_t count,
+        uint8_t *dat) {
+    const sd_ram_disk *disk = (const sd_ram_disk *) dev->priv;
 
-    // Are we looking at the root directory of a FAT16 system?
-    if (SD_FAT_16 == g_sd_filesystem
-            && g_sd_rootAddr == (buf->curClusterStartAddr)) {
-        // Root dir of FAT16; Is it the last sector in the root directory?
-        if (g_sd_rootDirSectors == (buf->curSectorOffset))
-            return SD_EOC_END;
-        // Root dir of FAT16; Not last sector
-        else
-            // Any error from reading the data block will be returned to calling
-            // function
-            return SDReadDataBlock(++(buf->curSectorOffset), buf->buf);
-    }
-    // We are looking at a generic data cluster.
-    else {
-        // Gen. data cluster; Have we reached the end of the cluster?
-        if (((1 << g_sd_sectorsPerCluster_shift) - 1)
-                > (buf->curSectorOffset)) {
-            // Gen. data cluster; Not the end; Load next sector in the cluster
+    if (address >= disk->sectors || count > disk->sectors - address)
+        return SD_DEVICE_ERROR;
+    memcpy(dat, disk->mem + (address << SD_SECTOR_SIZE_SHIFT),
+            count << SD_SECTOR_SIZE_SHIFT);
 
-            // Any error from reading the data block will be returned to
-            // calling function
-            return SDReadDataBlock(
-                    ++(buf->curSectorOffset) + buf->curClusterStartAddr,
-                    buf->buf);
-        }
-        // End of generic data cluster; Look through the FAT to find the next cluster
-        else
-            return SDIncCluster(buf);
-    }
+    return 0;
+}
+
+uint8_t SDRamWriteMulti (sd_block_dev *dev, uint32_t address, uint32_t count,
+        uint8_t *dat) {
+    const sd_ram_disk *disk = (const sd_ram_disk *) dev->priv;
+
+    if (address >= disk->sectors || count > disk->sectors - address)
+        return SD_DEVICE_ERROR;
+    memcpy(disk->mem + (address << SD_SECTOR_SIZE_SHIFT), dat,
+            count << SD_SECTOR_SIZE_SHIFT);
+
+    return 0;
+}
+
+uint8_t SDRamRead (sd_block_dev *dev, uint32_t address, uint8_t *dat) {
+    return SDRamReadMulti(dev, address, 1, dat);
+}
+
+uint8_t SDRamWrite (sd_block_dev *dev, uint32_t address, uint8_t *dat) {
+    return SDRamWriteMulti(dev, address, 1, dat);
+}
+#endif
+
+#ifdef SD_CARD
+uint8_t SDWaitWhileBusy (void) {
+    uint8_t err;
+
+    if (!g_sd_curCard->busy)
+        return 0;
+
+    // A card only signals busy while it is selected
+    GPIOPinClear(g_sd_curCard->cs);
+    err = SDPollWhileBusy((SD_BUSY_ERASING == g_sd_curCard->busy) ?
+            SD_ERASE_TIMEOUT : SD_PROGRAM_TIMEOUT);
+    // Deselected even on a timeout; the card stays marked busy, so the next
+    // access selects it afresh and waits again
+    GPIOPinSet(g_sd_curCard->cs);
+    if (err)
+        return err;
+
+    g_sd_curCard->busy = 0;
+    return 0;
+}
+
+uint8_t SDPollWhileBusy (const uint32_t wait) {
+    uint8_t err;
+    uint8_t temp = 0;
+    const uint32_t timeout = wait + CNT;
+
+    do {
+        if ((err = SPIShiftIn(8, &temp, sizeof(temp))))
+            return err;
+
+        // Check for timeout
+        if (0 < (timeout - CNT) && (timeout - CNT) < SD_WIGGLE_ROOM)
+            return SD_BUSY_TIMEOUT;
+    } while (!temp);
+
+    return 0;
+}
+#endif
+
+#ifdef SD_READ_AHEAD
+uint8_t SDStartReadDataBlock (uint32_t address, uint8_t *dat) {
+    uint8_t err;
+
+    // Only an SD card receives sectors in the background
+    if (&g_sd_cardOps != g_sd_vol->dev->ops)
+        return SDReadDataBlock(address, dat);
+
+    if ((err = SDSelectCard(g_sd_vol->dev)))
+        return err;
+
+    // Wait until the SD card is no longer busy
+    if ((err = SDWaitWhileBusy()))
+        return err;
+
+    GPIOPinClear(g_sd_curCard->cs);
+    if ((err = SDSendCommand(SD_CMD_RD_BLOCK, address, SD_CRC_OTHER)))
+        return err;
+    if ((err = SDReadBlockStart(dat)))
+        return err;
+
+    // Leave the SPI cog to receive the data
+    SPIShiftIn_sector(dat, 0);
+    g_sd_readPending = 1;
+
+    return 0;
+}
+
+uint8_t SDFinishReadDataBlock (void) {
+    uint8_t err;
+
+    if (g_sd_readPending) {
+        g_sd_readPending = 0;
+        if ((err = SPIWait()))
+            return err;
+        if ((err = SDReadBlockEnd()))
+            return err;
+        GPIOPinSet(g_sd_curCard->cs);
+    }
+
+    return 0;
+}
+#endif
+
+uint16_t SDReadDat16 (const uint8_t buf[]) {
+    return (buf[1] << 8) + buf[0];
+}
+
+uint32_t SDReadDat32 (const uint8_t buf[]) {
+    return (buf[3] << 24) + (buf[2] << 16) + (buf[1] << 8) + buf[0];
+}
+
+#if (defined SD_FILE_WRITE || defined SD_RING_LOG)
+void SDWriteDat16 (uint8_t buf[], const uint16_t dat) {
+    buf[1] = (uint8_t) (dat >> 8);
+    buf[0] = (uint8_t) dat;
+}
+
+void SDWriteDat32 (uint8_t buf[], const uint32_t dat) {
+    buf[3] = (uint8_t) (dat >> 24);
+    buf[2] = (uint8_t) (dat >> 16);
+    buf[1] = (uint8_t) (dat >> 8);
+    buf[0] = (uint8_t) dat;
+}
+#endif
+
+uint8_t SDWalkPath (const char *path, const char **name) {
+    uint8_t err, i;
+    char dirName[SD_FILENAME_STR_LEN];
+
+    // Absolute paths begin at the root directory
+    if ('/' == *path) {
+        g_sd_vol->dir_firstAllocUnit = g_sd_vol->rootAllocUnit;
+        ++path;
+    }
+
+    while (*path) {
+        // Measure the next component; no 8.3 name is as long as dirName, and
+        // stopping there keeps i from wrapping on a very long component
+        for (i = 0; path[i] && '/' != path[i]; ++i)
+            if (SD_FILENAME_STR_LEN <= i)
+                return SD_INVALID_FILENAME;
+
+        // The final component is left for the caller when requested
+        if (NULL != name && !path[i])
+            break;
+
+        // Empty components ("foo//bar" or "foo/") are skipped
+        if (i) {
+            memcpy(dirName, path, i);
+            dirName[i] = 0;
+            if ((err = SDEnterDir(dirName)))
+                return err;
+        }
+
+        path += i;
+        if ('/' == *path)
+            ++path;
+    }
+
+    if (NULL != name)
+        *name = path;
+
+    return 0;
+}
+
+uint8_t SDEnterDir (const char *d) {
+    uint8_t err;
+    uint16_t fileEntryOffset;
+    uint32_t allocUnit;
+#ifdef SD_PATH_CACHE
+    uint32_t rawName[SD_SHORT_NAME_WORDS];
+#endif
+
+    // "." stays put, and so does ".." in the root directory, which has
+    // neither entry
+    if ('.' == d[0] && (!d[1] || ('.' == d[1] && !d[2]
+            && g_sd_vol->dir_firstAllocUnit == g_sd_vol->rootAllocUnit)))
+        return 0;
+
+#ifdef SD_PATH_CACHE
+    if ((err = SDNormalizeName(d, (char *) rawName)))
+        return err;
+    if (SDPathCacheLookup(rawName, &allocUnit)) {
+        g_sd_vol->dir_firstAllocUnit = allocUnit;
+        return 0;
+    }
+#endif
+
+    if ((err = SDFind(d, &fileEntryOffset)))
+        return err;
+    if (!(SD_SUB_DIR
+            & g_sd_vol->buf->buf[fileEntryOffset + SD_FILE_ATTRIBUTE_OFFSET]))
+        return SD_ENTRY_NOT_DIR;
+
+    allocUnit = SDReadDat16(
+            &(g_sd_vol->buf->buf[fileEntryOffset + SD_FILE_START_CLSTR_LOW]));
+    if (SD_FAT_32 == g_sd_vol->filesystem) {
+        allocUnit |= SDReadDat16(
+                &(g_sd_vol->buf->buf[fileEntryOffset
+                        + SD_FILE_START_CLSTR_HIGH]))
+                << 16;
+        // Clear the highest 4 bits - they are always reserved
+        allocUnit &= 0x0FFFFFFF;
+    }
+    // ".." entries of first-level directories point to cluster 0
+    if (0 == allocUnit)
+        allocUnit = g_sd_vol->rootAllocUnit;
+
+#ifdef SD_PATH_CACHE
+    SDPathCacheInsert(rawName, allocUnit);
+#endif
+    g_sd_vol->dir_firstAllocUnit = allocUnit;
+
+    return 0;
+}
+
+#ifdef SD_PATH_CACHE
+uint8_t SDPathCacheLookup (const uint32_t rawName[], uint32_t *allocUnit) {
+    uint8_t i;
+
+    for (i = 0; i < SD_PATH_CACHE_SIZE; ++i)
+        if (g_sd_vol->pathCache[i].child
+                && g_sd_vol->dir_firstAllocUnit == g_sd_vol->pathCache[i].parent
+                && SDNameMatches((uint8_t *) g_sd_vol->pathCache[i].rawName,
+                        rawName)) {
+            *allocUnit = g_sd_vol->pathCache[i].child;
+            return 1;
+        }
+
+    return 0;
+}
+
+void SDPathCacheInsert (const uint32_t rawName[], const uint32_t allocUnit) {
+    sd_path_cache_entry *entry =
+            &(g_sd_vol->pathCache[g_sd_vol->pathCacheNext]);
+
+    entry->parent = g_sd_vol->dir_firstAllocUnit;
+    entry->child = allocUnit;
+    memcpy(entry->rawName, rawName, sizeof(entry->rawName));
+    g_sd_vol->pathCacheNext = (g_sd_vol->pathCacheNext + 1)
+            % SD_PATH_CACHE_SIZE;
+}
+#endif
+
+uint32_t SDGetSectorFromAlloc (uint32_t allocUnit) {
+    // The root directory of FAT16 lives outside of the data region
+    if ((uint32_t) -1 == allocUnit)
+        return g_sd_vol->rootAddr;
+
+    if (SD_FAT_32 == g_sd_vol->filesystem)
+        allocUnit -= g_sd_vol->rootAllocUnit;
+    else
+        allocUnit -= 2;
+    allocUnit <<= g_sd_vol->sectorsPerCluster_shift;
+    allocUnit += g_sd_vol->firstDataAddr;
+    return allocUnit;
+}
+
+uint8_t SDGetFATValue (const uint32_t fatEntry, uint32_t *value) {
+    uint8_t err;
+    uint32_t firstAvailableAllocUnit;
+
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    printf("Reading from the FAT...\n");
+    printf("\tLooking for entry: 0x%08X / %u\n", fatEntry, fatEntry);
+#endif
+
+    // The root directory of FAT16 is not part of any chain
+    if ((uint32_t) -1 == fatEntry) {
+        *value = (uint32_t) SD_EOC_END;
+        return 0;
+    }
+
+    // Do we need to load a new fat sector?
+    if ((fatEntry >> g_sd_vol->entriesPerFatSector_Shift)
+            != g_sd_vol->curFatSector) {
+#ifdef SD_FILE_WRITE
+        // If the currently loaded FAT sector has been modified, save it
+        if (g_sd_vol->fatMod)
+            if ((err = SDWriteFATSector(g_sd_vol->curFatSector)))
+                return err;
+#endif
+        // Need new sector, load it
+        g_sd_vol->curFatSector = fatEntry
+                >> g_sd_vol->entriesPerFatSector_Shift;
+        if ((err = SDReadDataBlock(g_sd_vol->curFatSector + g_sd_vol->fatStart,
+                g_sd_vol->fat)))
+            return err;
+#if (defined SD_VERBOSE_BLOCKS && defined SD_VERBOSE && defined SD_DEBUG)
+        SDPrintHexBlock(g_sd_vol->fat, SD_SECTOR_SIZE);
+#endif
+    }
+    firstAvailableAllocUnit = g_sd_vol->curFatSector
+            << g_sd_vol->entriesPerFatSector_Shift;
+
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    printf("\tLooks like I need FAT sector: 0x%08X / %u\n",
+            g_sd_vol->curFatSector, g_sd_vol->curFatSector);
+    printf("\tWith an offset of: 0x%04X / %u\n",
+            (fatEntry - firstAvailableAllocUnit) << 2,
+            (fatEntry - firstAvailableAllocUnit) << 2);
+#endif
+
+    // The necessary FAT sector has been loaded and the next allocation unit is
+    // known, proceed with loading the next data sector and incrementing the
+    // cluster variables
+
+    // Retrieve the next allocation unit number
+    if (SD_FAT_16 == g_sd_vol->filesystem)
+        *value = SDReadDat16(
+                &g_sd_vol->fat[(fatEntry - firstAvailableAllocUnit) << 1]);
+    else
+        /* Implied check for (SD_FAT_32 == g_sd_vol->filesystem) */
+        *value = SDReadDat32(
+                &g_sd_vol->fat[(fatEntry - firstAvailableAllocUnit) << 2]);
+    // Clear the highest 4 bits - they are always reserved
+    *value &= 0x0FFFFFFF;
+    // Report end-of-chain the same way for both filesystems so that it can be
+    // compared against SD_EOC_BEG
+    if (SD_FAT_16 == g_sd_vol->filesystem) {
+        if (SD_FAT16_EOC_BEG <= *value)
+            *value = (uint32_t) SD_EOC_END;
+    } else if (SD_FAT32_EOC_BEG <= *value)
+        *value = (uint32_t) SD_EOC_END;
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    printf("\tReceived value: 0x%08X / %u\n", *value, *value);
+#endif
+
+    return 0;
+}
+
+uint8_t SDLoadNextSector (sd_buffer *buf) {
+#ifdef SD_FILE_WRITE
+    if (buf->mod)
+        SDWriteDataBlock(buf->curClusterStartAddr + buf->curSectorOffset,
+                buf->buf);
+#endif
+
+    // Are we looking at the root directory of a FAT16 system?
+    if (SD_FAT_16 == g_sd_vol->filesystem
+            && g_sd_vol->rootAddr == (buf->curClusterStartAddr)) {
+        // Root dir of FAT16; Is it the last sector in the root directory?
+        if ((g_sd_vol->rootDirSectors - 1) <= (buf->curSectorOffset))
+            return SD_EOC_END;
+        // Root dir of FAT16; Not last sector
+        else
+            // Any error from reading the data block will be returned to calling
+            // function
+            return SDReadDataBlock(
+                    g_sd_vol->rootAddr + ++(buf->curSectorOffset), buf->buf);
+    }
+
+    // We are looking at a generic data cluster.
+    // Gen. data cluster; Have we reached the end of the cluster?
+    if (((1 << g_sd_vol->sectorsPerCluster_shift) - 1)
+            > (buf->curSectorOffset)) {
+        // Gen. data cluster; Not the end; Load next sector in the cluster
+
+        // Any error from reading the data block will be returned to
+        // calling function
+        return SDReadDataBlock(
+                ++(buf->curSectorOffset) + buf->curClusterStartAddr,
+                buf->buf);
+    }
+    // End of the last cluster; check for the end-of-chain marker (end of file)
+    else if (((uint32_t) SD_EOC_BEG) <= buf->nextAllocUnit)
+        return SD_EOC_END;
+    // End of generic data cluster; Look through the FAT to find the next cluster
+    else
+        return SDIncCluster(buf);
 
 #if (defined SD_VERBOSE_BLOCKS && defined SD_VERBOSE && defined SD_DEBUG)
     printf("New sector loaded:\n");
@@ -1419,311 +3008,1310 @@ uint8_t SDLoadNextSector (sd_buffer *buf) {
     return 0;
 }
 
-uint8_t SDLoadSectorFromOffset (sd_file *f, const uint32_t offset) {
+uint8_t SDLoadSectorFromOffset (sd_file *f, const uint32_t offset) {
+    uint8_t err;
+
+#ifdef SD_FILE_WRITE
+    // If the buffer has been modified, write it before loading the next sector
+    if ((err = SDWriteBackBuf(f->buf)))
+        return err;
+#endif
+
+#ifdef SD_READ_AHEAD
+    if (SDTakeReadAhead(f, offset))
+        return SDFinishReadDataBlock();
+#endif
+
+    // Find the correct cluster
+    if ((err = SDFindClusterFromOffset(f, offset)))
+        return err;
+
+    // Followed by finding the correct sector
+    f->buf->curSectorOffset = offset % (1 << g_sd_vol->sectorsPerCluster_shift);
+    f->curSector = offset;
+#ifdef SD_BUFFER_POOL
+    SDTouchBuf(f->buf);
+#endif
+    return SDReadDataBlock(f->buf->curClusterStartAddr + f->buf->curSectorOffset,
+            f->buf->buf);
+}
+
+uint8_t SDFindClusterFromOffset (sd_file *f, const uint32_t offset) {
+    uint8_t err;
+    uint32_t clusterOffset = offset >> g_sd_vol->sectorsPerCluster_shift;
+#ifdef SD_FILE_WRITE
+    const uint32_t lastCluster = (f->maxSectors
+            >> g_sd_vol->sectorsPerCluster_shift) - 1;
+    uint32_t nextAllocUnit;
+
+    // Jump straight to the last cluster when it is known and still ends the
+    // chain; otherwise forget it and walk
+    if (f->tailAllocUnit && lastCluster == clusterOffset
+            && f->curCluster != clusterOffset) {
+        if ((err = SDGetFATValue(f->tailAllocUnit, &nextAllocUnit)))
+            return err;
+        if (((uint32_t) SD_EOC_BEG) <= nextAllocUnit) {
+            f->curCluster = clusterOffset;
+            f->buf->curAllocUnit = f->tailAllocUnit;
+            f->buf->nextAllocUnit = nextAllocUnit;
+            f->buf->curClusterStartAddr = SDGetSectorFromAlloc(
+                    f->tailAllocUnit);
+#ifdef SD_SEEK_CHECKPOINTS
+            SDCheckpointRecord(f);
+#endif
+            return 0;
+        }
+        f->tailAllocUnit = 0;
+    }
+#endif
+
+#ifdef SD_SEEK_CHECKPOINTS
+    // Start from the closest checkpoint when it beats the current cluster
+    if ((err = SDCheckpointSeek(f, clusterOffset)))
+        return err;
+#endif
+
+    if (f->curCluster < clusterOffset) {
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+        printf("Need to fast-forward through the FAT to find the cluster\n");
+#endif
+        // Desired cluster comes after the currently loaded one - this is easy
+        // and requires continuing to look forward through the FAT from the
+        // current position
+        clusterOffset -= f->curCluster;
+        while (clusterOffset--) {
+            ++(f->curCluster);
+            f->buf->curAllocUnit = f->buf->nextAllocUnit;
+            if ((err = SDGetFATValue(f->buf->curAllocUnit,
+                    &(f->buf->nextAllocUnit))))
+                return err;
+#ifdef SD_SEEK_CHECKPOINTS
+            SDCheckpointRecord(f);
+#endif
+        }
+        f->buf->curClusterStartAddr = SDGetSectorFromAlloc(
+                f->buf->curAllocUnit);
+    } else if (f->curCluster > clusterOffset) {
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+        printf("Need to backtrack through the FAT to find the cluster\n");
+#endif
+        // Desired cluster is an earlier cluster than the currently loaded one -
+        // this requires starting from the beginning and working forward
+        f->buf->curAllocUnit = f->firstAllocUnit;
+        if ((err = SDGetFATValue(f->buf->curAllocUnit, &(f->buf->nextAllocUnit))))
+            return err;
+        f->curCluster = 0;
+        while (clusterOffset--) {
+            ++(f->curCluster);
+            f->buf->curAllocUnit = f->buf->nextAllocUnit;
+            if ((err = SDGetFATValue(f->buf->curAllocUnit,
+                    &(f->buf->nextAllocUnit))))
+                return err;
+#ifdef SD_SEEK_CHECKPOINTS
+            SDCheckpointRecord(f);
+#endif
+        }
+        f->buf->curClusterStartAddr = SDGetSectorFromAlloc(
+                f->buf->curAllocUnit);
+    }
+
+#ifdef SD_FILE_WRITE
+    // Remember the last cluster if the walk just reached it
+    if (lastCluster == clusterOffset
+            && ((uint32_t) SD_EOC_BEG) <= f->buf->nextAllocUnit)
+        f->tailAllocUnit = f->buf->curAllocUnit;
+#endif
+
+    return 0;
+}
+
+#ifdef SD_MULTI_BLOCK
+uint8_t SDFindExtent (sd_file *f, const uint32_t offset, const uint32_t want,
+        uint32_t *sectors) {
+    uint8_t err;
+
+    // Sectors left in the current cluster, followed by every cluster stored
+    // directly after it. The FAT is read before any data is transferred
+    *sectors = (1 << g_sd_vol->sectorsPerCluster_shift)
+            - offset % (1 << g_sd_vol->sectorsPerCluster_shift);
+    while (*sectors < want
+            && f->buf->curAllocUnit + 1 == f->buf->nextAllocUnit) {
+        ++(f->curCluster);
+        f->buf->curAllocUnit = f->buf->nextAllocUnit;
+        if ((err = SDGetFATValue(f->buf->curAllocUnit,
+                &(f->buf->nextAllocUnit))))
+            return err;
+#ifdef SD_SEEK_CHECKPOINTS
+        SDCheckpointRecord(f);
+#endif
+        *sectors += 1 << g_sd_vol->sectorsPerCluster_shift;
+    }
+    f->buf->curClusterStartAddr = SDGetSectorFromAlloc(f->buf->curAllocUnit);
+    if (*sectors > want)
+        *sectors = want;
+
+#ifdef SD_FILE_WRITE
+    // The extent may have run up to the end of the chain
+    if (((uint32_t) SD_EOC_BEG) <= f->buf->nextAllocUnit)
+        f->tailAllocUnit = f->buf->curAllocUnit;
+#endif
+
+    return 0;
+}
+#endif
+
+#ifdef SD_SEEK_CHECKPOINTS
+void SDCheckpointReset (sd_file *f) {
+    uint8_t i;
+    const uint32_t clusters = (f->length >> (SD_SECTOR_SIZE_SHIFT
+            + g_sd_vol->sectorsPerCluster_shift)) + 1;
+
+    // The caller decides what the table may cost, if anything
+    if (NULL == f->checkpoint)
+        f->checkpointCount = 0;
+    if (!f->checkpointCount)
+        return;
+
+    // Space the checkpoints so that the file as it is now fits the table
+    f->checkpointShift = 0;
+    while (f->checkpointCount < (clusters >> f->checkpointShift))
+        ++(f->checkpointShift);
+    f->checkpoint[0] = f->firstAllocUnit;
+    for (i = 1; i < f->checkpointCount; ++i)
+        f->checkpoint[i] = 0;
+}
+
+void SDCheckpointRecord (sd_file *f) {
+    uint8_t i;
+
+    if (!f->checkpointCount
+            || (f->curCluster & ((1 << f->checkpointShift) - 1)))
+        return;
+
+    // The file has outgrown the table; keep every other checkpoint and space
+    // them twice as far apart
+    while (f->checkpointCount <= (f->curCluster >> f->checkpointShift)) {
+        for (i = 1; i < (f->checkpointCount + 1) / 2; ++i)
+            f->checkpoint[i] = f->checkpoint[i << 1];
+        for (; i < f->checkpointCount; ++i)
+            f->checkpoint[i] = 0;
+        ++(f->checkpointShift);
+        if (f->curCluster & ((1 << f->checkpointShift) - 1))
+            return;
+    }
+
+    f->checkpoint[f->curCluster >> f->checkpointShift] = f->buf->curAllocUnit;
+}
+
+uint8_t SDCheckpointSeek (sd_file *f, const uint32_t cluster) {
+    uint32_t i = cluster >> f->checkpointShift;
+
+    if (!f->checkpointCount)
+        return 0;
+
+    if (f->checkpointCount <= i)
+        i = f->checkpointCount - 1;
+    while (!f->checkpoint[i])
+        --i;
+
+    // Walking on from the current cluster is no longer than from the
+    // checkpoint
+    if (f->curCluster <= cluster && f->curCluster >= (i << f->checkpointShift))
+        return 0;
+
+    f->curCluster = i << f->checkpointShift;
+    f->buf->curAllocUnit = f->checkpoint[i];
+    f->buf->curClusterStartAddr = SDGetSectorFromAlloc(f->buf->curAllocUnit);
+    return SDGetFATValue(f->buf->curAllocUnit, &(f->buf->nextAllocUnit));
+}
+
+#ifdef SD_FILE_WRITE
+void SDCheckpointTruncate (sd_file *f, const uint32_t clusters) {
+    uint8_t i;
+
+    // The first cluster is never freed
+    for (i = 1; i < f->checkpointCount; ++i)
+        if (((uint32_t) i << f->checkpointShift) >= clusters)
+            f->checkpoint[i] = 0;
+}
+#endif
+#endif
+
+uint8_t SDIncCluster (sd_buffer *buf) {
+    uint8_t err;
+
+#ifdef SD_FILE_WRITE
+    // If the sector has been modified, write it back to the SD card before
+    // reading again
+    if (buf->mod) {
+        if ((err = SDWriteDataBlock(
+                buf->curClusterStartAddr + buf->curSectorOffset, buf->buf)))
+            return err;
+    }
+    buf->mod = 0;
+#endif
+
+    // Update g_sd_cur*
+    if (SD_EOC_BEG <= buf->curAllocUnit && SD_EOC_END <= buf->curAllocUnit)
+        return SD_READING_PAST_EOC;
+    buf->curAllocUnit = buf->nextAllocUnit;
+    // Only look ahead to the next allocation unit if the current alloc unit is
+    // not EOC
+    if (!(SD_EOC_BEG <= buf->curAllocUnit && SD_EOC_END <= buf->curAllocUnit))
+        // Current allocation unit is not EOC, read the next one
+        if ((err = SDGetFATValue(buf->curAllocUnit, &(buf->nextAllocUnit))))
+            return err;
+    buf->curClusterStartAddr = SDGetSectorFromAlloc(buf->curAllocUnit);
+    buf->curSectorOffset = 0;
+
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    printf("Incrementing the cluster. New parameters are:\n");
+    printf("\tCurrent allocation unit: 0x%08X / %u\n", buf->curAllocUnit,
+            buf->curAllocUnit);
+    printf("\tNext allocation unit: 0x%08X / %u\n", buf->nextAllocUnit,
+            buf->nextAllocUnit);
+    printf("\tCurrent cluster starting address: 0x%08X / %u\n",
+            buf->curClusterStartAddr, buf->curClusterStartAddr);
+#endif
+
+#if (defined SD_VERBOSE_BLOCKS && defined SD_VERBOSE && defined SD_DEBUG)
+    if ((err = SDReadDataBlock(buf->curClusterStartAddr, buf->buf)))
+        return err;
+    SDPrintHexBlock(buf->buf, SD_SECTOR_SIZE);
+    return 0;
+#else
+    return SDReadDataBlock(buf->curClusterStartAddr, buf->buf);
+#endif
+}
+
+void SDGetFilename (const uint8_t *buf, char *filename) {
+    uint8_t i, j = 0;
+
+    // Read in the first 8 characters - stop when a space is reached or 8
+    // characters have been read, whichever comes first
+    for (i = 0; i < SD_FILE_NAME_LEN; ++i) {
+        if (0x05 == buf[i])
+            filename[j++] = 0xe5;
+        else if (' ' != buf[i])
+            filename[j++] = buf[i];
+    }
+
+    // Determine if there is more past the first 8 - Again, stop when a space is
+    // reached
+    if (' ' != buf[SD_FILE_NAME_LEN]) {
+        filename[j++] = '.';
+        for (i = SD_FILE_NAME_LEN; i < SD_FILE_NAME_LEN + SD_FILE_EXTENSION_LEN;
+                ++i) {
+            if (' ' != buf[i])
+                filename[j++] = buf[i];
+        }
+    }
+
+    // Insert null-terminator
+    filename[j] = 0;
+}
+
+uint8_t SDOpenEntry (const char *name, sd_file *f, const sd_file_mode mode) {
+    uint8_t err;
+    uint16_t fileEntryOffset = 0;
+#ifdef SD_FILE_WRITE
+    uint16_t sectorOffset;
+#endif
+
+#if (defined SD_DEBUG && defined SD_VERBOSE)
+    printf("Attempting to open %s\n", name);
+#endif
+
+#ifndef SD_BUFFER_POOL
+    if (NULL == f->buf)
+        SDError(SD_FILE_WITHOUT_BUFFER);
+#endif
+
+    // Never hand out the ID reserved for directories
+    f->id = g_sd_fileID++;
+    if (SD_FOLDER_ID == g_sd_fileID)
+        g_sd_fileID = 0;
+    f->rPtr = 0;
+    f->wPtr = 0;
+#if (defined SD_DEBUG && !(defined SD_FILE_WRITE))
+    if (SD_FILE_MODE_R != mode)
+    SDError(SD_INVALID_FILE_MODE);
+#endif
+    f->mode = mode;
+    f->mod = 0;
+#ifdef SD_FILE_WRITE
+    f->sync = SD_SYNC_WRITE_BACK;
+    f->syncBytes = 0;
+    f->syncTicks = 0;
+    f->unsynced = 0;
+    f->lastSync = CNT;
+    f->extendClusters = 1;
+    f->extendClaimed = 1;
+    f->extendTicks = CNT;
+#endif
+
+    // Attempt to find the file
+    if ((err = SDFind(name, &fileEntryOffset))) {
+#ifdef SD_FILE_WRITE
+        // If the file didn't exist and you're trying to read from it, that's a
+        // problem
+        if (SD_FILE_MODE_R == mode)
+            return err;
+
+        // Find returned an error, ensure it was either file-not-found or EOC
+        // and then create the file
+        if ((uint8_t) SD_EOC_END == err) {
+            // File wasn't found and the cluster is full; add another to the
+            // directory
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+            printf("Directory cluster was full, adding another...\n");
+#endif
+            if ((err = SDExtendFAT(g_sd_vol->buf)))
+                SDError(err);
+            if ((err = SDLoadNextSector(g_sd_vol->buf)))
+                SDError(err);
+
+            // A directory ends at its first empty entry, so whatever the new
+            // cluster held before must be wiped
+            memset(g_sd_vol->buf->buf, 0, SD_SECTOR_SIZE);
+            for (sectorOffset = 1;
+                    sectorOffset < (1 << g_sd_vol->sectorsPerCluster_shift);
+                    ++sectorOffset)
+                if ((err = SDWriteDataBlock(
+                        g_sd_vol->buf->curClusterStartAddr + sectorOffset,
+                        g_sd_vol->buf->buf)))
+                    SDError(err);
+            fileEntryOffset = 0;
+            err = SD_FILENAME_NOT_FOUND;
+        }
+        if (SD_FILENAME_NOT_FOUND == err) {
+            // File wasn't found, but there is still room in this cluster (or a
+            // new cluster was just added)
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+            printf("Creating a new directory entry...\n");
+#endif
+            if ((err = SDCreateFile(name, &fileEntryOffset)))
+                SDError(err);
+        } else
+#endif
+            // SDFind returned unknown error - throw it
+            SDError(err);
+    }
+
+    // `name` was found successfully, determine if it is a file or directory
+    if (SD_SUB_DIR
+            & g_sd_vol->buf->buf[fileEntryOffset + SD_FILE_ATTRIBUTE_OFFSET])
+        SDError(SD_ENTRY_NOT_FILE);
+
+    // Passed the file-not-directory test; everything needed from the directory
+    // entry is read out before the file's buffer is touched because the buffer
+    // may well be the directory buffer itself
+    if (SD_FAT_16 == g_sd_vol->filesystem)
+        f->firstAllocUnit = SDReadDat16(
+                &(g_sd_vol->buf->buf[fileEntryOffset
+                        + SD_FILE_START_CLSTR_LOW]));
+    else {
+        f->firstAllocUnit = SDReadDat16(
+                &(g_sd_vol->buf->buf[fileEntryOffset
+                        + SD_FILE_START_CLSTR_LOW]));
+        f->firstAllocUnit |= SDReadDat16(
+                &(g_sd_vol->buf->buf[fileEntryOffset
+                        + SD_FILE_START_CLSTR_HIGH]))
+                << 16;
+
+        // Clear the highest 4 bits - they are always reserved
+        f->firstAllocUnit &= 0x0FFFFFFF;
+    }
+    f->dirSectorAddr = g_sd_vol->buf->curClusterStartAddr
+            + g_sd_vol->buf->curSectorOffset;
+    f->fileEntryOffset = fileEntryOffset;
+    f->length = SDReadDat32(
+            &(g_sd_vol->buf->buf[fileEntryOffset + SD_FILE_LEN_OFFSET]));
+
+#ifdef SD_BUFFER_POOL
+    // No buffer was provided - borrow one from the pool
+    if (NULL == f->buf)
+        if ((err = SDGetPoolBuf(&(f->buf))))
+            SDError(err);
+#endif
+
+#ifdef SD_FILE_WRITE
+    // A freshly created directory entry has not been saved yet; do so before
+    // the directory buffer is reused for the file's contents
+    if (g_sd_vol->buf == f->buf)
+        if ((err = SDWriteBackBuf(g_sd_vol->buf)))
+            SDError(err);
+#endif
+
+    // Load the file into the buffer and update status variables
+    f->buf->id = f->id;
+    f->curSector = 0;
+    f->curCluster = 0;
+    f->buf->curAllocUnit = f->firstAllocUnit;
+    f->buf->curClusterStartAddr = SDGetSectorFromAlloc(f->buf->curAllocUnit);
+    if ((err = SDGetFATValue(f->buf->curAllocUnit, &(f->buf->nextAllocUnit))))
+        SDError(err);
+    f->buf->curSectorOffset = 0;
+#ifdef SD_SEEK_CHECKPOINTS
+    SDCheckpointReset(f);
+#endif
+#ifdef SD_FILE_WRITE
+    // Determine the number of sectors currently allocated to this file; useful
+    // in the case that the file needs to be extended
+    f->maxSectors = (f->length + SD_SECTOR_SIZE - 1) >> SD_SECTOR_SIZE_SHIFT;
+    if (!(f->maxSectors))
+        f->maxSectors = 1 << g_sd_vol->sectorsPerCluster_shift;
+    while (f->maxSectors % (1 << g_sd_vol->sectorsPerCluster_shift))
+        ++(f->maxSectors);
+    f->buf->mod = 0;
+
+    // The last cluster is known right away for files of a single cluster and
+    // for files closed recently; appending to them needs no walk of the FAT
+    f->tailAllocUnit = 0;
+    if (1 == (f->maxSectors >> g_sd_vol->sectorsPerCluster_shift))
+        f->tailAllocUnit = f->firstAllocUnit;
+#ifdef SD_TAIL_CACHE
+    else if ((err = SDTailCacheLookup(f, &(f->tailAllocUnit))))
+        SDError(err);
+#endif
+
+    if (SD_FILE_MODE_A == mode || SD_FILE_MODE_A_PLUS == mode)
+        f->wPtr = f->length;
+#endif
+    if ((err = SDReadDataBlock(f->buf->curClusterStartAddr, f->buf->buf)))
+        SDError(err);
+
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    printf("Opening file from...\n");
+    printf("\tAllocation unit 0x%08X\n", f->buf->curAllocUnit);
+    printf("\tNext allocation unit 0x%08X\n", f->buf->nextAllocUnit);
+    printf("\tCluster starting address 0x%08X\n", f->buf->curClusterStartAddr);
+    printf("\tSector offset 0x%04X\n", f->buf->curSectorOffset);
+    printf("\tFile length 0x%08X\n", f->length);
+    printf("\tMax sectors 0x%08X\n", f->maxSectors);
+#ifdef SD_VERBOSE_BLOCKS
+    printf("And the first file sector looks like....\n");
+    SDPrintHexBlock(f->buf->buf, SD_SECTOR_SIZE);
+    putchar('\n');
+#endif
+#endif
+
+    return 0;
+}
+
+uint8_t SDFind (const char *filename, uint16_t *fileEntryOffset) {
+    uint8_t err;
+    uint32_t rawName[SD_SHORT_NAME_WORDS];
+#ifdef SD_DIR_INDEX
+    uint8_t indexing = 0;
+    uint8_t found = 0;
+    sd_dir_index_entry match;
+#endif
+
+#ifdef SD_BUFFER_POOL
+    if ((err = SDClaimDirBuf()))
+        return err;
+#endif
+
+#ifdef SD_FILE_WRITE
+    // Save the current buffer
+    if (g_sd_vol->buf->mod) {
+        if ((err = SDWriteDataBlock(g_sd_vol->buf->curClusterStartAddr
+                + g_sd_vol->buf->curSectorOffset, g_sd_vol->buf->buf)))
+            return err;
+        g_sd_vol->buf->mod = 0;
+    }
+#endif
+
+    // Entries are compared in their on-disk form; a name that does not fit it
+    // can not exist
+    if ((err = SDNormalizeName(filename, (char *) rawName)))
+        return err;
+
+#ifdef SD_DIR_INDEX
+    if (g_sd_vol->dir_firstAllocUnit == g_sd_vol->dirIndexDir
+            && g_sd_vol->dirIndexBuilt) {
+        err = SDDirIndexLookup(rawName, fileEntryOffset);
+        if (SD_FILENAME_NOT_FOUND != err)
+            return err;
+
+        // Not indexed; if the whole directory is, the name does not exist and
+        // the buffer is left at the first unused entry for SDCreateFile()
+        if (SD_DIR_INDEX_NO_END != g_sd_vol->dirIndexEnd.entry) {
+            if ((err = SDDirIndexLoad(&g_sd_vol->dirIndexEnd)))
+                return err;
+
+            // The last entry filled its sector; the directory ends at the
+            // start of the next one, unless it must grow first
+            if (SD_DIR_INDEX_ENTRIES == g_sd_vol->dirIndexEnd.entry) {
+                if ((err = SDLoadNextSector(g_sd_vol->buf))) {
+                    *fileEntryOffset = SD_SECTOR_SIZE;
+                    return err;
+                }
+                SDDirIndexSetEnd(0);
+            }
+            *fileEntryOffset = g_sd_vol->dirIndexEnd.entry
+                    * SD_FILE_ENTRY_LENGTH;
+            return SD_FILENAME_NOT_FOUND;
+        }
+
+        // The directory holds more names than the index; search the rest of
+        // it without indexing it again
+    }
+
+    // The working directory is indexed on its first search. Other
+    // directories, searched while walking a path, are left out so as not to
+    // evict it
+    if (g_sd_vol->dir_firstAllocUnit == g_sd_vol->dirIndexDir
+            && !g_sd_vol->dirIndexBuilt) {
+        indexing = 1;
+        SDDirIndexReset();
+    }
+#endif
+
+    *fileEntryOffset = 0;
+
+    // If we aren't looking at the beginning of the directory cluster, we must
+    // backtrack to the beginning and then begin listing files
+    if (g_sd_vol->buf->curSectorOffset
+            || (g_sd_vol->dir_firstAllocUnit != g_sd_vol->buf->curAllocUnit)
+            || (SDGetSectorFromAlloc(g_sd_vol->dir_firstAllocUnit)
+                    != g_sd_vol->buf->curClusterStartAddr)) {
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+        printf("'find' requires a backtrack to beginning of directory's "
+                "cluster\n");
+#endif
+        g_sd_vol->buf->curClusterStartAddr = SDGetSectorFromAlloc(
+                g_sd_vol->dir_firstAllocUnit);
+        g_sd_vol->buf->curSectorOffset = 0;
+        g_sd_vol->buf->curAllocUnit = g_sd_vol->dir_firstAllocUnit;
+        if ((err = SDGetFATValue(g_sd_vol->buf->curAllocUnit,
+                &(g_sd_vol->buf->nextAllocUnit))))
+            return err;
+        if ((err = SDReadDataBlock(g_sd_vol->buf->curClusterStartAddr,
+                g_sd_vol->buf->buf)))
+            return err;
+    }
+    g_sd_vol->buf->id = SD_FOLDER_ID;
+#ifdef SD_BUFFER_POOL
+    SDTouchBuf(g_sd_vol->buf);
+#endif
+
+    // Loop through all entries in the current directory until we find the
+    // correct one
+    // Function will exit normally with SD_EOC_END error code if the file is not
+    // found
+    while (g_sd_vol->buf->buf[*fileEntryOffset]) {
+        // Check if file is valid, compare its name if it is
+        if (!(SD_DELETED_FILE_MARK == g_sd_vol->buf->buf[*fileEntryOffset])) {
+#ifdef SD_DIR_INDEX
+            // Long name entries can never match an 8.3 name
+            if (indexing && SD_LONG_NAME != g_sd_vol->buf->buf[*fileEntryOffset
+                    + SD_FILE_ATTRIBUTE_OFFSET])
+                SDDirIndexInsert(*fileEntryOffset);
+#endif
+            if (SDNameMatches(&(g_sd_vol->buf->buf[*fileEntryOffset]),
+                    rawName)) {
+#ifdef SD_DIR_INDEX
+                // Keep going until the whole directory is indexed; the match
+                // is reloaded afterwards
+                if (indexing) {
+                    match.sectorOffset = g_sd_vol->buf->curSectorOffset;
+                    match.entry = *fileEntryOffset / SD_FILE_ENTRY_LENGTH;
+                    match.allocUnit = g_sd_vol->buf->curAllocUnit;
+                    found = 1;
+                } else
+#endif
+                // File names match, return 0 to indicate a successful search
+                return 0;
+            }
+        }
+
+        // Increment to the next file
+        *fileEntryOffset += SD_FILE_ENTRY_LENGTH;
+
+        // If it was the last entry in this sector, proceed to the next one
+        if (SD_SECTOR_SIZE == *fileEntryOffset) {
+            // Last entry in the sector, attempt to load a new sector
+            // Possible error value includes end-of-chain marker
+            if ((err = SDLoadNextSector(g_sd_vol->buf))) {
+#ifdef SD_DIR_INDEX
+                if (indexing && (uint8_t) SD_EOC_END == err)
+                    break;
+#endif
+                return err;
+            }
+
+            *fileEntryOffset = 0;
+        }
+    }
+
+#ifdef SD_DIR_INDEX
+    if (indexing) {
+        SDDirIndexSetEnd(*fileEntryOffset);
+        g_sd_vol->dirIndexBuilt = 1;
+        if (found) {
+            *fileEntryOffset = match.entry * SD_FILE_ENTRY_LENGTH;
+            return SDDirIndexLoad(&match);
+        }
+        if (SD_SECTOR_SIZE == *fileEntryOffset)
+            return (uint8_t) SD_EOC_END;
+    }
+#endif
+
+    return SD_FILENAME_NOT_FOUND;
+}
+
+uint8_t SDNormalizeName (const char *filename, char rawName[]) {
+    uint8_t i, j;
+
+    if (!filename[0])
+        return SD_INVALID_FILENAME;
+
+    memset(rawName, ' ', SD_SHORT_NAME_LEN);
+
+    // "." and ".." are the only names allowed to begin with a period
+    if ('.' == filename[0]) {
+        rawName[0] = '.';
+        if ('.' == filename[1]) {
+            rawName[1] = '.';
+            i = 2;
+        } else
+            i = 1;
+        return filename[i] ? SD_INVALID_FILENAME : 0;
+    }
+
+    // Copy the name...
+    for (i = 0; '.' != filename[i] && filename[i]; ++i) {
+        if (SD_FILE_NAME_LEN == i)
+            return SD_INVALID_FILENAME;
+        rawName[i] = filename[i];
+    }
+
+    // ...followed by the extension, if there is one
+    if ('.' == filename[i])
+        for (++i, j = SD_FILE_NAME_LEN; filename[i]; ++i, ++j) {
+            if (SD_SHORT_NAME_LEN == j || '.' == filename[i])
+                return SD_INVALID_FILENAME;
+            rawName[j] = filename[i];
+        }
+
+    // A leading 0xe5 is stored as 0x05 so as not to be mistaken for a deleted
+    // entry
+    if (SD_DELETED_FILE_MARK == (uint8_t) rawName[0])
+        rawName[0] = 0x05;
+
+    return 0;
+}
+
+uint8_t SDNameMatches (const uint8_t *entry, const uint32_t rawName[]) {
+    const sd_long_alias *entryWords = (const sd_long_alias *) entry;
+
+    // The name is two longs; the extension's three bytes are checked as a word
+    // and a byte since the fourth byte of the last long holds the attributes
+    return entryWords[0] == rawName[0] && entryWords[1] == rawName[1]
+            && ((const sd_word_alias *) entry)[4]
+                    == ((const sd_word_alias *) rawName)[4]
+            && entry[10] == ((const uint8_t *) rawName)[10];
+}
+
+#ifdef SD_DIR_INDEX
+uint16_t SDDirIndexHash (const uint8_t rawName[]) {
+    uint8_t i;
+    uint16_t hash = 5381;
+
+    for (i = 0; i < SD_SHORT_NAME_LEN; ++i)
+        hash = (hash << 5) + hash + rawName[i];
+
+    // Keep clear of the values that mark unused slots
+    if (SD_DIR_INDEX_DELETED >= hash)
+        hash += SD_DIR_INDEX_DELETED + 1;
+
+    return hash;
+}
+
+void SDDirIndexReset (void) {
+    memset(g_sd_vol->dirIndex, 0, sizeof(g_sd_vol->dirIndex));
+    g_sd_vol->dirIndexCount = 0;
+    // Anything but SD_DIR_INDEX_NO_END; the scan stores the real end
+    g_sd_vol->dirIndexEnd.entry = 0;
+    g_sd_vol->dirIndexBuilt = 0;
+}
+
+void SDDirIndexInsert (const uint16_t fileEntryOffset) {
+    uint16_t hash = SDDirIndexHash(&(g_sd_vol->buf->buf[fileEntryOffset]));
+    uint8_t i = hash & (SD_DIR_INDEX_SIZE - 1);
+
+    // The slot of a removed entry is reused
+    while (SD_DIR_INDEX_EMPTY != g_sd_vol->dirIndex[i].hash
+            && SD_DIR_INDEX_DELETED != g_sd_vol->dirIndex[i].hash)
+        i = (i + 1) & (SD_DIR_INDEX_SIZE - 1);
+
+    if (SD_DIR_INDEX_EMPTY == g_sd_vol->dirIndex[i].hash) {
+        // A partial index can still find entries, but it can no longer prove
+        // that a name does not exist
+        if ((SD_DIR_INDEX_SIZE * 3 / 4) <= g_sd_vol->dirIndexCount) {
+            g_sd_vol->dirIndexEnd.entry = SD_DIR_INDEX_NO_END;
+            return;
+        }
+        ++g_sd_vol->dirIndexCount;
+    }
+
+    g_sd_vol->dirIndex[i].hash = hash;
+    g_sd_vol->dirIndex[i].sectorOffset = g_sd_vol->buf->curSectorOffset;
+    g_sd_vol->dirIndex[i].entry = fileEntryOffset / SD_FILE_ENTRY_LENGTH;
+    g_sd_vol->dirIndex[i].allocUnit = g_sd_vol->buf->curAllocUnit;
+}
+
+void SDDirIndexRemove (const uint16_t fileEntryOffset) {
+    uint8_t i = SDDirIndexHash(&(g_sd_vol->buf->buf[fileEntryOffset]))
+            & (SD_DIR_INDEX_SIZE - 1);
+
+    // Slots can not simply be emptied without breaking the probe sequence of
+    // the entries that follow; they are marked deleted instead
+    while (SD_DIR_INDEX_EMPTY != g_sd_vol->dirIndex[i].hash) {
+        if (g_sd_vol->dirIndex[i].allocUnit == g_sd_vol->buf->curAllocUnit
+                && g_sd_vol->dirIndex[i].sectorOffset
+                        == g_sd_vol->buf->curSectorOffset
+                && g_sd_vol->dirIndex[i].entry
+                        == fileEntryOffset / SD_FILE_ENTRY_LENGTH) {
+            g_sd_vol->dirIndex[i].hash = SD_DIR_INDEX_DELETED;
+            return;
+        }
+        i = (i + 1) & (SD_DIR_INDEX_SIZE - 1);
+    }
+}
+
+void SDDirIndexSetEnd (const uint16_t fileEntryOffset) {
+    // An index that ran out of room never learns where the directory ends
+    if (SD_DIR_INDEX_NO_END == g_sd_vol->dirIndexEnd.entry)
+        return;
+
+    g_sd_vol->dirIndexEnd.sectorOffset = g_sd_vol->buf->curSectorOffset;
+    g_sd_vol->dirIndexEnd.entry = fileEntryOffset / SD_FILE_ENTRY_LENGTH;
+    g_sd_vol->dirIndexEnd.allocUnit = g_sd_vol->buf->curAllocUnit;
+}
+
+uint8_t SDDirIndexLookup (const uint32_t rawName[], uint16_t *fileEntryOffset) {
+    uint8_t err;
+    uint16_t hash = SDDirIndexHash((const uint8_t *) rawName);
+    uint8_t i = hash & (SD_DIR_INDEX_SIZE - 1);
+
+    while (SD_DIR_INDEX_EMPTY != g_sd_vol->dirIndex[i].hash) {
+        if (hash == g_sd_vol->dirIndex[i].hash) {
+            if ((err = SDDirIndexLoad(&(g_sd_vol->dirIndex[i]))))
+                return err;
+            *fileEntryOffset = g_sd_vol->dirIndex[i].entry
+                    * SD_FILE_ENTRY_LENGTH;
+            if (SDNameMatches(&(g_sd_vol->buf->buf[*fileEntryOffset]), rawName))
+                return 0;
+        }
+        i = (i + 1) & (SD_DIR_INDEX_SIZE - 1);
+    }
+
+    return SD_FILENAME_NOT_FOUND;
+}
+
+uint8_t SDDirIndexLoad (const sd_dir_index_entry *pos) {
+    uint8_t err;
+    const uint32_t clusterStartAddr = SDGetSectorFromAlloc(pos->allocUnit);
+
+#ifdef SD_BUFFER_POOL
+    if ((err = SDClaimDirBuf()))
+        return err;
+#endif
+
+    g_sd_vol->buf->id = SD_FOLDER_ID;
+#ifdef SD_BUFFER_POOL
+    SDTouchBuf(g_sd_vol->buf);
+#endif
+
+    // Nothing to do if the sector is already loaded
+    if (clusterStartAddr == g_sd_vol->buf->curClusterStartAddr
+            && pos->sectorOffset == g_sd_vol->buf->curSectorOffset
+            && pos->allocUnit == g_sd_vol->buf->curAllocUnit)
+        return 0;
+
+#ifdef SD_FILE_WRITE
+    if ((err = SDWriteBackBuf(g_sd_vol->buf)))
+        return err;
+#endif
+
+    g_sd_vol->buf->curAllocUnit = pos->allocUnit;
+    g_sd_vol->buf->curClusterStartAddr = clusterStartAddr;
+    g_sd_vol->buf->curSectorOffset = pos->sectorOffset;
+    if ((err = SDGetFATValue(pos->allocUnit, &(g_sd_vol->buf->nextAllocUnit))))
+        return err;
+
+    return SDReadDataBlock(clusterStartAddr + pos->sectorOffset,
+            g_sd_vol->buf->buf);
+}
+#endif
+
+uint8_t SDReloadBuf (sd_file *f) {
+    uint8_t err;
+
+    // Function is only called if it has already been determined that the buffer
+    // needs to be loaded - no checks need to be run
+
+#ifdef SD_BUFFER_POOL
+    // Another file took this buffer; rather than taking it straight back,
+    // borrow whichever pool buffer has gone unused the longest
+    if (SDIsPoolBuf(f->buf))
+        if ((err = SDGetPoolBuf(&(f->buf))))
+            return err;
+#endif
+
+#ifdef SD_FILE_WRITE
+    // If the currently loaded buffer has been modified, save it; it may hold
+    // another file's sector
+    if ((err = SDWriteBackBuf(f->buf)))
+        return err;
+#endif
+
+    // Set current values to show that the first sector of the file is loaded.
+    // SDLoadSectorFromOffset() loads the sector unconditionally before
+    // returning so we do not need to load the sector here
+    f->buf->curAllocUnit = f->firstAllocUnit;
+    f->buf->curClusterStartAddr = SDGetSectorFromAlloc(f->firstAllocUnit);
+    f->buf->curSectorOffset = 0;
+    f->curCluster = 0;
+    if ((err = SDGetFATValue(f->firstAllocUnit, &(f->buf->nextAllocUnit))))
+        return err;
+
+    // A direct transfer may have left no sector loaded; any sector will do
+    if (SD_INVALID_SECTOR == f->curSector)
+        f->curSector = 0;
+
+    // Proceed with loading the sector
+    if ((err = SDLoadSectorFromOffset(f, f->curSector)))
+        return err;
+    f->buf->id = f->id;
+
+    return 0;
+}
+
+#ifdef SD_BUFFER_POOL
+uint8_t SDGetPoolBuf (sd_buffer **buf) {
+    uint8_t i;
+    sd_buffer *candidate;
+    sd_buffer *clean = NULL;
+#ifdef SD_FILE_WRITE
+    uint8_t err;
+    sd_buffer *dirty = NULL;
+#endif
+
+    for (i = 0; i < SD_BUFFER_POOL_SIZE; ++i) {
+        candidate = &(g_sd_bufPool[i]);
+
+#ifdef SD_FILE_WRITE
+        if (candidate->mod) {
+            if (NULL == dirty || candidate->lastUse < dirty->lastUse)
+                dirty = candidate;
+        } else
+#endif
+        if (NULL == clean || candidate->lastUse < clean->lastUse)
+            clean = candidate;
+    }
+
+#ifdef SD_FILE_WRITE
+    // Every buffer holds unsaved data; save the least recently used one
+    if (NULL == clean) {
+        if ((err = SDWriteBackBuf(dirty)))
+            return err;
+        clean = dirty;
+    }
+#endif
+
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    printf("Lending pool buffer %u (last used at tick %u)\n",
+            (unsigned int) (clean - g_sd_bufPool), clean->lastUse);
+#endif
+
+    // Nobody owns the buffer until the borrower loads its sector; until then
+    // it matches no sector, so that no directory mistakes it for one of its
+    // own
+    clean->id = SD_FOLDER_ID;
+    clean->vol = g_sd_vol;
+    clean->curClusterStartAddr = 0;
+    clean->curSectorOffset = 0;
+    clean->curAllocUnit = 0;
+    SDTouchBuf(clean);
+    *buf = clean;
+
+    return 0;
+}
+
+uint8_t SDClaimDirBuf (void) {
+    uint8_t err;
+
+    // Still the directory's unless a file has loaded one of its sectors into
+    // it, or another volume's directory has borrowed it
+    if (SD_FOLDER_ID == g_sd_vol->buf->id && (!SDIsPoolBuf(g_sd_vol->buf)
+            || g_sd_vol == g_sd_vol->buf->vol))
+        return 0;
+
+    // Leave the buffer to the file; the directory goes back to its own buffer
+    // if that one is free, or borrows the least recently used pool buffer
+    if (SD_FOLDER_ID == g_sd_vol->ownBuf->id)
+        g_sd_vol->buf = g_sd_vol->ownBuf;
+    else if ((err = SDGetPoolBuf(&(g_sd_vol->buf))))
+        return err;
+
+    return 0;
+}
+
+uint8_t SDIsPoolBuf (const sd_buffer *buf) {
+    // A buffer given by the caller (such as g_sd_buf) is never lent, so that
+    // a file given it keeps it
+    return (&(g_sd_bufPool[0]) <= buf)
+            && (&(g_sd_bufPool[SD_BUFFER_POOL_SIZE]) > buf);
+}
+
+void SDTouchBuf (sd_buffer *buf) {
+    buf->lastUse = ++g_sd_bufTick;
+}
+#endif
+
+#ifdef SD_READ_AHEAD
+uint8_t SDReadAhead (sd_file *f) {
+    uint8_t i;
+    uint32_t sectorOffset;
+    sd_buffer *candidate;
+    sd_buffer *target = NULL;
+    const uint32_t next = f->curSector + 1;
+
+    if (!SDIsPoolBuf(f->buf) || SD_INVALID_SECTOR == f->curSector
+            || (next << SD_SECTOR_SIZE_SHIFT) >= f->length)
+        return 0;
+    if (NULL != g_sd_aheadBuf && f == g_sd_aheadFile
+            && next == g_sd_aheadSector && f->id == g_sd_aheadBuf->id)
+        return 0;
+
+    // Only a clean, dedicated pool buffer may be used; the directory buffer is
+    // left for the directory
+    for (i = 0; i < SD_BUFFER_POOL_SIZE; ++i) {
+        candidate = &(g_sd_bufPool[i]);
+        if (candidate == f->buf || candidate == g_sd_vol->buf)
+            continue;
+#ifdef SD_FILE_WRITE
+        if (candidate->mod)
+            continue;
+#endif
+        if (NULL == target || candidate->lastUse < target->lastUse)
+            target = candidate;
+    }
+    if (NULL == target)
+        return 0;
+
+    // Describe the next sector, which may be the first of the next cluster
+    sectorOffset = next % (1 << g_sd_vol->sectorsPerCluster_shift);
+    if (sectorOffset) {
+        target->curAllocUnit = f->buf->curAllocUnit;
+        target->nextAllocUnit = f->buf->nextAllocUnit;
+        target->curClusterStartAddr = f->buf->curClusterStartAddr;
+    } else {
+        uint8_t err;
+
+        if (((uint32_t) SD_EOC_BEG) <= f->buf->nextAllocUnit)
+            return 0;
+        // The FAT is read now, before the SPI cog is given the sector
+        target->curAllocUnit = f->buf->nextAllocUnit;
+        if ((err = SDGetFATValue(target->curAllocUnit,
+                &(target->nextAllocUnit))))
+            return err;
+        target->curClusterStartAddr = SDGetSectorFromAlloc(
+                target->curAllocUnit);
+    }
+    target->curSectorOffset = sectorOffset;
+    target->id = f->id;
+    target->vol = g_sd_vol;
+    SDTouchBuf(target);
+
+    g_sd_aheadBuf = target;
+    g_sd_aheadFile = f;
+    g_sd_aheadSector = next;
+
+    return SDStartReadDataBlock(target->curClusterStartAddr + sectorOffset,
+            target->buf);
+}
+
+uint8_t SDTakeReadAhead (sd_file *f, const uint32_t offset) {
+    sd_buffer *old = f->buf;
+
+    // The buffer may have been lent to someone else since
+    if (NULL == g_sd_aheadBuf || f != g_sd_aheadFile
+            || offset != g_sd_aheadSector || f->id != g_sd_aheadBuf->id
+            || !SDIsPoolBuf(old))
+        return 0;
+
+    f->buf = g_sd_aheadBuf;
+    f->curSector = offset;
+    f->curCluster = offset >> g_sd_vol->sectorsPerCluster_shift;
+    g_sd_aheadBuf = NULL;
+#ifdef SD_SEEK_CHECKPOINTS
+    SDCheckpointRecord(f);
+#endif
+    SDTouchBuf(f->buf);
+
+    // The old buffer goes back to the pool, first in line to be reused
+    old->id = SD_FOLDER_ID;
+    old->lastUse = 0;
+
+    return 1;
+}
+
+void SDCancelReadAhead (const sd_file *f) {
+    if (NULL != g_sd_aheadBuf && f == g_sd_aheadFile) {
+        if (f->id == g_sd_aheadBuf->id) {
+            g_sd_aheadBuf->id = SD_FOLDER_ID;
+            g_sd_aheadBuf->lastUse = 0;
+        }
+        g_sd_aheadBuf = NULL;
+    }
+}
+#endif
+
+#ifdef SD_FILE_WRITE
+uint8_t SDWriteBackBuf (sd_buffer *buf) {
+    uint8_t err;
+    sd_block_dev *dev;
+
+    if (buf->mod) {
+        // A buffer lent from the pool may hold a sector of another volume
+        dev = buf->vol->dev;
+        if ((err = dev->ops->write(dev,
+                buf->curClusterStartAddr + buf->curSectorOffset, buf->buf)))
+            return err;
+        buf->mod = 0;
+    }
+
+    return 0;
+}
+
+uint8_t SDFlushFile (sd_file *f) {
     uint8_t err;
-    uint32_t clusterOffset = offset >> g_sd_sectorsPerCluster_shift;
 
-#ifdef SD_FILE_WRITE
-    // If the buffer has been modified, write it before loading the next sector
-    if (f->buf->mod) {
-        SDWriteDataBlock(f->buf->curClusterStartAddr + f->buf->curSectorOffset,
-                f->buf->buf);
+    // If the currently loaded sector has been modified, save the changes
+    if ((f->buf->id == f->id) && f->buf->mod) {
+        if ((err = SDWriteDataBlock(
+                f->buf->curClusterStartAddr + f->buf->curSectorOffset,
+                f->buf->buf)))
+            return err;
         f->buf->mod = 0;
-    }
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+        printf("Modified sector in file has been saved...\n");
+        printf("\tDestination address: 0x%08X / %u\n",
+                f->buf->curClusterStartAddr + f->buf->curSectorOffset,
+                f->buf->curClusterStartAddr + f->buf->curSectorOffset);
+        printf("\tFile first sector address: 0x%08X / %u\n",
+                SDGetSectorFromAlloc(f->firstAllocUnit),
+                SDGetSectorFromAlloc(f->firstAllocUnit));
 #endif
+    }
 
-    // Find the correct cluster
-    if (f->curCluster < clusterOffset) {
+    // If we modified the length of the file...
 #if (defined SD_VERBOSE && defined SD_DEBUG)
-        printf("Need to fast-forward through the FAT to find the cluster\n");
+    printf("Flushing file and \"f->mod\" value is %u\n", f->mod);
+    printf("File length is: 0x%08X / %u\n", f->length, f->length);
 #endif
-        // Desired cluster comes after the currently loaded one - this is easy
-        // and requires continuing to look forward through the FAT from the
-        // current position
-        clusterOffset -= f->curCluster;
-        while (clusterOffset--) {
-            ++(f->curCluster);
-            f->buf->curAllocUnit = f->buf->nextAllocUnit;
-            if ((err = SDGetFATValue(f->buf->curAllocUnit,
-                    &(f->buf->nextAllocUnit))))
-                return err;
-        }
-        f->buf->curClusterStartAddr = SDGetSectorFromAlloc(
-                f->buf->curAllocUnit);
-    } else if (f->curCluster > clusterOffset) {
+    if (f->mod) {
 #if (defined SD_VERBOSE && defined SD_DEBUG)
-        printf("Need to backtrack through the FAT to find the cluster\n");
+        printf("File length has been modified - write it to the directory\n");
 #endif
-        // Desired cluster is an earlier cluster than the currently loaded one -
-        // this requires starting from the beginning and working forward
-        f->buf->curAllocUnit = f->firstAllocUnit;
-        if ((err = SDGetFATValue(f->buf->curAllocUnit, &(f->buf->nextAllocUnit))))
+        if ((err = SDWriteFileLength(f)))
             return err;
-        f->curCluster = 0;
-        while (clusterOffset--) {
-            ++(f->curCluster);
-            f->buf->curAllocUnit = f->buf->nextAllocUnit;
-            if ((err = SDGetFATValue(f->buf->curAllocUnit,
-                    &(f->buf->nextAllocUnit))))
-                return err;
-        }
-        f->buf->curClusterStartAddr = SDGetSectorFromAlloc(
-                f->buf->curAllocUnit);
     }
 
-    // Followed by finding the correct sector
-    f->buf->curSectorOffset = offset % (1 << g_sd_sectorsPerCluster_shift);
-    f->curSector = offset;
-    SDReadDataBlock(f->buf->curClusterStartAddr + f->buf->curSectorOffset,
-            f->buf->buf);
+    // Bring every copy of the FAT up to date with the file's clusters
+    if ((err = SDSyncFATs()))
+        return err;
+
+    f->unsynced = 0;
+    f->lastSync = CNT;
 
     return 0;
 }
 
-uint8_t SDIncCluster (sd_buffer *buf) {
+uint8_t SDWriteFileLength (sd_file *f) {
     uint8_t err;
 
-#ifdef SD_FILE_WRITE
-    // If the sector has been modified, write it back to the SD card before
-    // reading again
-    if (buf->mod) {
-        if ((err = SDWriteDataBlock(
-                buf->curClusterStartAddr + buf->curSectorOffset, buf->buf)))
-            return err;
-    }
-    buf->mod = 0;
+#ifdef SD_BUFFER_POOL
+    if ((err = SDClaimDirBuf()))
+        return err;
 #endif
 
-    // Update g_sd_cur*
-    if (SD_EOC_BEG <= buf->curAllocUnit && SD_EOC_END <= buf->curAllocUnit)
-        return SD_READING_PAST_EOC;
-    buf->curAllocUnit = buf->nextAllocUnit;
-    // Only look ahead to the next allocation unit if the current alloc unit is
-    // not EOC
-    if (!(SD_EOC_BEG <= buf->curAllocUnit && SD_EOC_END <= buf->curAllocUnit))
-        // Current allocation unit is not EOC, read the next one
-        if ((err = SDGetFATValue(buf->curAllocUnit, &(buf->nextAllocUnit))))
+    // Check if the directory sector is still loaded...
+    if ((g_sd_vol->buf->curClusterStartAddr + g_sd_vol->buf->curSectorOffset)
+            != f->dirSectorAddr) {
+        // If it isn't, load it, saving it first if it's been modified since
+        // the last read...
+        if ((err = SDWriteBackBuf(g_sd_vol->buf)))
             return err;
-    buf->curClusterStartAddr = SDGetSectorFromAlloc(buf->curAllocUnit);
-    buf->curSectorOffset = 0;
-
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-    printf("Incrementing the cluster. New parameters are:\n");
-    printf("\tCurrent allocation unit: 0x%08X / %u\n", buf->curAllocUnit,
-            buf->curAllocUnit);
-    printf("\tNext allocation unit: 0x%08X / %u\n", buf->nextAllocUnit,
-            buf->nextAllocUnit);
-    printf("\tCurrent cluster starting address: 0x%08X / %u\n",
-            buf->curClusterStartAddr, buf->curClusterStartAddr);
-#endif
+        if ((err = SDReadDataBlock(f->dirSectorAddr, g_sd_vol->buf->buf)))
+            return err;
+        // Only the sector address is known; a reserved allocation unit
+        // forces SDFind() to backtrack before walking the directory
+        g_sd_vol->buf->curClusterStartAddr = f->dirSectorAddr;
+        g_sd_vol->buf->curSectorOffset = 0;
+        g_sd_vol->buf->curAllocUnit = 0;
+        g_sd_vol->buf->id = SD_FOLDER_ID;
+    }
+    // Finally, edit the length of the file
+    SDWriteDat32(&(g_sd_vol->buf->buf[f->fileEntryOffset + SD_FILE_LEN_OFFSET]),
+            f->length);
+    g_sd_vol->buf->mod = 01;
+    g_sd_vol->buf->vol = g_sd_vol;
+    f->mod = 0;
 
-#if (defined SD_VERBOSE_BLOCKS && defined SD_VERBOSE && defined SD_DEBUG)
-    if ((err = SDReadDataBlock(buf->curClusterStartAddr, buf->buf)))
-        return err;
-    SDPrintHexBlock(buf->buf, SD_SECTOR_SIZE);
     return 0;
-#else
-    return SDReadDataBlock(buf->curClusterStartAddr, buf->buf);
-#endif
 }
 
-void SDGetFilename (const uint8_t *buf, char *filename) {
-    uint8_t i, j = 0;
-
-    // Read in the first 8 characters - stop when a space is reached or 8
-    // characters have been read, whichever comes first
-    for (i = 0; i < SD_FILE_NAME_LEN; ++i) {
-        if (0x05 == buf[i])
-            filename[j++] = 0xe5;
-        else if (' ' != buf[i])
-            filename[j++] = buf[i];
-    }
+uint8_t SDCheckSync (sd_file *f, const uint32_t bytes) {
+    f->unsynced += bytes;
 
-    // Determine if there is more past the first 8 - Again, stop when a space is
-    // reached
-    if (' ' != buf[SD_FILE_NAME_LEN]) {
-        filename[j++] = '.';
-        for (i = SD_FILE_NAME_LEN; i < SD_FILE_NAME_LEN + SD_FILE_EXTENSION_LEN;
-                ++i) {
-            if (' ' != buf[i])
-                filename[j++] = buf[i];
-        }
+    switch (f->sync) {
+        case SD_SYNC_WRITE_THROUGH:
+            return SDfflush(f);
+        case SD_SYNC_PERIODIC:
+            if ((f->syncBytes && f->syncBytes <= f->unsynced)
+                    || (f->syncTicks && f->syncTicks <= CNT - f->lastSync))
+                return SDfflush(f);
+            break;
+        default:
+            break;
     }
 
-    // Insert null-terminator
-    filename[j] = 0;
+    return 0;
 }
 
-uint8_t SDFind (const char *filename, uint16_t *fileEntryOffset) {
-    uint8_t err;
-    char readEntryName[SD_FILENAME_STR_LEN];
+uint8_t SDWriteFATSector (const uint32_t fatSector) {
+    uint8_t err, i;
 
-#ifdef SD_FILE_WRITE
-    // Save the current buffer
-    if (g_sd_buf.mod) {
-        if ((err = SDWriteDataBlock(
-                g_sd_buf.curClusterStartAddr + g_sd_buf.curSectorOffset,
-                g_sd_buf.buf)))
-            return err;
-        g_sd_buf.mod = 0;
+    if ((err = SDWriteDataBlock(fatSector + g_sd_vol->fatStart, g_sd_vol->fat)))
+        return err;
+    g_sd_vol->fatMod = 0;
+
+#ifdef SD_FAT_MIRROR_LAZY
+    // Queue the sector for mirroring unless it already is
+    for (i = 0; i < g_sd_vol->fatDirtyCount; ++i)
+        if (fatSector == g_sd_vol->fatDirty[i])
+            return 0;
+    if (SD_FAT_DIRTY_SIZE > g_sd_vol->fatDirtyCount) {
+        g_sd_vol->fatDirty[g_sd_vol->fatDirtyCount++] = fatSector;
+        return 0;
     }
 #endif
 
-    *fileEntryOffset = 0;
-
-    // If we aren't looking at the beginning of the directory cluster, we must
-    // backtrack to the beginning and then begin listing files
-    if (g_sd_buf.curSectorOffset
-            || (SDGetSectorFromAlloc(g_sd_dir_firstAllocUnit)
-                    != g_sd_buf.curClusterStartAddr)) {
-#if (defined SD_VERBOSE && defined SD_DEBUG)
-        printf("'find' requires a backtrack to beginning of directory's "
-                "cluster\n");
-#endif
-        g_sd_buf.curClusterStartAddr = SDGetSectorFromAlloc(
-                g_sd_dir_firstAllocUnit);
-        g_sd_buf.curSectorOffset = 0;
-        g_sd_buf.curAllocUnit = g_sd_dir_firstAllocUnit;
-        if ((err = SDGetFATValue(g_sd_buf.curAllocUnit, &g_sd_buf.nextAllocUnit)))
+    // Mirror the sector right away
+    for (i = 1; i < g_sd_vol->numFATs; ++i)
+        if ((err = SDWriteDataBlock(fatSector + g_sd_vol->fatStart
+                + i * g_sd_vol->fatSize, g_sd_vol->fat)))
             return err;
-        if ((err = SDReadDataBlock(g_sd_buf.curClusterStartAddr, g_sd_buf.buf)))
-            return err;
-    }
-    g_sd_buf.id = SD_FOLDER_ID;
 
-    // Loop through all entries in the current directory until we find the
-    // correct one
-    // Function will exit normally with SD_EOC_END error code if the file is not
-    // found
-    while (g_sd_buf.buf[*fileEntryOffset]) {
-        // Check if file is valid, retrieve the name if it is
-        if (!(SD_DELETED_FILE_MARK == g_sd_buf.buf[*fileEntryOffset])) {
-            SDGetFilename(&(g_sd_buf.buf[*fileEntryOffset]), readEntryName);
-            if (!strcmp(filename, readEntryName))
-                // File names match, return 0 to indicate a successful search
-                return 0;
-        }
+    return 0;
+}
 
-        // Increment to the next file
-        *fileEntryOffset += SD_FILE_ENTRY_LENGTH;
+uint8_t SDSyncFATs (void) {
+    uint8_t err;
+#ifdef SD_FAT_MIRROR_LAZY
+    uint8_t i, j;
+    uint8_t reload = 0;
+#endif
 
-        // If it was the last entry in this sector, proceed to the next one
-        if (SD_SECTOR_SIZE == *fileEntryOffset) {
-            // Last entry in the sector, attempt to load a new sector
-            // Possible error value includes end-of-chain marker
-            if ((err = SDLoadNextSector(&g_sd_buf)))
-                return err;
+    if (g_sd_vol->fatMod)
+        if ((err = SDWriteFATSector(g_sd_vol->curFatSector)))
+            return err;
 
-            *fileEntryOffset = 0;
+#ifdef SD_FAT_MIRROR_LAZY
+    for (i = 0; i < g_sd_vol->fatDirtyCount; ++i) {
+        // The FAT buffer is borrowed to copy each sector other than the loaded
+        // one
+        if (g_sd_vol->curFatSector != g_sd_vol->fatDirty[i] || reload) {
+            if ((err = SDReadDataBlock(
+                    g_sd_vol->fatDirty[i] + g_sd_vol->fatStart, g_sd_vol->fat)))
+                return err;
+            reload = 1;
         }
+        for (j = 1; j < g_sd_vol->numFATs; ++j)
+            if ((err = SDWriteDataBlock(g_sd_vol->fatDirty[i]
+                    + g_sd_vol->fatStart + j * g_sd_vol->fatSize,
+                    g_sd_vol->fat)))
+                return err;
     }
+    g_sd_vol->fatDirtyCount = 0;
 
-    return SD_FILENAME_NOT_FOUND;
-}
-
-uint8_t SDReloadBuf (sd_file *f) {
-    uint8_t err;
-
-    // Function is only called if it has already been determined that the buffer
-    // needs to be loaded - no checks need to be run
-
-#ifdef SD_FILE_WRITE
-    // If the currently loaded buffer has been modified, save it
-    if (f->buf->mod) {
-        if ((err = SDWriteDataBlock(
-                f->buf->curClusterStartAddr + f->buf->curSectorOffset,
-                f->buf->buf)))
+    if (reload)
+        if ((err = SDReadDataBlock(g_sd_vol->curFatSector + g_sd_vol->fatStart,
+                g_sd_vol->fat)))
             return err;
-        f->buf->mod = 0;
-    }
 #endif
 
-    // Set current values to show that the first sector of the file is loaded.
-    // SDLoadSectorFromOffset() loads the sector unconditionally before
-    // returning so we do not need to load the sector here
-    f->buf->curAllocUnit = f->firstAllocUnit;
-    f->buf->curClusterStartAddr = SDGetSectorFromAlloc(f->firstAllocUnit);
-    f->buf->curSectorOffset = 0;
-    if ((err = SDGetFATValue(f->firstAllocUnit, &(f->buf->nextAllocUnit))))
-        return err;
-
-    // Proceed with loading the sector
-    if ((err = SDLoadSectorFromOffset(f, f->curSector)))
-        return err;
-    f->buf->id = f->id;
-
     return 0;
 }
 
-#ifdef SD_FILE_WRITE
 uint32_t SDFindEmptySpace (const uint8_t restore) {
     uint16_t allocOffset = 0;
-    uint32_t fatSectorAddr = g_sd_curFatSector + g_sd_fatStart;
+    uint32_t fatSectorAddr = g_sd_vol->curFatSector + g_sd_vol->fatStart;
     uint32_t retVal;
-    // NOTE: g_sd_curFatSector is not modified until end of function - it is
-    // used throughout this function as the original starting point
+    // NOTE: g_sd_vol->curFatSector is not modified until end of function - it
+    // is used throughout this function as the original starting point
 
 #if (defined SD_VERBOSE_BLOCKS && defined SD_VERBOSE && defined SD_DEBUG)
     printf("\n*** SDFindEmptySpace() initialized with FAT sector 0x%08X / %u "
-            "loaded ***\n", g_sd_curFatSector, g_sd_curFatSector);
-    SDPrintHexBlock(g_sd_fat, SD_SECTOR_SIZE);
+            "loaded ***\n", g_sd_vol->curFatSector, g_sd_vol->curFatSector);
+    SDPrintHexBlock(g_sd_vol->fat, SD_SECTOR_SIZE);
 #endif
 
     // Find the first empty allocation unit and write the EOC marker
-    if (SD_FAT_16 == g_sd_filesystem) {
+    if (SD_FAT_16 == g_sd_vol->filesystem) {
         // Loop until we find an empty cluster
-        while (SDReadDat16(&(g_sd_fat[allocOffset]))) {
+        while (SDReadDat16(&(g_sd_vol->fat[allocOffset]))) {
 #if (defined SD_VERBOSE_BLOCKS && defined SD_VERBOSE && defined SD_DEBUG)
             printf("Searching the following sector...\n");
-            SDPrintHexBlock(g_sd_fat, SD_SECTOR_SIZE);
+            SDPrintHexBlock(g_sd_vol->fat, SD_SECTOR_SIZE);
 #endif
             // Stop when we either reach the end of the current block or find an
             // empty cluster
-            while (SDReadDat16(&(g_sd_fat[allocOffset]))
-                    && (SD_SECTOR_SIZE > allocOffset))
-                allocOffset += SD_FAT_16;
+            allocOffset = SDFindFreeEntry(g_sd_vol->fat, allocOffset);
             // If we reached the end of a sector...
             if (SD_SECTOR_SIZE <= allocOffset) {
                 // If the currently loaded FAT sector has been modified, save it
-                if (g_sd_fatMod) {
+                if (g_sd_vol->fatMod) {
 #if (defined SD_VERBOSE && defined SD_DEBUG)
                     printf("FAT sector has been modified; saving now... ");
 #endif
-                    SDWriteDataBlock(g_sd_curFatSector, g_sd_fat);
-                    SDWriteDataBlock(g_sd_curFatSector + g_sd_fatSize,
-                            g_sd_fat);
+                    SDWriteFATSector(fatSectorAddr - g_sd_vol->fatStart);
 #if (defined SD_VERBOSE && defined SD_DEBUG)
                     printf("done!\n");
 #endif
-                    g_sd_fatMod = 0;
                 }
                 // Read the next fat sector
 #if (defined SD_VERBOSE && defined SD_DEBUG)
                 printf("SDFindEmptySpace() is reading in sector address: "
                         "0x%08X / %u\n", fatSectorAddr + 1, fatSectorAddr + 1);
 #endif
-                SDReadDataBlock(++fatSectorAddr, g_sd_fat);
+                SDReadDataBlock(++fatSectorAddr, g_sd_vol->fat);
+                allocOffset = 0;
             }
         }
-        SDWriteDat16(g_sd_fat + allocOffset, (uint16_t) SD_EOC_END);
-        g_sd_fatMod = 1;
-    } else /* Implied and not needed: "if (SD_FAT_32 == g_sd_filesystem)" */{
+        SDWriteDat16(g_sd_vol->fat + allocOffset, (uint16_t) SD_EOC_END);
+        g_sd_vol->fatMod = 1;
+    } else /* Implied and not needed: "if (SD_FAT_32 == filesystem)" */{
         // In FAT32, the first 7 usable clusters seem to be un-officially
         // reserved for the root directory
-        if (0 == g_sd_curFatSector)
-            allocOffset = 9 * g_sd_filesystem;
+        if (0 == g_sd_vol->curFatSector)
+            allocOffset = 9 * g_sd_vol->filesystem;
 
         // Loop until we find an empty cluster
-        while (SDReadDat32(&(g_sd_fat[allocOffset])) & 0x0fffffff) {
+        while (SDReadDat32(&(g_sd_vol->fat[allocOffset])) & 0x0fffffff) {
 #if (defined SD_VERBOSE_BLOCKS && defined SD_VERBOSE && defined SD_DEBUG)
             printf("Searching the following sector...\n");
-            SDPrintHexBlock(g_sd_fat, SD_SECTOR_SIZE);
+            SDPrintHexBlock(g_sd_vol->fat, SD_SECTOR_SIZE);
 #endif
             // Stop when we either reach the end of the current block or find an
             // empty cluster
-            while ((SDReadDat32(&(g_sd_fat[allocOffset])) & 0x0fffffff)
-                    && (SD_SECTOR_SIZE > allocOffset))
-                allocOffset += SD_FAT_32;
+            allocOffset = SDFindFreeEntry(g_sd_vol->fat, allocOffset);
 
 #if (defined SD_VERBOSE && defined SD_DEBUG)
             printf("Broke while loop... why? Offset = 0x%04X / %u\n",
@@ -1731,58 +4319,192 @@ uint32_t SDFindEmptySpace (const uint8_t restore) {
 #endif
             // If we reached the end of a sector...
             if (SD_SECTOR_SIZE <= allocOffset) {
-                if (g_sd_fatMod) {
+                if (g_sd_vol->fatMod) {
 #if (defined SD_VERBOSE && defined SD_DEBUG)
                     printf("FAT sector has been modified; saving now... ");
 #endif
-                    SDWriteDataBlock(g_sd_curFatSector + g_sd_fatStart,
-                            g_sd_fat);
-                    SDWriteDataBlock(
-                            g_sd_curFatSector + g_sd_fatStart + g_sd_fatSize,
-                            g_sd_fat);
+                    SDWriteFATSector(fatSectorAddr - g_sd_vol->fatStart);
 #if (defined SD_VERBOSE && defined SD_DEBUG)
                     printf("done!\n");
 #endif
-                    g_sd_fatMod = 0;
                 }
                 // Read the next fat sector
 #if (defined SD_VERBOSE && defined SD_DEBUG)
                 printf("SDFindEmptySpace() is reading in sector address: "
                         "0x%08X / %u\n", fatSectorAddr + 1, fatSectorAddr + 1);
 #endif
-                SDReadDataBlock(++fatSectorAddr, g_sd_fat);
+                SDReadDataBlock(++fatSectorAddr, g_sd_vol->fat);
                 allocOffset = 0;
             }
         }
-        SDWriteDat32(&(g_sd_fat[allocOffset]),
+        SDWriteDat32(&(g_sd_vol->fat[allocOffset]),
                 ((uint32_t) SD_EOC_END) & 0x0fffffff);
-        g_sd_fatMod = 1;
+        g_sd_vol->fatMod = 1;
     }
+#ifdef SD_FREE_SPACE
+    --g_sd_vol->freeClusters;
+    g_sd_vol->freeMod = 1;
+#endif
 
 #if (defined SD_VERBOSE && defined SD_DEBUG)
     printf("Available space found: 0x%08X / %u\n",
-            (g_sd_curFatSector << g_sd_entriesPerFatSector_Shift)
-                    + allocOffset / g_sd_filesystem,
-            (g_sd_curFatSector << g_sd_entriesPerFatSector_Shift)
-                    + allocOffset / g_sd_filesystem);
+            (g_sd_vol->curFatSector << g_sd_vol->entriesPerFatSector_Shift)
+                    + allocOffset / g_sd_vol->filesystem,
+            (g_sd_vol->curFatSector << g_sd_vol->entriesPerFatSector_Shift)
+                    + allocOffset / g_sd_vol->filesystem);
 #endif
 
+    // Return new address to end-of-chain; the sector that was searched last is
+    // the one containing the new entry (not necessarily g_sd_vol->curFatSector)
+    retVal = (fatSectorAddr - g_sd_vol->fatStart)
+            << g_sd_vol->entriesPerFatSector_Shift;
+    retVal += allocOffset / g_sd_vol->filesystem;
+
     // If we loaded a new fat sector (and then modified it directly above),
     // write the sector before re-loading the original
-    if ((fatSectorAddr != (g_sd_curFatSector + g_sd_fatStart)) && g_sd_fatMod) {
-        SDWriteDataBlock(fatSectorAddr, g_sd_fat);
-        SDWriteDataBlock(fatSectorAddr + g_sd_fatSize, g_sd_fat);
-        g_sd_fatMod = 0;
-        SDReadDataBlock(g_sd_curFatSector + g_sd_fatStart, g_sd_fat);
+    if ((fatSectorAddr != (g_sd_vol->curFatSector + g_sd_vol->fatStart))
+            && g_sd_vol->fatMod) {
+        SDWriteFATSector(fatSectorAddr - g_sd_vol->fatStart);
+        SDReadDataBlock(g_sd_vol->curFatSector + g_sd_vol->fatStart,
+                g_sd_vol->fat);
     } else
-        g_sd_curFatSector = fatSectorAddr - g_sd_fatStart;
+        g_sd_vol->curFatSector = fatSectorAddr - g_sd_vol->fatStart;
 
-    // Return new address to end-of-chain
-    retVal = g_sd_curFatSector << g_sd_entriesPerFatSector_Shift;
-    retVal += allocOffset / g_sd_filesystem;
     return retVal;
 }
 
+uint16_t SDFindFreeEntry (const uint8_t fat[], uint16_t offset) {
+    const sd_long_alias *words = (const sd_long_alias *) fat;
+    uint32_t word;
+
+    if (SD_FAT_16 == g_sd_vol->filesystem) {
+        // An entry in the upper half of a long is tested on its own
+        if (offset & SD_FAT_16) {
+            if (!SDReadDat16(&(fat[offset])))
+                return offset;
+            offset += SD_FAT_16;
+        }
+
+        for (; SD_SECTOR_SIZE > offset; offset += sizeof(*words)) {
+            word = words[offset >> 2];
+            // Non-zero only if either half is zero; a borrow out of a zero lower
+            // half can only mark the upper half, so a zero lower half is found
+            // first
+            if ((word - 0x00010001) & ~word & 0x80008000)
+                return (word & 0xffff) ? offset + SD_FAT_16 : offset;
+        }
+    } else
+        for (; SD_SECTOR_SIZE > offset; offset += sizeof(*words))
+            // The highest 4 bits are reserved
+            if (!(words[offset >> 2] & 0x0fffffff))
+                return offset;
+
+    return SD_SECTOR_SIZE;
+}
+
+#ifdef SD_FREE_SPACE
+uint16_t SDCountFreeEntries (const uint8_t fat[], const uint16_t entries) {
+    const sd_long_alias *words = (const sd_long_alias *) fat;
+    uint16_t i, count = 0;
+    uint32_t word;
+
+    if (SD_FAT_16 == g_sd_vol->filesystem) {
+        for (i = 0; i < (entries >> 1); ++i) {
+            word = words[i];
+            // Only a long holding a free entry is looked at more closely
+            if ((word - 0x00010001) & ~word & 0x80008000)
+                count += !(word & 0xffff) + !(word >> 16);
+        }
+        if (entries & 1)
+            count += !SDReadDat16(&(fat[(entries - 1) * SD_FAT_16]));
+    } else
+        for (i = 0; i < entries; ++i)
+            // The highest 4 bits are reserved
+            count += !(words[i] & 0x0fffffff);
+
+    return count;
+}
+
+uint8_t SDLoadFreeCount (const uint32_t fsInfoAddr) {
+    uint8_t err;
+    uint32_t fatSector, entries;
+    const uint32_t end = g_sd_vol->clusterCount + 2;
+
+#ifdef SD_FILE_WRITE
+    g_sd_vol->fsInfoAddr = 0;
+    g_sd_vol->freeMod = 0;
+#endif
+
+    if (fsInfoAddr) {
+        if ((err = SDReadDataBlock(fsInfoAddr, g_sd_vol->fat)))
+            return err;
+        if (SD_FSINFO_LEAD_SIG
+                == SDReadDat32(&(g_sd_vol->fat[SD_FSINFO_LEAD_SIG_ADDR]))
+                && SD_FSINFO_STRUCT_SIG
+                        == SDReadDat32(
+                                &(g_sd_vol->fat[SD_FSINFO_STRUCT_SIG_ADDR]))
+                && SD_FSINFO_TRAIL_SIG
+                        == SDReadDat32(
+                                &(g_sd_vol->fat[SD_FSINFO_TRAIL_SIG_ADDR]))) {
+#ifdef SD_FILE_WRITE
+            g_sd_vol->fsInfoAddr = fsInfoAddr;
+#endif
+            // An unknown count is stored as 0xffffffff
+            g_sd_vol->freeClusters = SDReadDat32(
+                    &(g_sd_vol->fat[SD_FSINFO_FREE_COUNT_ADDR]));
+            if (g_sd_vol->clusterCount >= g_sd_vol->freeClusters)
+                return 0;
+        }
+    }
+
+    // Count the free entries of every FAT sector; the last one may hold
+    // entries beyond the end of the partition
+    g_sd_vol->freeClusters = 0;
+    for (fatSector = 0;
+            end > (fatSector << g_sd_vol->entriesPerFatSector_Shift);
+            ++fatSector) {
+        if ((err = SDReadDataBlock(fatSector + g_sd_vol->fatStart,
+                g_sd_vol->fat)))
+            return err;
+        entries = end - (fatSector << g_sd_vol->entriesPerFatSector_Shift);
+        if (((uint32_t) 1 << g_sd_vol->entriesPerFatSector_Shift) < entries)
+            entries = 1 << g_sd_vol->entriesPerFatSector_Shift;
+        g_sd_vol->freeClusters += SDCountFreeEntries(g_sd_vol->fat, entries);
+    }
+#ifdef SD_FILE_WRITE
+    // Store the count on the next sync
+    g_sd_vol->freeMod = 1;
+#endif
+
+#if (defined SD_VERBOSE && defined SD_DEBUG)
+    printf("Free clusters: %u\n", g_sd_vol->freeClusters);
+#endif
+
+    return 0;
+}
+
+#ifdef SD_FILE_WRITE
+uint8_t SDWriteFSInfo (void) {
+    uint8_t err;
+
+    if (!g_sd_vol->freeMod || !g_sd_vol->fsInfoAddr)
+        return 0;
+
+    // The FAT buffer is borrowed to hold the sector
+    if ((err = SDReadDataBlock(g_sd_vol->fsInfoAddr, g_sd_vol->fat)))
+        return err;
+    SDWriteDat32(&(g_sd_vol->fat[SD_FSINFO_FREE_COUNT_ADDR]),
+            g_sd_vol->freeClusters);
+    if ((err = SDWriteDataBlock(g_sd_vol->fsInfoAddr, g_sd_vol->fat)))
+        return err;
+    g_sd_vol->freeMod = 0;
+
+    return SDReadDataBlock(g_sd_vol->curFatSector + g_sd_vol->fatStart,
+            g_sd_vol->fat);
+}
+#endif
+#endif
+
 uint8_t SDExtendFAT (sd_buffer *buf) {
     uint8_t err;
     uint32_t newAllocUnit;
@@ -1793,26 +4515,25 @@ uint8_t SDExtendFAT (sd_buffer *buf) {
     // Do we need to load a different sector of the FAT or is the correct one
     // currently loaded? (Correct means the sector currently containing the EOC
     // marker)
-    if ((buf->curAllocUnit >> g_sd_entriesPerFatSector_Shift)
-            != g_sd_curFatSector) {
+    if ((buf->curAllocUnit >> g_sd_vol->entriesPerFatSector_Shift)
+            != g_sd_vol->curFatSector) {
 
 #if (defined SD_VERBOSE && defined SD_DEBUG)
         printf("Need new FAT sector. Loading: 0x%08X / %u\n",
-                buf->curAllocUnit >> g_sd_entriesPerFatSector_Shift,
-                buf->curAllocUnit >> g_sd_entriesPerFatSector_Shift);
+                buf->curAllocUnit >> g_sd_vol->entriesPerFatSector_Shift,
+                buf->curAllocUnit >> g_sd_vol->entriesPerFatSector_Shift);
         printf("... because the current allocation unit is: 0x%08X / %u\n",
                 buf->curAllocUnit, buf->curAllocUnit);
 #endif
         // Need new sector, save the old one...
-        if (g_sd_fatMod) {
-            SDWriteDataBlock(g_sd_curFatSector + g_sd_fatStart, g_sd_fat);
-            SDWriteDataBlock(g_sd_curFatSector + g_sd_fatStart + g_sd_fatSize,
-                    g_sd_fat);
-            g_sd_fatMod = 0;
-        }
+        if (g_sd_vol->fatMod)
+            if ((err = SDWriteFATSector(g_sd_vol->curFatSector)))
+                return err;
         // And load the new one...
-        g_sd_curFatSector = buf->curAllocUnit >> g_sd_entriesPerFatSector_Shift;
-        if ((err = SDReadDataBlock(g_sd_curFatSector + g_sd_fatStart, g_sd_fat)))
+        g_sd_vol->curFatSector = buf->curAllocUnit
+                >> g_sd_vol->entriesPerFatSector_Shift;
+        if ((err = SDReadDataBlock(g_sd_vol->curFatSector + g_sd_vol->fatStart,
+                g_sd_vol->fat)))
             return err;
     }
 
@@ -1821,9 +4542,9 @@ uint8_t SDExtendFAT (sd_buffer *buf) {
     // the end of its cluster chain
     if (SD_EOC_BEG
             <= SDReadDat32(
-                    &(g_sd_fat[(buf->curAllocUnit
-                            % (1 << g_sd_entriesPerFatSector_Shift))
-                            * g_sd_filesystem])))
+                    &(g_sd_vol->fat[(buf->curAllocUnit
+                            % (1 << g_sd_vol->entriesPerFatSector_Shift))
+                            * g_sd_vol->filesystem])))
         return SD_INVALID_FAT_APPEND;
 #endif
 
@@ -1831,39 +4552,597 @@ uint8_t SDExtendFAT (sd_buffer *buf) {
     // Display the currently loaded FAT.... for no reason... not sure why I
     // wanted to do this...
     printf("This is the sector that *should* contain the EOC marker...\n");
-    SDPrintHexBlock(g_sd_fat, SD_SECTOR_SIZE);
+    SDPrintHexBlock(g_sd_vol->fat, SD_SECTOR_SIZE);
 #endif
 
     // Find where the next cluster of the file should be stored...
     newAllocUnit = SDFindEmptySpace(1);
 
     // Now that we know the allocation unit, write it to the FAT buffer
-    if (SD_FAT_16 == g_sd_filesystem) {
+    if (SD_FAT_16 == g_sd_vol->filesystem) {
         SDWriteDat16(
-                &(g_sd_fat[(buf->curAllocUnit
-                        % (1 << g_sd_entriesPerFatSector_Shift))
-                        * g_sd_filesystem]), (uint16_t) newAllocUnit);
+                &(g_sd_vol->fat[(buf->curAllocUnit
+                        % (1 << g_sd_vol->entriesPerFatSector_Shift))
+                        * g_sd_vol->filesystem]), (uint16_t) newAllocUnit);
     } else {
         SDWriteDat32(
-                &(g_sd_fat[(buf->curAllocUnit
-                        % (1 << g_sd_entriesPerFatSector_Shift))
-                        * g_sd_filesystem]), newAllocUnit);
+                &(g_sd_vol->fat[(buf->curAllocUnit
+                        % (1 << g_sd_vol->entriesPerFatSector_Shift))
+                        * g_sd_vol->filesystem]), newAllocUnit);
     }
     buf->nextAllocUnit = newAllocUnit;
-    g_sd_fatMod = 1;  // And mark the buffer as modified
+    g_sd_vol->fatMod = 1;  // And mark the buffer as modified
 
 #if (defined SD_VERBOSE_BLOCKS && defined SD_VERBOSE && defined SD_DEBUG)
     printf("After modification, the FAT now looks like...\n");
-    SDPrintHexBlock(g_sd_fat, SD_SECTOR_SIZE);
+    SDPrintHexBlock(g_sd_vol->fat, SD_SECTOR_SIZE);
+#endif
+
+    return 0;
+}
+
+uint8_t SDExtendFile (sd_file *f) {
+    uint8_t err;
+    uint8_t claimed = 1;
+    uint32_t ticksPerCluster;
+
+    // SDExtendFAT() appends to whichever cluster the buffer points at, so
+    // first make sure that is the file's last cluster
+    if ((err = SDWriteBackBuf(f->buf)))
+        return err;
+    if ((err = SDFindClusterFromOffset(f, f->maxSectors - 1)))
+        return err;
+    f->curSector = SD_INVALID_SECTOR;
+    if (((uint32_t) SD_EOC_BEG) <= f->buf->nextAllocUnit) {
+        // Claim a run of clusters after the last one, falling back to a single
+        // cluster from anywhere in the FAT
+        if ((err = SDClaimAdjacent(f->buf, f->extendClusters, &claimed)))
+            return err;
+#ifdef SD_AU_ALIGN
+        if (!claimed)
+            if ((err = SDClaimAligned(f->buf, f->extendClusters, &claimed)))
+                return err;
+#endif
+        if (claimed)
+            f->tailAllocUnit = f->buf->nextAllocUnit + claimed - 1;
+        else {
+            if ((err = SDExtendFAT(f->buf)))
+                return err;
+            f->tailAllocUnit = f->buf->nextAllocUnit;
+            claimed = 1;
+        }
+        // Claim more next time while the file fills its clusters quickly and
+        // fewer once it slows down, so that a burst of writes does not leave
+        // a slow file claiming the most clusters for good
+        ticksPerCluster = (CNT - f->extendTicks) / f->extendClaimed;
+        if ((CLKFREQ / 1000) * SD_EXTEND_SLOW_MS < ticksPerCluster) {
+            if (1 < f->extendClusters)
+                f->extendClusters >>= 1;
+        } else if (SD_EXTEND_MAX_CLUSTERS > f->extendClusters)
+            f->extendClusters <<= 1;
+        f->extendClaimed = claimed;
+        f->extendTicks = CNT;
+    }
+    f->maxSectors += claimed << g_sd_vol->sectorsPerCluster_shift;
+
+    return 0;
+}
+
+#ifdef SD_TAIL_CACHE
+uint8_t SDTailCacheLookup (const sd_file *f, uint32_t *tailAllocUnit) {
+    uint8_t err, i;
+    uint32_t cluster, allocUnit, nextAllocUnit;
+    const uint32_t clusters = f->maxSectors >> g_sd_vol->sectorsPerCluster_shift;
+    const sd_tail_cache_entry *entry = NULL;
+
+    *tailAllocUnit = 0;
+    for (i = 0; i < SD_TAIL_CACHE_SIZE; ++i)
+        if (f->firstAllocUnit == g_sd_vol->tailCache[i].firstAllocUnit
+                && clusters == g_sd_vol->tailCache[i].clusters)
+            entry = &(g_sd_vol->tailCache[i]);
+    if (NULL == entry)
+        return 0;
+
+    // The tail is only trusted if the chain still leads to it from the
+    // checkpoint kept with it, which is at most one checkpoint interval away
+    cluster = entry->checkCluster;
+    allocUnit = entry->checkAllocUnit;
+    while (1) {
+        if ((err = SDGetFATValue(allocUnit, &nextAllocUnit)))
+            return err;
+        if (clusters - 1 == cluster || SD_RESERVED_CLUSTER >= nextAllocUnit
+                || g_sd_vol->clusterCount + 1 < nextAllocUnit)
+            break;
+        allocUnit = nextAllocUnit;
+        ++cluster;
+    }
+    if (clusters - 1 == cluster && entry->tailAllocUnit == allocUnit
+            && ((uint32_t) SD_EOC_BEG) <= nextAllocUnit)
+        *tailAllocUnit = allocUnit;
+
+    return 0;
+}
+
+void SDTailCacheInsert (const sd_file *f) {
+    uint8_t i;
+    sd_tail_cache_entry *entry = NULL;
+    const uint32_t clusters = f->maxSectors >> g_sd_vol->sectorsPerCluster_shift;
+
+    // Update the file's slot if it has one
+    for (i = 0; i < SD_TAIL_CACHE_SIZE; ++i)
+        if (f->firstAllocUnit == g_sd_vol->tailCache[i].firstAllocUnit)
+            entry = &(g_sd_vol->tailCache[i]);
+    if (NULL == entry) {
+        entry = &(g_sd_vol->tailCache[g_sd_vol->tailCacheNext]);
+        g_sd_vol->tailCacheNext = (g_sd_vol->tailCacheNext + 1)
+                % SD_TAIL_CACHE_SIZE;
+        entry->checkCluster = 0;
+    }
+
+    // Keep the file's last checkpoint that is still part of it (the first
+    // cluster always is), unless the slot already holds a later one
+    for (i = f->checkpointCount - 1; !f->checkpoint[i]
+            || ((uint32_t) i << f->checkpointShift) >= clusters; --i)
+        ;
+    if (entry->firstAllocUnit != f->firstAllocUnit
+            || ((uint32_t) i << f->checkpointShift) >= entry->checkCluster
+            || clusters <= entry->checkCluster) {
+        entry->checkCluster = (uint32_t) i << f->checkpointShift;
+        entry->checkAllocUnit = f->checkpoint[i];
+    }
+
+    entry->firstAllocUnit = f->firstAllocUnit;
+    entry->tailAllocUnit = f->tailAllocUnit;
+    entry->clusters = clusters;
+}
+
+void SDTailCacheRemove (const uint32_t firstAllocUnit) {
+    uint8_t i;
+
+    for (i = 0; i < SD_TAIL_CACHE_SIZE; ++i)
+        if (firstAllocUnit == g_sd_vol->tailCache[i].firstAllocUnit)
+            g_sd_vol->tailCache[i].firstAllocUnit = 0;
+}
+#endif
+
+uint8_t SDClaimAdjacent (sd_buffer *buf, const uint8_t want, uint8_t *count) {
+    uint8_t err;
+    uint32_t allocUnit, value, end;
+    const uint32_t last = buf->curAllocUnit;
+
+    // Reading the last cluster's entry loads its FAT sector; the run must not
+    // leave that sector or the FAT
+    if ((err = SDGetFATValue(last, &value)))
+        return err;
+    end = ((last >> g_sd_vol->entriesPerFatSector_Shift) + 1)
+            << g_sd_vol->entriesPerFatSector_Shift;
+    if (g_sd_vol->clusterCount + 2 < end)
+        end = g_sd_vol->clusterCount + 2;
+
+    *count = 0;
+    for (allocUnit = last + 1; allocUnit < end && *count < want; ++allocUnit) {
+        if ((err = SDGetFATValue(allocUnit, &value)))
+            return err;
+        if (value)
+            break;
+        ++(*count);
+    }
+    if (!*count)
+        return 0;
+
+    // Link the run, in order, behind the last cluster and end it
+    for (allocUnit = last; allocUnit < last + *count; ++allocUnit)
+        if ((err = SDSetFATValue(allocUnit, allocUnit + 1)))
+            return err;
+    if ((err = SDSetFATValue(allocUnit, (uint32_t) SD_EOC_END)))
+        return err;
+    buf->nextAllocUnit = last + 1;
+
+    return 0;
+}
+
+#ifdef SD_AU_ALIGN
+uint8_t SDClaimAligned (sd_buffer *buf, const uint8_t want, uint8_t *count) {
+    uint8_t err;
+    uint32_t allocUnit, value, first;
+    const uint32_t last = buf->curAllocUnit;
+
+    *count = 0;
+    if (!g_sd_vol->auClusters)
+        return 0;
+
+    // A chain that only reached the end of its FAT sector carries on in the
+    // next one
+    value = 1;
+    if (g_sd_vol->clusterCount + 2 > last + 1)
+        if ((err = SDGetFATValue(last + 1, &value)))
+            return err;
+    if (!value) {
+        first = last + 1;
+        *count = 1;
+    } else {
+        if ((err = SDFindAlignedRun(want, &first)))
+            return (SD_INSUFFICIENT_SPACE == err) ? 0 : err;
+        *count = want;
+    }
+
+    // Chain the run together, end it, and then link it to the last cluster
+    for (allocUnit = first; allocUnit < first + *count - 1; ++allocUnit)
+        if ((err = SDSetFATValue(allocUnit, allocUnit + 1)))
+            return err;
+    if ((err = SDSetFATValue(allocUnit, (uint32_t) SD_EOC_END)))
+        return err;
+    if ((err = SDSetFATValue(last, first)))
+        return err;
+    buf->nextAllocUnit = first;
+
+    return 0;
+}
+
+uint8_t SDFindAlignedRun (const uint32_t count, uint32_t *first) {
+    uint8_t err, i;
+    uint32_t run, value;
+    const uint32_t end = g_sd_vol->clusterCount + 2;
+
+    for (i = 0; i < SD_AU_SEARCH_MAX; ++i) {
+        if (end < g_sd_vol->auNext + count) {
+            // Start over at the first boundary
+            g_sd_vol->auNext = g_sd_vol->auFirst;
+            if (end < g_sd_vol->auNext + count)
+                break;
+        }
+
+        for (run = 0; run < count; ++run) {
+            if ((err = SDGetFATValue(g_sd_vol->auNext + run, &value)))
+                return err;
+            if (value)
+                break;
+        }
+
+        // Whether or not this one was free, the next search starts at the
+        // following boundary
+        *first = g_sd_vol->auNext;
+        g_sd_vol->auNext += g_sd_vol->auClusters;
+        if (count == run)
+            return 0;
+    }
+
+    return SD_INSUFFICIENT_SPACE;
+}
+#endif
+
+uint8_t SDSetFATValue (const uint32_t fatEntry, const uint32_t value) {
+    uint8_t err;
+    uint16_t offset;
+    uint32_t oldValue;
+
+    // Reading the entry loads its sector
+    if ((err = SDGetFATValue(fatEntry, &oldValue)))
+        return err;
+
+#ifdef SD_FREE_SPACE
+    // Keep the count of free clusters current
+    if (!oldValue && value) {
+        --g_sd_vol->freeClusters;
+        g_sd_vol->freeMod = 1;
+    } else if (oldValue && !value) {
+        ++g_sd_vol->freeClusters;
+        g_sd_vol->freeMod = 1;
+    }
+#endif
+
+    offset = (fatEntry % (1 << g_sd_vol->entriesPerFatSector_Shift))
+            * g_sd_vol->filesystem;
+    if (SD_FAT_16 == g_sd_vol->filesystem)
+        SDWriteDat16(&(g_sd_vol->fat[offset]), (uint16_t) value);
+    else
+        // The highest 4 bits are reserved and must be preserved
+        SDWriteDat32(&(g_sd_vol->fat[offset]),
+                (SDReadDat32(&(g_sd_vol->fat[offset])) & 0xF0000000)
+                        | (value & 0x0FFFFFFF));
+    g_sd_vol->fatMod = 1;
+
+    return 0;
+}
+
+uint8_t SDFindFreeRun (const uint32_t start, const uint32_t count,
+        uint32_t *first) {
+    uint8_t err;
+    uint32_t allocUnit, value, skip, run = 0;
+    const uint32_t end = g_sd_vol->clusterCount + 2;
+    const uint32_t entryMask = (1 << g_sd_vol->entriesPerFatSector_Shift) - 1;
+    // Every allocation unit is checked once, plus enough to complete a run
+    // that wraps around
+    uint32_t remaining = g_sd_vol->clusterCount + count;
+
+    allocUnit = (2 <= start && end > start) ? start : 2;
+    while (remaining) {
+        if (end == allocUnit) {
+            // Runs can not wrap around the end of the FAT
+            allocUnit = 2;
+            run = 0;
+        }
+        if ((err = SDGetFATValue(allocUnit, &value)))
+            return err;
+        if (value) {
+            // Skip over the used entries that follow in the same FAT sector
+            run = 0;
+            skip = SDFindFreeEntry(g_sd_vol->fat,
+                    (allocUnit & entryMask) * g_sd_vol->filesystem)
+                    / g_sd_vol->filesystem - (allocUnit & entryMask);
+            if (end - allocUnit < skip)
+                skip = end - allocUnit;
+            if (remaining < skip)
+                skip = remaining;
+            allocUnit += skip;
+            remaining -= skip;
+            continue;
+        }
+        --remaining;
+        if (count == ++run) {
+            *first = allocUnit - count + 1;
+            return 0;
+        }
+        ++allocUnit;
+    }
+
+    return SD_INSUFFICIENT_SPACE;
+}
+
+uint8_t SDReleaseClusters (sd_file *f, const uint32_t clusters) {
+    uint8_t err;
+    uint32_t allocUnit, next, last, i;
+
+    // Walk to the last cluster that is kept and end the chain there
+    allocUnit = f->firstAllocUnit;
+    for (i = 1; i < clusters; ++i)
+        if ((err = SDGetFATValue(allocUnit, &allocUnit)))
+            return err;
+    if ((err = SDGetFATValue(allocUnit, &next)))
+        return err;
+    if ((err = SDSetFATValue(allocUnit, (uint32_t) SD_EOC_END)))
+        return err;
+    last = allocUnit;
+
+    // The buffer must not look ahead into the released clusters
+    if (f->buf->id == f->id && allocUnit == f->buf->curAllocUnit)
+        f->buf->nextAllocUnit = (uint32_t) SD_EOC_END;
+
+    // Free the rest of the chain
+    if ((err = SDFreeChain(next)))
+        return err;
+
+    f->maxSectors = clusters << g_sd_vol->sectorsPerCluster_shift;
+    f->tailAllocUnit = last;
+
+    return 0;
+}
+
+uint8_t SDFreeChain (uint32_t allocUnit) {
+    uint8_t err;
+    uint32_t next;
+#ifdef SD_AU_ALIGN
+    uint32_t lowest = (uint32_t) -1;
+#endif
+#ifdef SD_ERASE_FREED
+    uint32_t runFirst = allocUnit;
+    uint32_t runLength = 0;
+#endif
+
+    while (((uint32_t) SD_EOC_BEG) > allocUnit) {
+        if (2 > allocUnit || g_sd_vol->clusterCount + 2 <= allocUnit)
+            return SD_CORRUPT_CLUSTER;
+        if ((err = SDGetFATValue(allocUnit, &next)))
+            return err;
+        if (!next)
+            return SD_EMPTY_FAT_ENTRY;
+        if ((err = SDSetFATValue(allocUnit, 0)))
+            return err;
+
+#ifdef SD_AU_ALIGN
+        if (lowest > allocUnit)
+            lowest = allocUnit;
+#endif
+#ifdef SD_ERASE_FREED
+        // Each run of consecutive clusters is erased with one command
+        if (runFirst + runLength != allocUnit) {
+            if ((err = SDEraseClusters(runFirst, runLength)))
+                return err;
+            runFirst = allocUnit;
+            runLength = 0;
+        }
+        ++runLength;
+#endif
+        allocUnit = next;
+    }
+
+#ifdef SD_AU_ALIGN
+    // Look for free allocation units of the card from the one that was just
+    // (partly) freed
+    if (g_sd_vol->auClusters && g_sd_vol->auFirst <= lowest
+            && g_sd_vol->auNext > lowest)
+        g_sd_vol->auNext = g_sd_vol->auFirst
+                + ((lowest - g_sd_vol->auFirst) & ~(g_sd_vol->auClusters - 1));
+#endif
+#ifdef SD_ERASE_FREED
+    if (runLength)
+        return SDEraseClusters(runFirst, runLength);
+#endif
+
+    return 0;
+}
+
+#ifdef SD_ERASE_FREED
+uint8_t SDEraseClusters (const uint32_t first, const uint32_t count) {
+    return SDEraseDataBlocks(SDGetSectorFromAlloc(first),
+            count << g_sd_vol->sectorsPerCluster_shift);
+}
+#endif
+
+#ifdef SD_RAW_BLOCKS
+uint8_t SDRawCheckRange (const uint32_t first, const uint32_t count) {
+    uint8_t err, i, protect = 0;
+    uint32_t start, length;
+    const uint32_t end = first + count;
+
+    if ((err = SDRawCheckVolume(first, count)))
+        return err;
+
+    // Every FAT partition on the card, mounted or not
+    if ((err = SDRawReadMBR()))
+        return err;
+    if (SD_BOOT_SECTOR_ID == g_sd_vol->fat[SD_BOOT_SECTOR_ID_ADDR]) {
+        length = SDReadDat16(&(g_sd_vol->fat[SD_TOT_SCTR_16_ADDR]));
+        if (!length)
+            length = SDReadDat32(&(g_sd_vol->fat[SD_TOT_SCTR_32_ADDR]));
+        protect = first < length;
+    } else
+        for (i = 0; i < SD_PARTITION_ENTRIES; ++i) {
+            if (!SDIsFATPartition(g_sd_vol->fat[SD_PARTITION_TABLE_ADDR
+                    + i * SD_PARTITION_ENTRY_SIZE + SD_PARTITION_TYPE_OFFSET]))
+                continue;
+            start = SDReadDat32(&(g_sd_vol->fat[SD_PARTITION_TABLE_ADDR
+                    + i * SD_PARTITION_ENTRY_SIZE + SD_PARTITION_LBA_OFFSET]));
+            length = SDReadDat32(&(g_sd_vol->fat[SD_PARTITION_TABLE_ADDR
+                    + i * SD_PARTITION_ENTRY_SIZE + SD_PARTITION_SIZE_OFFSET]));
+            if (first < start + length && end > start)
+                protect = 1;
+        }
+    if ((err = SDRawRestoreFAT()))
+        return err;
+
+    return protect ? SD_RAW_PROTECTED : 0;
+}
+
+uint8_t SDRawCheckVolume (const uint32_t first, const uint32_t count) {
+    const uint32_t end = first + count;
+
+    // A region filled in by hand may reach past the last sector address
+    if (end < first)
+        return SD_RAW_OUT_OF_RANGE;
+
+    // The MBR (or the boot sector of an unpartitioned card) and the mounted
+    // volume
+    if (!first || (g_sd_vol->volumeEnd && first < g_sd_vol->volumeEnd
+            && end > g_sd_vol->volumeStart))
+        return SD_RAW_PROTECTED;
+
+    return 0;
+}
+
+uint8_t SDRawReadMBR (void) {
+#ifdef SD_FILE_WRITE
+    uint8_t err;
+
+    // The loaded FAT sector is saved before the FAT buffer is borrowed
+    if (g_sd_vol->fatMod)
+        if ((err = SDWriteFATSector(g_sd_vol->curFatSector)))
+            return err;
 #endif
 
+    return SDReadDataBlock(0, g_sd_vol->fat);
+}
+
+uint8_t SDRawRestoreFAT (void) {
+    // Without a mounted volume, the FAT buffer holds nothing worth restoring
+    if (!g_sd_vol->volumeEnd)
+        return 0;
+
+    return SDReadDataBlock(g_sd_vol->curFatSector + g_sd_vol->fatStart,
+            g_sd_vol->fat);
+}
+
+uint8_t SDIsFATPartition (const uint8_t type) {
+    // Hidden partitions (0x1?) use the same file systems
+    switch (type & ~0x10) {
+        case 0x01:  // FAT12
+        case 0x04:  // FAT16, less than 32 MB
+        case 0x06:  // FAT16
+        case 0x0b:  // FAT32
+        case 0x0c:  // FAT32, LBA
+        case 0x0e:  // FAT16, LBA
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+#ifdef SD_RING_LOG
+uint8_t SDRingReadSlot (sd_ring_log *log, const uint32_t slot,
+        uint32_t *sequence) {
+    uint8_t err;
+
+    if ((err = SDRawRead(&(log->region), slot, 1, log->buf)))
+        return err;
+
+    // An erased or foreign sector, or a record that belongs in another slot,
+    // is not part of the log
+    *sequence = SDReadDat32(&(log->buf[SD_RING_SEQUENCE_ADDR]));
+    if (SD_RING_MAGIC != SDReadDat32(&(log->buf[SD_RING_MAGIC_ADDR]))
+            || slot != *sequence % log->region.count)
+        *sequence = SD_RING_NO_RECORD;
+
     return 0;
 }
+#endif
+#endif
+
+uint8_t SDRemoveEntry (const char *name) {
+    uint8_t err;
+    uint16_t fileEntryOffset;
+    uint32_t allocUnit;
+
+    if ((err = SDFind(name, &fileEntryOffset)))
+        return ((uint8_t) SD_EOC_END == err) ? SD_FILENAME_NOT_FOUND : err;
+    if (SD_SUB_DIR
+            & g_sd_vol->buf->buf[fileEntryOffset + SD_FILE_ATTRIBUTE_OFFSET])
+        return SD_ENTRY_NOT_FILE;
+
+    allocUnit = SDReadDat16(
+            &(g_sd_vol->buf->buf[fileEntryOffset + SD_FILE_START_CLSTR_LOW]));
+    if (SD_FAT_32 == g_sd_vol->filesystem) {
+        allocUnit |= SDReadDat16(
+                &(g_sd_vol->buf->buf[fileEntryOffset
+                        + SD_FILE_START_CLSTR_HIGH]))
+                << 16;
+        // Clear the highest 4 bits - they are always reserved
+        allocUnit &= 0x0FFFFFFF;
+    }
+
+#ifdef SD_DIR_INDEX
+    // The index hashes the name, so the entry leaves it before the name is
+    // overwritten
+    if (g_sd_vol->dir_firstAllocUnit == g_sd_vol->dirIndexDir
+            && g_sd_vol->dirIndexBuilt)
+        SDDirIndexRemove(fileEntryOffset);
+#endif
+    g_sd_vol->buf->buf[fileEntryOffset] = SD_DELETED_FILE_MARK;
+    g_sd_vol->buf->mod = 1;
+    g_sd_vol->buf->vol = g_sd_vol;
+
+    // The entry is deleted on the card before its chain is freed, so that a
+    // power loss leaves lost clusters rather than a file in free ones
+    if ((err = SDWriteBackBuf(g_sd_vol->buf)))
+        return err;
+
+    // An empty file may have no clusters at all
+    if (!allocUnit)
+        return 0;
+#ifdef SD_TAIL_CACHE
+    SDTailCacheRemove(allocUnit);
+#endif
+
+    return SDFreeChain(allocUnit);
+}
 
 uint8_t SDCreateFile (const char *name, const uint16_t *fileEntryOffset) {
-    uint8_t i, j;
+    uint8_t err;
+#ifdef SD_DEBUG
+    uint8_t i;
+#endif
     // *name is only checked for uppercase
     char uppercaseName[SD_FILENAME_STR_LEN];
+    uint32_t rawName[SD_SHORT_NAME_WORDS];
     uint32_t allocUnit;
 
 #ifdef SD_DEBUG
@@ -1885,71 +5164,167 @@ uint8_t SDCreateFile (const char *name, const uint16_t *fileEntryOffset) {
     // Write the file fields in order...
 
     /* 1) Short file name */
-    // Write first section
-    for (i = 0; '.' != name[i] && 0 != name[i]; ++i)
-        g_sd_buf.buf[*fileEntryOffset + i] = name[i];
-    // Check if there is an extension
-    if (name[i]) {
-        // There might be an extension - pad first name with spaces
-        for (j = i; j < SD_FILE_NAME_LEN; ++j)
-            g_sd_buf.buf[*fileEntryOffset + j] = ' ';
-        // Check if there is a period, as one would expect for a file name with
-        // an extension
-        if ('.' == name[i]) {
-            // Extension exists, write it
-            ++i;  // Skip the period
-            // Insert extension, character-by-character
-            for (j = SD_FILE_NAME_LEN; name[i]; ++j)
-                g_sd_buf.buf[*fileEntryOffset + j] = name[i++];
-            // Pad extension with spaces
-            for (; j < SD_FILE_NAME_LEN + SD_FILE_EXTENSION_LEN; ++j)
-                g_sd_buf.buf[*fileEntryOffset + j] = ' ';
-        }
-        // If it wasn't a period or null terminator, throw an error
-        else
-            return SD_INVALID_FILENAME;
-    }
-    // No extension, pad with spaces
-    else
-        for (; i < (SD_FILE_NAME_LEN + SD_FILE_EXTENSION_LEN); ++i)
-            g_sd_buf.buf[*fileEntryOffset + i] = ' ';
+    // Normalized first so that an unusable name leaves the entry untouched
+    if ((err = SDNormalizeName(name, (char *) rawName)))
+        return err;
+    memcpy(&(g_sd_vol->buf->buf[*fileEntryOffset]), rawName, SD_SHORT_NAME_LEN);
 
     /* 2) Write attribute field... */
     // TODO: Allow for file attribute flags to be set, such as SD_READ_ONLY,
     //       SD_SUB_DIR, etc
-    g_sd_buf.buf[*fileEntryOffset + SD_FILE_ATTRIBUTE_OFFSET] =
+    g_sd_vol->buf->buf[*fileEntryOffset + SD_FILE_ATTRIBUTE_OFFSET] =
     SD_ARCHIVE;  // Archive flag should be set because the file is new
-    g_sd_buf.mod = 1;
+    g_sd_vol->buf->mod = 1;
+    g_sd_vol->buf->vol = g_sd_vol;
 
 #if (defined SD_VERBOSE && defined SD_DEBUG)
-    SDPrintFileEntry(&(g_sd_buf.buf[*fileEntryOffset]), uppercaseName);
+    SDPrintFileEntry(&(g_sd_vol->buf->buf[*fileEntryOffset]), uppercaseName);
 #endif
 
 #if (defined SD_VERBOSE_BLOCKS && defined SD_VERBOSE && defined SD_DEBUG)
-    SDPrintHexBlock(g_sd_buf.buf, SD_SECTOR_SIZE);
+    SDPrintHexBlock(g_sd_vol->buf->buf, SD_SECTOR_SIZE);
 #endif
 
     /* 3) Find a spot in the FAT (do not check for a full FAT, assume space is
      * available)
      */
     allocUnit = SDFindEmptySpace(0);
-    SDWriteDat16(&(g_sd_buf.buf[*fileEntryOffset + SD_FILE_START_CLSTR_LOW]),
+    SDWriteDat16(
+            &(g_sd_vol->buf->buf[*fileEntryOffset + SD_FILE_START_CLSTR_LOW]),
             (uint16_t) allocUnit);
-    if (SD_FAT_32 == g_sd_filesystem)
+    if (SD_FAT_32 == g_sd_vol->filesystem)
         SDWriteDat16(
-                &(g_sd_buf.buf[*fileEntryOffset + SD_FILE_START_CLSTR_HIGH]),
+                &(g_sd_vol->buf->buf[*fileEntryOffset
+                        + SD_FILE_START_CLSTR_HIGH]),
                 (uint16_t) (allocUnit >> 16));
 
     /* 4) Write the size of the file (currently 0) */
-    SDWriteDat32(&(g_sd_buf.buf[*fileEntryOffset + SD_FILE_LEN_OFFSET]), 0);
+    SDWriteDat32(&(g_sd_vol->buf->buf[*fileEntryOffset + SD_FILE_LEN_OFFSET]),
+            0);
+
+#ifdef SD_DIR_INDEX
+    // Keep the index of the current directory up to date; the entry just used
+    // was the directory's first unused one, so the end moves along by one (to
+    // SD_DIR_INDEX_ENTRIES if the sector is now full)
+    if (g_sd_vol->dir_firstAllocUnit == g_sd_vol->dirIndexDir
+            && g_sd_vol->dirIndexBuilt) {
+        SDDirIndexInsert(*fileEntryOffset);
+        SDDirIndexSetEnd(*fileEntryOffset + SD_FILE_ENTRY_LENGTH);
+    }
+#endif
 
 #if (defined SD_VERBOSE_BLOCKS && defined SD_VERBOSE && defined SD_DEBUG)
     printf("New file entry at offset 0x%08X / %u looks like...\n",
             *fileEntryOffset, *fileEntryOffset);
-    SDPrintHexBlock(g_sd_buf.buf, SD_SECTOR_SIZE);
+    SDPrintHexBlock(g_sd_vol->buf->buf, SD_SECTOR_SIZE);
+#endif
+
+    g_sd_vol->buf->mod = 1;
+    g_sd_vol->buf->vol = g_sd_vol;
+
+    return 0;
+}
+#endif
+
+#ifdef SD_SERVER
+void SDServer (void *par) {
+    sd_server_start *start = (sd_server_start *) par;
+    sd_request *req, *unmount;
+    uint8_t err;
+
+#ifdef SD_DEBUG
+    g_sd_serverId = cogid();
+#endif
+
+    // The cog that drives the chip select has to be the one that starts the
+    // card
+    if (!(err = SDStart(start->mosi, start->miso, start->sclk, start->cs,
+            start->freq)))
+        err = SDMount();
+    start->err = err;
+    start->done = 1;
+    if (err) {
+#ifdef SD_DEBUG
+        g_sd_serverId = -1;
+#endif
+        g_sd_serverRunning = 0;
+        cogstop(cogid());
+    }
+
+    while (1) {
+        while (g_sd_serverHead == g_sd_serverTail)
+            ;
+        req = g_sd_serverQueue[g_sd_serverHead];
+        req->err = SDServeRequest(req);
+        g_sd_serverHead = (g_sd_serverHead + 1) & (SD_SERVER_QUEUE_SIZE - 1);
+
+        if (SD_REQUEST_UNMOUNT == req->type && !req->err) {
+            // Turn away new requests, then fail those still queued
+            while (lockset(g_sd_serverLock))
+                ;
+            g_sd_serverCog = -1;
+            lockclr(g_sd_serverLock);
+            unmount = req;
+            while (g_sd_serverHead != g_sd_serverTail) {
+                req = g_sd_serverQueue[g_sd_serverHead];
+                req->err = SD_SERVER_NOT_RUNNING;
+                req->done = 1;
+                g_sd_serverHead = (g_sd_serverHead + 1)
+                        & (SD_SERVER_QUEUE_SIZE - 1);
+            }
+
+            // Only now may the stack and the queue be given to a new server
+            unmount->done = 1;
+#ifdef SD_DEBUG
+            g_sd_serverId = -1;
+#endif
+            g_sd_serverRunning = 0;
+            cogstop(cogid());
+        }
+
+        req->done = 1;
+    }
+}
+#endif
+
+#ifdef SD_ASYNC
+uint8_t SDServeRequest (sd_request *req) {
+    switch (req->type) {
+        case SD_REQUEST_OPEN:
+            return SDfopen(req->name, req->f, req->mode);
+        case SD_REQUEST_READ:
+            return SDfread(req->dat, req->bytes, req->f, &(req->bytes));
+#ifdef SD_FILE_WRITE
+        case SD_REQUEST_WRITE:
+            return SDfwrite(req->dat, req->bytes, req->f);
+        case SD_REQUEST_FLUSH:
+            return SDfflush(req->f);
+        case SD_REQUEST_CLOSE:
+            return SDfclose(req->f);
+        case SD_REQUEST_UNMOUNT:
+            return SDUnmount();
+#else
+        case SD_REQUEST_CLOSE:
+        case SD_REQUEST_UNMOUNT:
+            // Nothing has been written that would need to be stored
+            return 0;
+#endif
+        default:
+            return SD_INVALID_FILE_MODE;
+    }
+}
+
+uint8_t SDSubmitOrServe (sd_request *req) {
+#ifdef SD_SERVER
+    uint8_t err;
+
+    if (SD_SERVER_NOT_RUNNING != (err = SDServerSubmit(req)))
+        return err;
 #endif
 
-    g_sd_buf.mod = 1;
+    // Without a server cog the calling cog owns the file system
+    req->err = SDServeRequest(req);
+    req->done = 1;
 
     return 0;
 }
@@ -2000,7 +5375,7 @@ void SDPrintFileAttributes (const uint8_t flag) {
 #endif
 
 #ifdef SD_DEBUG
-void SDError (const uint8_t err) {
+void SDErrorHalt (const uint8_t err) {
     char str[] = "SD Error %u: %s\n";
 
     switch (err) {
@@ -2088,13 +5463,45 @@ void SDError (const uint8_t err) {
         case SD_TOO_MANY_FATS:
             printf(str, (err - SD_ERRORS_BASE),
                     "This driver is only capable of writing files on FAT "
-                            "partitions with two (2) copies of the FAT");
+                            "partitions with at least one copy of the FAT");
             break;
         case SD_FILE_WITHOUT_BUFFER:
             printf(str, (err - SD_ERRORS_BASE),
                     "SDfopen() was passed a file struct with "
                             "an uninitialized buffer");
             break;
+        case SD_ENTRY_NOT_DIR:
+            printf(str, (err - SD_ERRORS_BASE),
+                    "Requested directory entry is not a directory");
+            break;
+        case SD_INSUFFICIENT_SPACE:
+            printf(str, (err - SD_ERRORS_BASE),
+                    "Not enough contiguous free space on the SD card");
+            break;
+        case SD_BUSY_TIMEOUT:
+            printf(str, (err - SD_ERRORS_BASE),
+                    "SD card remained busy after a write");
+            break;
+        case SD_RAW_PROTECTED:
+            printf(str, (err - SD_ERRORS_BASE),
+                    "Raw region overlaps a FAT partition or the MBR");
+            break;
+        case SD_RAW_OUT_OF_RANGE:
+            printf(str, (err - SD_ERRORS_BASE),
+                    "Sectors lie outside the raw region");
+            break;
+        case SD_DEVICE_ERROR:
+            printf(str, (err - SD_ERRORS_BASE),
+                    "The block device failed to transfer data");
+            break;
+        case SD_SERVER_NOT_RUNNING:
+            printf(str, (err - SD_ERRORS_BASE),
+                    "The server cog is not running");
+            break;
+        case SD_SERVER_QUEUE_FULL:
+            printf(str, (err - SD_ERRORS_BASE),
+                    "The server cog's request queue is full");
+            break;
         default:
             // Is the error an SPI error?
             if (err > SD_ERRORS_BASE
@@ -44,7 +44,9 @@
 #include <stdlib.h>
 #include <string.h>
 #include <PropWare.h>
+#ifdef __propeller__
 #include <spi.h>
+#endif
 
 /**
  * @defgroup _propware_sd           FAT16/32 SD card
@@ -76,12 +78,252 @@
  *                              NOTE: Work-in-progress, code size is not
  *                              necessarily at a minimum, nor is RAM usage
  *                              DEFAULT: ON
+ * @param    SD_BUFFER_POOL     A small pool of sector buffers is kept by the
+ *                              driver; files opened without a buffer of their
+ *                              own borrow the least recently used one so that
+ *                              interleaved access to a few files does not
+ *                              reload a sector on every call. The directory
+ *                              borrows one too whenever a file holds the
+ *                              volume's directory buffer. Costs
+ *                              SD_BUFFER_POOL_SIZE buffers of hub RAM
+ *                              DEFAULT: ON
+ * @param    SD_DIR_INDEX       The entries of the current directory are indexed
+ *                              by a hash of their names the first time the
+ *                              directory is searched; later searches read only
+ *                              the one sector holding the requested entry
+ *                              DEFAULT: ON
+ * @param    SD_PATH_CACHE      Directories found while walking a path are
+ *                              remembered by parent and name so that opening
+ *                              another file deep in a tree does not search
+ *                              every parent directory again
+ *                              DEFAULT: ON
+ * @param    SD_FAT_MIRROR_LAZY Modified FAT sectors are only written to the
+ *                              first copy of the FAT when evicted; the other
+ *                              copies are brought up to date in one pass by
+ *                              SDfclose(), SDUnmount() or SDsync()
+ *                              DEFAULT: ON
+ * @param    SD_TAIL_CACHE      The last cluster of recently closed files is
+ *                              remembered so that reopening a large file to
+ *                              append to it does not walk its cluster chain;
+ *                              a remembered cluster is checked with a walk
+ *                              from the file's last seek checkpoint. Requires
+ *                              SD_SEEK_CHECKPOINTS
+ *                              DEFAULT: ON
+ * @param    SD_READ_AHEAD      Once a file read with SDfgetc() or SDfread() is
+ *                              halfway through a sector, its next sector is
+ *                              requested into a free pool buffer, which the
+ *                              SPI cog receives while the application carries
+ *                              on. Only applies to files using pool buffers;
+ *                              requires SD_BUFFER_POOL and SPI_FAST_SECTOR
+ *                              (spi.h), since without a background transfer
+ *                              it would only read the next sector early
+ *                              DEFAULT: ON
+ * @param    SD_AU_ALIGN        The card's allocation unit (the region it erases
+ *                              and programs as a whole) is read by SDStart();
+ *                              a growing file that can not continue into the
+ *                              clusters after its end moves on to the start of
+ *                              a free allocation unit instead of the first
+ *                              free cluster. Requires SD_FILE_WRITE
+ *                              DEFAULT: ON
+ * @param    SD_ERASE_FREED     Clusters freed by SDremove(), SDftruncate() or
+ *                              SDfclose() are erased on the card (CMD32, CMD33
+ *                              and CMD38) so that writing them again later runs
+ *                              at full speed; freeing clusters takes longer
+ *                              DEFAULT: OFF
+ * @param    SD_FREE_SPACE      Free clusters are counted by SDMount() (from
+ *                              the FSInfo sector of FAT32 when it holds a
+ *                              count, otherwise by reading the FAT) and the
+ *                              count is kept current as clusters are claimed
+ *                              and freed, so that SDGetFreeSpace() needs no
+ *                              access to the card
+ *                              DEFAULT: ON
+ * @param    SD_MULTI_BLOCK     Whole sectors passed to SDfread() or SDfwrite()
+ *                              are transferred with one multi-block command
+ *                              (CMD18 or CMD25) for each run of clusters that
+ *                              lie one after another on the card, instead of
+ *                              one command per sector
+ *                              DEFAULT: ON
+ * @param    SD_SEEK_CHECKPOINTS A file may be given a table before it is
+ *                              opened (see SDfopen()) in which it remembers
+ *                              the allocation unit of every 2^k-th cluster
+ *                              (k doubles whenever the file outgrows it), so
+ *                              that a seek walks the FAT from the nearest
+ *                              checkpoint rather than from the file's first
+ *                              cluster; the table's length is the only memory
+ *                              it costs
+ *                              DEFAULT: ON
+ * @param    SD_RAW_BLOCKS      Public functions read, write and erase sectors
+ *                              of a region outside the FAT volume, such as a
+ *                              reserved partition, without a filesystem. A
+ *                              region may not overlap the MBR, the mounted
+ *                              volume or any FAT partition
+ *                              DEFAULT: OFF
+ * @param    SD_RING_LOG        Records of up to SD_RING_RECORD_SIZE bytes are
+ *                              appended to a raw region, one sector each,
+ *                              overwriting the oldest once the region is full.
+ *                              After a reset the end of the log is found with a
+ *                              binary search. Requires SD_RAW_BLOCKS
+ *                              DEFAULT: OFF
+ * @param    SD_CARD            The SD card is driven over SPI, started by
+ *                              SDStart(), and is the default block device.
+ *                              Only a Propeller has one: built for a host
+ *                              computer (see host/Makefile) the driver leaves
+ *                              out the card and the options that need it or
+ *                              another cog, and mounts image files through
+ *                              SD_BLOCK_FILE instead
+ *                              DEFAULT: ON
+ * @param    SD_BLOCK_FILE      SDFileDevice() sets up a block device backed by
+ *                              a stdio image file, so that the file system can
+ *                              be mounted from a card image, e.g. to test it
+ *                              on a host computer
+ *                              DEFAULT: OFF
+ * @param    SD_RAM_DISK        SDRamDevice() sets up a block device in a region
+ *                              of hub (or external) memory for scratch files;
+ *                              SDRamCopy() moves a finished file to the SD
+ *                              card in multi-block writes. Requires
+ *                              SD_FILE_WRITE
+ *                              DEFAULT: OFF
+ * @param    SD_ASYNC           SDfread_async() and SDfwrite_async() start a
+ *                              transfer that is checked with SDpoll() or
+ *                              SDwait(). Without a server cog (see SD_SERVER)
+ *                              the transfer is carried out before returning,
+ *                              so the same code runs with and without one
+ *                              DEFAULT: OFF
+ * @param    SD_SERVER          SDServerStart() gives the file system to a cog
+ *                              of its own; any cog may then open, read,
+ *                              write, flush and close files by queuing
+ *                              requests with SDServerSubmit(), or start
+ *                              transfers with SDfread_async() and
+ *                              SDfwrite_async(). Implies SD_ASYNC. With
+ *                              SD_DEBUG, an error in the server cog is still
+ *                              returned in the request rather than halting
+ *                              DEFAULT: OFF
  */
 #define SD_DEBUG
 #define SD_VERBOSE
 #define SD_VERBOSE_BLOCKS
 #define SD_SHELL
 #define SD_FILE_WRITE
+#define SD_BUFFER_POOL
+
+#ifdef SD_BUFFER_POOL
+// Number of buffers in the pool; g_sd_buf is never lent
+#define SD_BUFFER_POOL_SIZE     2
+#endif
+#define SD_DIR_INDEX
+
+#ifdef SD_DIR_INDEX
+// Number of slots in the directory index (must be a power of 2); directories
+// with more than 3/4 this many short names are only partially indexed
+#define SD_DIR_INDEX_SIZE       64
+#endif
+#define SD_PATH_CACHE
+
+#ifdef SD_PATH_CACHE
+// Number of (parent directory, name) pairs remembered by the path cache
+#define SD_PATH_CACHE_SIZE      8
+#endif
+#define SD_FAT_MIRROR_LAZY
+
+#if (defined SD_FAT_MIRROR_LAZY && defined SD_FILE_WRITE)
+// Number of FAT sectors that may await mirroring; when full, sectors are
+// mirrored as they are evicted
+#define SD_FAT_DIRTY_SIZE       16
+#endif
+
+#define SD_TAIL_CACHE
+
+#if (defined SD_TAIL_CACHE && defined SD_FILE_WRITE)
+// Number of closed files whose last cluster is remembered
+#define SD_TAIL_CACHE_SIZE      4
+#endif
+
+#define SD_READ_AHEAD
+
+#if (!defined SD_BUFFER_POOL || !defined SPI_FAST_SECTOR)
+// Read-ahead receives sectors into pool buffers in the background
+#undef SD_READ_AHEAD
+#endif
+
+#ifdef SD_FILE_WRITE
+// Most clusters claimed at once when a growing file is extended; the count
+// starts at 1 for each opened file, doubles with every extension that follows
+// the previous one within SD_EXTEND_SLOW_MS per cluster claimed and halves
+// with every one that does not
+#define SD_EXTEND_MAX_CLUSTERS  16
+#define SD_EXTEND_SLOW_MS       1000
+#endif
+
+#define SD_AU_ALIGN
+
+#ifdef SD_FILE_WRITE
+// Number of allocation unit boundaries checked for free space before falling
+// back to the first free cluster
+#define SD_AU_SEARCH_MAX        16
+#else
+// Only written files are placed
+#undef SD_AU_ALIGN
+#endif
+//#define SD_ERASE_FREED
+#define SD_FREE_SPACE
+#define SD_MULTI_BLOCK
+#define SD_SEEK_CHECKPOINTS
+//#define SD_RAW_BLOCKS
+//#define SD_RING_LOG
+
+#ifndef SD_RAW_BLOCKS
+// The ring log is kept in a raw region
+#undef SD_RING_LOG
+#endif
+#define SD_CARD
+//#define SD_BLOCK_FILE
+//#define SD_RAM_DISK
+
+#ifdef SD_RAM_DISK
+// Root directory entries of a volume made by SDRamFormat() (a multiple of 16)
+#define SD_RAM_ROOT_ENTRIES     64
+#endif
+#ifndef SD_FILE_WRITE
+// Nothing could be stored on a RAM disk
+#undef SD_RAM_DISK
+#endif
+//#define SD_ASYNC
+//#define SD_SERVER
+
+#ifdef SD_SERVER
+// Requests that may wait in the server's queue (must be a power of 2)
+#define SD_SERVER_QUEUE_SIZE    8
+// Bytes of stack of the server cog, the C kernel's thread state included
+#define SD_SERVER_STACK_SIZE    1024
+// The server carries out requests with the same code as the inline fallback
+#ifndef SD_ASYNC
+#define SD_ASYNC
+#endif
+#endif
+
+#ifndef SD_FILE_WRITE
+// Clusters are only freed by writing
+#undef SD_ERASE_FREED
+#endif
+
+#ifndef SD_SEEK_CHECKPOINTS
+// A cached tail is checked by walking from the file's last checkpoint
+#undef SD_TAIL_CACHE
+#endif
+
+#ifndef __propeller__
+// A host computer has no SD card, SPI bus or other cogs
+#undef SD_CARD
+#endif
+
+#ifndef SD_CARD
+// Volumes are kept in image files; allocation units, read-ahead and the server
+// cog all belong to the card
+#define SD_BLOCK_FILE
+#undef SD_AU_ALIGN
+#undef SD_READ_AHEAD
+#undef SD_SERVER
+#endif
 
 #define SD_LINE_SIZE            16
 #define SD_SECTOR_SIZE          512
@@ -105,6 +347,21 @@ typedef enum {
     SEEK_END   // End of the file
 } file_pos;
 
+#ifdef SD_BLOCK_FILE
+// After file_pos, whose SEEK_* members would clash with stdio's macros
+#include <stdio.h>
+#include <limits.h>
+#endif
+
+#ifdef SD_FILE_WRITE
+// When a file's modified sector and length are written to the SD card
+typedef enum {
+    SD_SYNC_WRITE_BACK,  // Only when the buffer is reused, or on flush/close
+    SD_SYNC_PERIODIC,  // After a number of bytes and/or milliseconds of writes
+    SD_SYNC_WRITE_THROUGH  // At the end of every write call
+} sd_sync_policy;
+#endif
+
 // Error codes - preceded by SPI
 #define SD_ERRORS_BASE          16
 #define SD_ERRORS_LIMIT         32
@@ -127,11 +384,108 @@ typedef enum {
 #define SD_TOO_MANY_FATS        SD_ERRORS_BASE + 16
 #define SD_READING_PAST_EOC     SD_ERRORS_BASE + 17
 #define SD_FILE_WITHOUT_BUFFER  SD_ERRORS_BASE + 18
-#define SD_ERRORS_SIZE          SD_ERRORS_BASE + 19
+#define SD_ENTRY_NOT_DIR        SD_ERRORS_BASE + 19
+#define SD_INSUFFICIENT_SPACE   SD_ERRORS_BASE + 20
+#define SD_BUSY_TIMEOUT         SD_ERRORS_BASE + 21
+#define SD_RAW_PROTECTED        SD_ERRORS_BASE + 22
+#define SD_RAW_OUT_OF_RANGE     SD_ERRORS_BASE + 23
+#define SD_DEVICE_ERROR         SD_ERRORS_BASE + 24
+#define SD_SERVER_NOT_RUNNING   SD_ERRORS_BASE + 25
+#define SD_SERVER_QUEUE_FULL    SD_ERRORS_BASE + 26
+#define SD_ERRORS_SIZE          SD_ERRORS_BASE + 27
+
+typedef struct _sd_block_dev sd_block_dev;
+
+// Operations of a block device; addresses count SD_SECTOR_SIZE-byte sectors
+// and each returns 0 upon success, error code otherwise
+typedef struct {
+    uint8_t (*read) (sd_block_dev *dev, uint32_t address, uint8_t *dat);
+    uint8_t (*write) (sd_block_dev *dev, uint32_t address, uint8_t *dat);
+    // Consecutive sectors; NULL to transfer one sector at a time
+    uint8_t (*readMulti) (sd_block_dev *dev, uint32_t address, uint32_t count,
+            uint8_t *dat);
+    uint8_t (*writeMulti) (sd_block_dev *dev, uint32_t address,
+            uint32_t count, uint8_t *dat);
+    // Store everything written so far; NULL if writes are never held back
+    uint8_t (*sync) (sd_block_dev *dev);
+    // Discard sectors to speed up writing them later; may be NULL
+    uint8_t (*erase) (sd_block_dev *dev, uint32_t address, uint32_t count);
+} sd_block_ops;
+
+// Storage holding the FAT volume (see SDSetBlockDevice())
+struct _sd_block_dev {
+    const sd_block_ops *ops;
+    void *priv;  // Belongs to the backend
+};
+
+// An SD card on the SPI bus, selected by its own chip select pin (see
+// SDCardDevice())
+typedef struct {
+    uint32_t cs;  // Chip select pin mask
+    uint8_t busy;  // The card may still be busy with the last write or erase (SD_BUSY_*)
+#ifdef SD_AU_ALIGN
+    uint8_t auShift;  // log_2 of the card's allocation unit in sectors; 0 if unknown
+#endif
+} sd_card;
+
+#ifdef SD_RAM_DISK
+// Memory holding a RAM disk (see SDRamDevice())
+typedef struct {
+    uint8_t *mem;  // Long-aligned; sectors * SD_SECTOR_SIZE bytes
+    uint32_t sectors;
+} sd_ram_disk;
+#endif
+
+#ifdef SD_RAW_BLOCKS
+// Sectors of the card accessed without a filesystem (see SDRawRegion()); raw
+// writes and erases check again that they stay clear of the MBR and the
+// mounted volume
+typedef struct {
+    uint32_t first;  // Address of the region's first sector
+    uint32_t count;  // Number of sectors in the region
+} sd_raw_region;
+
+#ifdef SD_RING_LOG
+// Bytes of data carried by each record of a ring log
+#define SD_RING_RECORD_SIZE     (SD_SECTOR_SIZE - 12)
+
+typedef struct {
+    sd_raw_region region;  // One record is stored in each sector
+    uint32_t next;  // Sequence number of the next record to be appended
+    uint8_t buf[SD_SECTOR_SIZE];  // Holds a record on its way to or from the card
+} sd_ring_log;
+#endif
+#endif
 
-// Forward declarations for buffers and files
+// Forward declarations for buffers, files and volumes
 typedef struct _sd_buffer sd_buffer;
 typedef struct _sd_file sd_file;
+typedef struct _sd_volume sd_volume;
+
+#ifdef SD_ASYNC
+// Operations carried out by the server cog
+typedef enum {
+    SD_REQUEST_OPEN,  // SDfopen(name, f, mode)
+    SD_REQUEST_READ,  // SDfread(dat, bytes, f, &bytes)
+    SD_REQUEST_WRITE,  // SDfwrite(dat, bytes, f)
+    SD_REQUEST_FLUSH,  // SDfflush(f)
+    SD_REQUEST_CLOSE,  // SDfclose(f)
+    SD_REQUEST_UNMOUNT  // SDUnmount(); once it succeeds, the server cog stops
+} sd_request_type;
+
+// A request for the server cog; it belongs to the server from
+// SDServerSubmit() until done is set
+typedef struct {
+    sd_request_type type;
+    sd_file *f;
+    const char *name;  // SD_REQUEST_OPEN
+    sd_file_mode mode;  // SD_REQUEST_OPEN
+    uint8_t *dat;  // SD_REQUEST_READ and SD_REQUEST_WRITE
+    uint32_t bytes;  // Bytes to transfer; replaced by the bytes read
+    uint8_t err;  // Result of the operation; valid once done is set
+    volatile uint8_t done;  // Set when the request completes
+} sd_request;
+#endif
 
 /**
  * In case the system is low on RAM, allow the external program to access the
@@ -143,7 +497,10 @@ extern sd_buffer g_sd_buf;
  * @brief       Initialize SD card communication over SPI for 3.3V configuration
  *
  * @detailed    Starts an SPI cog IFF an SPI cog has not already been started;
- *              If one has been started, only the cs parameter will have effect
+ *              If one has been started, only the cs parameter will have effect.
+ *              The card started is the one holding the selected volume (see
+ *              SDSelectVolume()), or the default card if that volume is not on
+ *              a card
  *
  * @param       mosi        Pin mask for MOSI pin
  * @param       miso        Pin mask for MISO pin
@@ -158,673 +515,2639 @@ extern sd_buffer g_sd_buf;
 uint8_t SDStart (const uint32_t mosi, const uint32_t miso, const uint32_t sclk,
         const uint32_t cs, const uint32_t freq);
 
+#ifdef SD_SERVER
 /**
- * @brief   Mount either FAT16 or FAT32 filesystem
+ * @brief       Start a cog that owns the SD card and its file system
  *
- * @return  Returns 0 upon success, error code otherwise
+ * @detailed    The server cog starts the SD card and mounts it itself, since
+ *              a cog can not drive the chip select low while another holds
+ *              it high. Returns once the card is mounted. From then on only
+ *              the server cog may call the other SD functions; every cog,
+ *              the calling one included, uses SDServerSubmit()
+ *
+ * @param       mosi        Pin mask for MOSI pin
+ * @param       miso        Pin mask for MISO pin
+ * @param       sclk        Pin mask for SCLK pin
+ * @param       cs          Pin mask for CS pin
+ * @param       freq        See SDStart()
+ *
+ * @return      Returns 0 upon success, error code otherwise
  */
-uint8_t SDMount (void);
+uint8_t SDServerStart (const uint32_t mosi, const uint32_t miso,
+        const uint32_t sclk, const uint32_t cs, const uint32_t freq);
 
-#ifdef SD_FILE_WRITE
 /**
- * @brief   Stop all SD activities and write any modified buffers
+ * @brief       Queue a request for the server cog
  *
- * @pre     All files must be explicitly closed before
+ * @detailed    Safe to call from any cog; the queue is guarded by a hub lock.
+ *              Returns without waiting for the request to be carried out:
+ *              the caller may continue until req->done is set, after which
+ *              req->err holds the result. Requests are carried out in the
+ *              order in which they are queued. Neither the request nor the
+ *              memory and file that it refers to may be touched before then
  *
- * @return  Returns 0 upon success, error code otherwise
+ * @param       *req    Request with type and the parameters of that type set
+ *
+ * @return      Returns 0 if the request is queued, SD_SERVER_QUEUE_FULL if
+ *              SD_SERVER_QUEUE_SIZE - 1 requests are already waiting (the
+ *              request may be submitted again later) or SD_SERVER_NOT_RUNNING
  */
-uint8_t SDUnmount (void);
+uint8_t SDServerSubmit (sd_request *req);
 #endif
 
+#ifdef SD_ASYNC
 /**
- * @brief    Change the current working directory to *f (similar to 'cd f')
- *
- * @param    *d     Short filename of directory to change to
- *
- * @return   Returns 0 upon success, error code otherwise
+ * @brief       Start reading from a file and return without waiting for the
+ *              data
+ *
+ * @detailed    The read is carried out by the server cog, so that the caller
+ *              can work on other data meanwhile. Without a server cog it is
+ *              carried out before returning, so code written for the server
+ *              also runs without it. Completion is checked with SDpoll() or
+ *              SDwait(); req->bytes then holds the number of bytes read
+ *
+ * @param       dat[]   Location in memory for the data; may not be touched
+ *                      until the read completes
+ * @param       bytes   Number of bytes to read
+ * @param       *f      Open file; may not be used until the read completes
+ * @param       *req    Handle of the read; may not be reused until it
+ *                      completes
+ *
+ * @return      Returns 0 if the read has been started (or carried out),
+ *              SD_SERVER_QUEUE_FULL if it has to be started again later
  */
-uint8_t SDchdir (const char *d);
+uint8_t SDfread_async (uint8_t dat[], const uint32_t bytes, sd_file *f,
+        sd_request *req);
 
+#ifdef SD_FILE_WRITE
 /**
- * @brief       Open a file with a given name and load its information into the
- *              file pointer
- *
- * @detailed    Load the first sector of a file into the file buffer; Initialize
- *              global character pointers; NOTE: currently, only one file mode
- *              is supported and is best described as "r+"; NOTE: two position
- *              pointers are used, one for writing and one for reading, this may
- *              be changed later to comply with POSIX standards but is useful
- *              for my own purposes at the moment
- *              NOTE: This driver does not include any provision for timestamps;
- *              Niether file modification or creation will changed file's
- *              timestamp data (creation times are random and uninitialized)
+ * @brief       Start writing to a file and return without waiting for the
+ *              data to be written
  *
- * @pre         Files cannot be created in the root directory of a FAT16
- *              filesystem
- *              TODO: Fix this
+ * @detailed    Filling one buffer while another is being written keeps the
+ *              card busy without stalling the producer. See SDfread_async()
  *
- * @param       *name   C-string containing the filename to open
- * @param       *f      Address where file information (such as the first
- *                      allocation unit) can be stored. Multiple files opened
- *                      simultaneously is allowed.
+ * @param       dat[]   Data to write; may not be touched until the write
+ *                      completes
+ * @param       bytes   Number of bytes to write
+ * @param       *f      Open file; may not be used until the write completes
+ * @param       *req    Handle of the write; may not be reused until it
+ *                      completes
  *
- * @return      Returns 0 upon success, error code otherwise
+ * @return      Returns 0 if the write has been started (or carried out),
+ *              SD_SERVER_QUEUE_FULL if it has to be started again later
  */
-uint8_t SDfopen (const char *name, sd_file *f, const sd_file_mode mode);
+uint8_t SDfwrite_async (const uint8_t dat[], const uint32_t bytes, sd_file *f,
+        sd_request *req);
+#endif
 
-#ifdef SD_FILE_WRITE
 /**
- * @brief   Close a given file
+ * @brief       Check whether a request has completed
  *
- * @param   *f      Address of the file object to close
+ * @param       *req    Request started with SDServerSubmit() or an
+ *                      asynchronous file function
  *
- * @return  Returns 0 upon success, error code otherwise
+ * @return      Returns non-zero once the request has completed, 0 otherwise
  */
-uint8_t SDfclose (sd_file *f);
+inline uint8_t SDpoll (const sd_request *req);
 
 /**
- * @brief       Insert a character into a given file
- *
- * @detailed    Insert 'c' at the location pointed to by the file's write
- *              pointer; Note: the read and write pointers may be merged into
- *              one at a later date
+ * @brief       Wait for a request to complete
  *
- * @param       c       Character to be inserted
- * @param       *f      Address of the desired file object
+ * @param       *req    Request started with SDServerSubmit() or an
+ *                      asynchronous file function
  *
- * @return      Returns 0 upon success, error code otherwise
+ * @return      Returns 0 if the request succeeded, error code otherwise
  */
-uint8_t SDfputc (const char c, sd_file *f);
+uint8_t SDwait (const sd_request *req);
+#endif
 
 /**
- * @brief       Insert a c-string into a file
- *
- * @detailed    Insert an array of bytes into the file object pointed to by 'f'
- *              beginning at address 's' until the value 0 is reached
- *
- * @param       *s  C-string to be inserted
- * @param       *f  Address of file object
+ * @brief   Mount either FAT16 or FAT32 filesystem
  *
- * @return      Returns 0 upon success, error code otherwise
+ * @return  Returns 0 upon success, error code otherwise
  */
-uint8_t SDfputs (char *s, sd_file *f);
-#endif
+uint8_t SDMount (void);
 
 /**
- * @brief       Read one character from the currently opened file.
- *
- * @detailed    NOTE: This function does not include error checking
- *
- * @pre         *f must point to a currently opened and valid file
- * @pre         The file must have at least one byte left - no error checking is
- *              performed to stop the user from reading past the end of a file
- *              (call SDfeof() for end-of-file check)
+ * @brief   Mount the FAT16 or FAT32 filesystem of a given volume, whichever
+ *          volume is selected (see SDMount())
  *
- * @param       *f  Address where file information (such as the first allocation
- *                  unit) can be stored.
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
  *
- * @return      Returns the character pointed to by the g_sd_rPtr pointer
+ * @return  Returns 0 upon success, error code otherwise
  */
-char SDfgetc (sd_file *f);
+uint8_t SDMountVol (sd_volume *vol);
 
 /**
- * @brief   Read a line from a file until either 'size' characters have been
- *          read or a newline is found; Parameters should match stdio.h's fgets
- *          except for the file pointer
- *          NOTE: This function does not include error checking
+ * @brief   Select the block device of the selected volume, which SDMount()
+ *          mounts next
  *
- * @pre     *f must point to a currently opened and valid file
- *
- * @param   s[]        Character array to store file characters
- * @param   size    Maximum number of characters to read from the file
- * @param   *f        Address with the currently opened file
+ * @detailed    Everything the file system reads or writes goes through the
+ *              device; SDStart() is only needed for the SD card. The device
+ *              must not change while the volume is mounted
  *
- * @return  Returns character memory location of character array
+ * @param   *dev    A block device, or NULL for the SD card (the default)
  */
-char * SDfgets (char s[], uint32_t size, sd_file *f);
+void SDSetBlockDevice (sd_block_dev *dev);
 
 /**
- * @brief   Determine whether the read pointer has reached the end of the file
+ * @brief   Set up a block device for another SD card on the same SPI bus
  *
- * @Pre:    *f must point to a currently opened and valid file
- *
- * @param   *f  Address of the requested file
+ * @detailed    Each card has its own chip select pin; SDStart() is called for
+ *              it with the card's volume selected. Cards may then be written
+ *              in turn, each programming its last sector while the next card
+ *              receives data
  *
- * @return  Returns true if the read pointer points to the end of the file,
- *          false otherwise
+ * @param   *dev    Address of the block device to be set up
+ * @param   *card   Address of the card's state; must stay valid while the
+ *                  device is used
  */
-inline uint8_t SDfeof (sd_file *f);
+void SDCardDevice (sd_block_dev *dev, sd_card *card);
 
 /**
- * @brief   Set the read pointer for a given file to the position 'origin +
- *          offset'
+ * @brief   Set up a volume, in addition to the default one, that may be
+ *          mounted at the same time as others
+ *
+ * @detailed    A volume carries everything that SDMount() learns about a
+ *              file system, its working directory and its caches. Each takes
+ *              roughly SD_SECTOR_SIZE bytes for its FAT buffer plus the
+ *              directory index and caches
+ *
+ * @param   *vol    Address of the volume to be set up
+ * @param   *dev    Block device holding the volume, or NULL for the SD card
+ * @param   *buf    Directory buffer of the volume; like g_sd_buf, it may be
+ *                  lent to the volume's files but not to other volumes' files
+ */
+void SDVolumeInit (sd_volume *vol, sd_block_dev *dev, sd_buffer *buf);
+
+/**
+ * @brief   Select the volume used by the functions that are not given an open
+ *          file
+ *
+ * @detailed    SDMount(), SDUnmount(), SDsync(), SDchdir(), SDfopen(),
+ *              SDremove(), the raw block functions and the functions that
+ *              select a device or start a card act on the selected volume.
+ *              Functions given an open file act on the volume that the file
+ *              was opened on, whichever volume is selected. The variants
+ *              ending in Vol, such as SDfopenVol(), are given their volume
+ *              instead, so that cogs and libraries need not share a
+ *              selection
+ *
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
+ */
+void SDSelectVolume (sd_volume *vol);
+
+#ifdef SD_BLOCK_FILE
+/**
+ * @brief   Set up a block device that keeps the volume in an image file, such
+ *          as a card image on a host computer
  *
- * @Pre:    *f must be an opened file
+ * @param   *dev    Address of the block device to be set up
+ * @param   *image  Image file opened for reading (and writing, to write files)
+ */
+void SDFileDevice (sd_block_dev *dev, FILE *image);
+#endif
+
+#ifdef SD_RAM_DISK
+/**
+ * @brief   Set up a block device that keeps the volume in memory
  *
- * @param   *f      Address of the file object being referenced
- * @param   offset  Bytes beyond 'origin' to set the pointer to
- * @param   origin  Gives a reference to the offset; can be one of SEEK_SET,
- *                  SEEK_CUR, SEEK_END
+ * @detailed    Scratch files on a RAM disk are read and written at memory
+ *              speed and cost the SD card no wear. The memory must be
+ *              formatted with SDRamFormat() before the disk is first mounted
  *
- * @return  Returns 0 upon success, error code otherwise
+ * @param   *dev        Address of the block device to be set up
+ * @param   *disk       Address of the RAM disk description to be set up; must
+ *                      stay valid as long as the device is used
+ * @param   mem[]       Long-aligned memory for the disk
+ * @param   sectors     Size of mem[] in SD_SECTOR_SIZE-byte sectors
  */
-uint8_t SDfseekr (sd_file *f, const int32_t offset, const file_pos origin);
+void SDRamDevice (sd_block_dev *dev, sd_ram_disk *disk, uint8_t mem[],
+        const uint32_t sectors);
 
 /**
- * @brief   Set the write pointer for a given file to the position 'origin +
- *          offset'
+ * @brief   Create an empty FAT16 volume with one-sector clusters (larger if
+ *          there would be too many) on a RAM disk
  *
- * @Pre:    *f must be an opened file
+ * @detailed    The volume may hold fewer clusters than the FAT16 minimum;
+ *              SDMount() accepts that from a RAM disk only. The root
+ *              directory holds SD_RAM_ROOT_ENTRIES entries
  *
- * @param   *f      Address of the file object being referenced
- * @param   offset  Bytes beyond 'origin' to set the pointer to
- * @param   origin  Gives a reference to the offset; can be one of SEEK_SET,
- *                  SEEK_CUR, SEEK_END
+ * @param   *disk   RAM disk set up by SDRamDevice(); must not be mounted
  *
  * @return  Returns 0 upon success, error code otherwise
  */
-uint8_t SDfseekw (sd_file *f, const int32_t offset, const file_pos origin);
+uint8_t SDRamFormat (const sd_ram_disk *disk);
 
 /**
- * @brief   Retrieve the current position of the read pointer
+ * @brief   Append a file of a RAM disk to an open file of the mounted volume
  *
- * @Pre:    *f must be an opened file
+ * @detailed    The RAM disk is read in place without being mounted, so the
+ *              SD card can stay mounted. Each run of consecutive clusters is
+ *              passed to SDfwrite() whole, which writes the sectors that it
+ *              covers straight from the RAM disk with multi-block writes
  *
- * @param   *f  Address of the file object being referenced
+ * @note    Does not currently follow paths; the file must be in the root
+ *          directory of the RAM disk
  *
- * @return  Returns the byte offset (from beginning) of the read pointer
+ * @pre     The RAM disk must have been unmounted since it was last written
+ *
+ * @param   *disk   RAM disk set up by SDRamDevice()
+ * @param   *name   Short filename of the file on the RAM disk
+ * @param   *f      Destination, opened for writing on the mounted volume
+ *
+ * @return  Returns 0 upon success, error code otherwise
  */
-inline file_pos SDftellr (const sd_file *f);
+uint8_t SDRamCopy (const sd_ram_disk *disk, const char *name, sd_file *f);
+#endif
 
+#ifdef SD_FILE_WRITE
 /**
- * @brief   Retrieve the current position of the write pointer
- *
- * @Pre:    *f must be an opened file
+ * @brief   Stop all SD activities and write any modified buffers
  *
- * @param   *f  Address of the file object being referenced
+ * @pre     All files must be explicitly closed before
  *
- * @return  Returns the byte offset (from beginning) of the write pointer
+ * @return  Returns 0 upon success, error code otherwise
  */
-inline file_pos SDftellw (const sd_file *f);
-
-#ifdef SD_SHELL
-// Shell definitions
-#define SD_SHELL_INPUT_LEN          64
-#define SD_SHELL_CMD_LEN            8
-#define SD_SHELL_ARG_LEN            32
-#define SD_SHELL_EXIT               ("exit")
-#define SD_SHELL_LS                 ("ls")
-#define SD_SHELL_CAT                ("cat")
-#define SD_SHELL_CD                 ("cd")
-#define SD_SHELL_TOUCH              ("touch")
+uint8_t SDUnmount (void);
 
 /**
- * @brief   Provide the user with a very basic Unix-like shell. The following
- *          commands are available to the user: ls, cat, cd.
+ * @brief   Unmount a given volume, whichever volume is selected (see
+ *          SDUnmount())
  *
- * @param   *f  If a file is opened via a command such as 'cat', its information
- *              will be stored at this address
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
  *
  * @return  Returns 0 upon success, error code otherwise
  */
-uint8_t SD_Shell (sd_file *f);
+uint8_t SDUnmountVol (sd_volume *vol);
 
 /**
- * @brief   List the contents of a directory on the screen (similar to 'ls .')
+ * @brief   Write all modified file system metadata (the directory and FAT
+ *          buffers) to the SD card and bring every copy of the FAT up to date
  *
- * @note    TODO: Implement *abspath when SDGetSectorFromPath() is functional
- *
- * @param   *absPath    Absolute path of the directory to be printed
+ * @detailed    Open files are not affected; their buffers are written by
+ *              SDfclose(). Returns once the block device has stored the data
  *
  * @return  Returns 0 upon success, error code otherwise
  */
-uint8_t SD_Shell_ls (void);
+uint8_t SDsync (void);
 
 /**
- * @brief   Dump the contents of a file to the screen (similar to 'cat f');
+ * @brief   Write a given volume's modified metadata, whichever volume is
+ *          selected (see SDsync())
  *
- * @note:   Does not currently follow paths
- *
- * @param   *f  Short filename of file to print
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
  *
  * @return  Returns 0 upon success, error code otherwise
  */
-uint8_t SD_Shell_cat (const char *name, sd_file *f);
+uint8_t SDsyncVol (sd_volume *vol);
+#endif
 
+#ifdef SD_FREE_SPACE
 /**
- * @brief   Change the current working directory to *f (similar to 'cd f');
+ * @brief   Report the free space left on the mounted partition
  *
- * @param   *d  Short filename of directory to change to
+ * @detailed    Returns a count kept by the driver; the card is not accessed
  *
- * @return  Returns 0 upon success, error code otherwise
+ * @return  Returns the number of free sectors (SD_SECTOR_SIZE bytes each)
  */
-uint8_t SD_Shell_cd (const char *d);
+uint32_t SDGetFreeSpace (void);
 
-#ifdef SD_FILE_WRITE
 /**
- * @brief   Create a new file, do not open it
+ * @brief   Report the free space left on a given volume, whichever volume is
+ *          selected (see SDGetFreeSpace())
  *
- * @param   name[]  C-string name for the file to be created
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
  *
- * @return  Returns 0 upon success, error code otherwise
+ * @return  Returns the number of free sectors (SD_SECTOR_SIZE bytes each)
  */
-uint8_t SD_Shell_touch (const char name[]);
-#endif
+uint32_t SDGetFreeSpaceVol (sd_volume *vol);
 #endif
 
-#if (defined SD_VERBOSE || defined SD_VERBOSE_BLOCKS)
+#ifdef SD_RAW_BLOCKS
 /**
- * @brief    Print a block of data in hex format to the screen in SD_LINE_SIZE-byte lines
+ * @brief   Describe a region of sectors for raw access
  *
- * @param    *dat       Pointer to the beginning of the data
- * @param    bytes      Number of bytes to print
+ * @detailed    The region is refused if it overlaps the MBR (or the boot
+ *              sector of an unpartitioned card), the mounted volume or any
+ *              partition listed in the MBR as FAT. Sector 0 is read to check
+ *              the partitions
  *
- * @return   Returns 0 upon success, error code otherwise
+ * @param   *r      Address of the region to be filled in
+ * @param   first   Address of the region's first sector
+ * @param   count   Number of sectors in the region
+ *
+ * @return  Returns 0 upon success, SD_RAW_PROTECTED if the region overlaps a
+ *          FAT volume, error code otherwise
+ */
+uint8_t SDRawRegion (sd_raw_region *r, const uint32_t first,
+        const uint32_t count);
+
+/**
+ * @brief   Describe a (non-FAT) partition of the MBR as a region for raw
+ *          access
+ *
+ * @param   *r          Address of the region to be filled in
+ * @param   partition   Entry of the partition table, 0 to 3
+ *
+ * @return  Returns 0 upon success, SD_RAW_OUT_OF_RANGE if the entry is
+ *          unused, SD_RAW_PROTECTED if the partition is FAT, error code
+ *          otherwise
+ */
+uint8_t SDRawPartition (sd_raw_region *r, const uint8_t partition);
+
+/**
+ * @brief   Read sectors of a raw region
+ *
+ * @param   *r      Region to be read
+ * @param   block   First sector to be read, counted from the start of the
+ *                  region
+ * @param   count   Number of sectors
+ * @param   dat[]   Location in memory with room for 'count' sectors
+ *
+ * @return  Returns 0 upon success, SD_RAW_OUT_OF_RANGE if any sector lies
+ *          outside the region, error code otherwise
+ */
+uint8_t SDRawRead (const sd_raw_region *r, const uint32_t block,
+        uint32_t count, uint8_t dat[]);
+
+/**
+ * @brief   Write sectors of a raw region
+ *
+ * @detailed    With SD_MULTI_BLOCK, the sectors are sent with a single
+ *              command. The card finishes programming in the background
+ *
+ * @param   *r      Region to be written
+ * @param   block   First sector to be written, counted from the start of the
+ *                  region
+ * @param   count   Number of sectors
+ * @param   dat[]   Data of 'count' sectors
+ *
+ * @return  Returns 0 upon success, SD_RAW_OUT_OF_RANGE if any sector lies
+ *          outside the region, SD_RAW_PROTECTED if it overlaps the MBR or the
+ *          mounted volume, error code otherwise
+ */
+uint8_t SDRawWrite (const sd_raw_region *r, const uint32_t block,
+        uint32_t count, const uint8_t dat[]);
+
+/**
+ * @brief   Erase sectors of a raw region so that writing them later runs at
+ *          full speed
+ *
+ * @detailed    Erased sectors read back as all 0s or all 1s, depending on the
+ *              card. The card erases in the background
+ *
+ * @param   *r      Region to be erased
+ * @param   block   First sector to be erased, counted from the start of the
+ *                  region
+ * @param   count   Number of sectors
+ *
+ * @return  Returns 0 upon success, SD_RAW_OUT_OF_RANGE if any sector lies
+ *          outside the region, SD_RAW_PROTECTED if it overlaps the MBR or the
+ *          mounted volume, error code otherwise
+ */
+uint8_t SDRawErase (const sd_raw_region *r, const uint32_t block,
+        const uint32_t count);
+
+#ifdef SD_RING_LOG
+/**
+ * @brief   Open the ring log kept in a raw region
+ *
+ * @detailed    The record after the last one appended is found with about
+ *              log_2(sectors) reads, so appending resumes where it stopped
+ *              before a reset or loss of power. A region that holds no records
+ *              starts an empty log; to start over on a used region, erase it
+ *              first with SDRawErase()
+ *
+ * @param   *log        Address of the log object to be filled in
+ * @param   *region     Region holding the log
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDRingOpen (sd_ring_log *log, const sd_raw_region *region);
+
+/**
+ * @brief   Append a record to a ring log, overwriting the oldest once the
+ *          region is full
+ *
+ * @detailed    Costs a single sector write
+ *
+ * @param   *log    Address of an open log
+ * @param   dat[]   Data of the record
+ * @param   bytes   Size of the record; at most SD_RING_RECORD_SIZE
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDRingAppend (sd_ring_log *log, const uint8_t dat[],
+        const uint16_t bytes);
+
+/**
+ * @brief   Read back a record of a ring log
+ *
+ * @detailed    Records are numbered from 0 in the order they were appended;
+ *              the last region.count of them are kept
+ *
+ * @param   *log        Address of an open log
+ * @param   sequence    Number of the record
+ * @param   dat[]       Location in memory with room for SD_RING_RECORD_SIZE
+ *                      bytes
+ * @param   *bytes      Returns the size of the record
+ *
+ * @return  Returns 0 upon success, SD_RAW_OUT_OF_RANGE if the record has not
+ *          been appended or has been overwritten, error code otherwise
+ */
+uint8_t SDRingRead (sd_ring_log *log, const uint32_t sequence,
+        uint8_t dat[], uint16_t *bytes);
+#endif
+#endif
+
+/**
+ * @brief   Check, without waiting, whether the SD card is still programming
+ *          the last sector written to it (or erasing freed clusters)
+ *
+ * @detailed    Writes return as soon as the card has accepted the data; the
+ *              next access to the card waits for it to finish. An application
+ *              may use this to do other work in the meantime
+ *
+ * @return  Returns 1 if the card is busy, 0 otherwise
+ */
+uint8_t SDIsBusy (void);
+
+/**
+ * @brief    Change the current working directory to *f (similar to 'cd f')
+ *
+ * @param    *d     Path of the directory to change to; each component is a
+ *                  short filename separated by '/' (such as "LOGS/2026" or
+ *                  "../JAZZ"); paths beginning with '/' start from the root
+ *
+ * @return   Returns 0 upon success, error code otherwise; the working
+ *           directory is left unchanged upon failure
+ */
+uint8_t SDchdir (const char *d);
+
+/**
+ * @brief   Change the working directory of a given volume, whichever volume is
+ *          selected (see SDchdir())
+ *
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
+ * @param   *d      Path of the directory to change to
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDchdirVol (sd_volume *vol, const char *d);
+
+/**
+ * @brief       Open a file with a given name and load its information into the
+ *              file pointer
+ *
+ * @detailed    Load the first sector of a file into the file buffer; Initialize
+ *              global character pointers; NOTE: files are best described as
+ *              "r+", except that the append modes (SD_FILE_MODE_A and
+ *              SD_FILE_MODE_A_PLUS) start the write pointer at the end of the
+ *              file; NOTE: two position
+ *              pointers are used, one for writing and one for reading, this may
+ *              be changed later to comply with POSIX standards but is useful
+ *              for my own purposes at the moment
+ *              NOTE: This driver does not include any provision for timestamps;
+ *              Niether file modification or creation will changed file's
+ *              timestamp data (creation times are random and uninitialized)
+ *
+ * @pre         Files cannot be created in the root directory of a FAT16
+ *              filesystem
+ *              TODO: Fix this
+ *
+ * @param       *name   C-string containing the filename to open; it may be
+ *                      preceded by a path such as "LOGS/2026/10/DAY18.CSV"
+ *                      (see SDchdir())
+ * @param       *f      Address where file information (such as the first
+ *                      allocation unit) can be stored. Multiple files opened
+ *                      simultaneously is allowed. If f->buf is NULL
+ *                      and SD_BUFFER_POOL is enabled, a buffer will be
+ *                      borrowed from the driver's pool (and returned when the
+ *                      file is closed). With SD_SEEK_CHECKPOINTS, f->checkpoint
+ *                      and f->checkpointCount must also be set: a table of
+ *                      that many uint32_t that the file uses for seek
+ *                      checkpoints while it is open, or NULL and 0 for none
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDfopen (const char *name, sd_file *f, const sd_file_mode mode);
+
+/**
+ * @brief   Open a file on a given volume, whichever volume is selected (see
+ *          SDfopen()); the file is then used without naming the volume again
+ *
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
+ * @param   *name   Path of the file within the volume's working directory
+ * @param   *f      Address where file information can be stored, set up as
+ *                  for SDfopen()
+ * @param   mode    Mode in which the file is opened
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDfopenVol (sd_volume *vol, const char *name, sd_file *f,
+        const sd_file_mode mode);
+
+#ifdef SD_FILE_WRITE
+/**
+ * @brief   Close a given file
+ *
+ * @detailed    A buffer that was borrowed from the pool is returned and f->buf
+ *              is set to NULL
+ *
+ * @param   *f      Address of the file object to close
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDfclose (sd_file *f);
+
+/**
+ * @brief       Write a file's modified sector, its length and the FAT to the
+ *              SD card
+ *
+ * @detailed    The directory entry is only rewritten if the length changed
+ *              since the last flush; data written before a successful flush
+ *              survives a loss of power
+ *
+ * @param       *f      Address of the file object to flush
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDfflush (sd_file *f);
+
+/**
+ * @brief       Select when a file's writes are flushed to the SD card
+ *
+ * @detailed    Files are opened with SD_SYNC_WRITE_BACK. With
+ *              SD_SYNC_PERIODIC, the file is flushed at the end of the first
+ *              write call after either limit is reached; a limit of 0 is
+ *              ignored. Periods are measured with the system counter and must
+ *              therefore be shorter than 2^32 clock ticks (53 seconds at 80 MHz)
+ *
+ * @param       *f          Address of the file object
+ * @param       policy      One of SD_SYNC_WRITE_BACK, SD_SYNC_PERIODIC or
+ *                          SD_SYNC_WRITE_THROUGH
+ * @param       bytes       SD_SYNC_PERIODIC only: flush after this many bytes
+ * @param       ms          SD_SYNC_PERIODIC only: flush after this many
+ *                          milliseconds
+ */
+void SDfsetsync (sd_file *f, const sd_sync_policy policy, const uint32_t bytes,
+        const uint32_t ms);
+
+/**
+ * @brief       Reserve space for a file as one contiguous run of clusters
+ *
+ * @detailed    The file's length is not changed; writes within the reserved
+ *              space never need to search or modify the FAT. Clusters beyond
+ *              the file's length are released by SDfclose()
+ *
+ * @param       *f      Address of an open file object
+ * @param       bytes   Total number of bytes the file should have room for
+ *
+ * @return      Returns 0 upon success, SD_INSUFFICIENT_SPACE if no run of
+ *              free clusters is long enough, error code otherwise
+ */
+uint8_t SDfallocate (sd_file *f, const uint32_t bytes);
+
+/**
+ * @brief       Shorten a file, freeing the clusters it no longer needs
+ *
+ * @detailed    Files can only be made shorter; a length at or beyond the end
+ *              of the file leaves it unchanged. Read and write pointers past
+ *              the new end are moved back to it. The new length is saved by
+ *              SDfflush() or SDfclose()
+ *
+ * @param       *f          Address of an open file object
+ * @param       length      New length of the file in bytes
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDftruncate (sd_file *f, const uint32_t length);
+
+/**
+ * @brief       Delete a file and free its clusters
+ *
+ * @detailed    The file must not be open. The directory and FAT are saved by
+ *              SDsync() or SDUnmount() like any other change
+ *
+ * @param       *name   Path of the file, as accepted by SDfopen()
+ *
+ * @return      Returns 0 upon success, SD_FILENAME_NOT_FOUND if there is no
+ *              such file, SD_ENTRY_NOT_FILE if it is a directory, error code
+ *              otherwise
+ */
+uint8_t SDremove (const char *name);
+
+/**
+ * @brief   Delete a file on a given volume, whichever volume is selected (see
+ *          SDremove())
+ *
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
+ * @param   *name   Path of the file, as accepted by SDfopen()
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDremoveVol (sd_volume *vol, const char *name);
+
+/**
+ * @brief       Insert a character into a given file
+ *
+ * @detailed    Insert 'c' at the location pointed to by the file's write
+ *              pointer; Note: the read and write pointers may be merged into
+ *              one at a later date
+ *
+ * @param       c       Character to be inserted
+ * @param       *f      Address of the desired file object
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDfputc (const char c, sd_file *f);
+
+/**
+ * @brief       Insert a c-string into a file
+ *
+ * @detailed    Insert an array of bytes into the file object pointed to by 'f'
+ *              beginning at address 's' until the value 0 is reached
+ *
+ * @param       *s  C-string to be inserted
+ * @param       *f  Address of file object
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDfputs (char *s, sd_file *f);
+
+/**
+ * @brief       Write a block of bytes into a file
+ *
+ * @detailed    Insert 'bytes' bytes from 'dat' at the location pointed to by
+ *              the file's write pointer, extending the file as needed. Partial
+ *              sectors are copied into the file's buffer; whole sectors that
+ *              line up with a sector boundary are sent directly from 'dat' to
+ *              the SD card without passing through the buffer
+ *
+ * @param       dat[]   Bytes to be written
+ * @param       bytes   Number of bytes to write
+ * @param       *f      Address of the desired file object
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDfwrite (const uint8_t dat[], uint32_t bytes, sd_file *f);
+#endif
+
+/**
+ * @brief       Read one character from the currently opened file.
+ *
+ * @detailed    NOTE: This function does not include error checking
+ *
+ * @pre         *f must point to a currently opened and valid file
+ * @pre         The file must have at least one byte left - no error checking is
+ *              performed to stop the user from reading past the end of a file
+ *              (call SDfeof() for end-of-file check)
+ *
+ * @param       *f  Address where file information (such as the first allocation
+ *                  unit) can be stored.
+ *
+ * @return      Returns the character pointed to by the g_sd_rPtr pointer
+ */
+char SDfgetc (sd_file *f);
+
+/**
+ * @brief   Read a line from a file until either 'size' characters have been
+ *          read or a newline is found; Parameters should match stdio.h's fgets
+ *          except for the file pointer
+ *          NOTE: This function does not include error checking
+ *
+ * @pre     *f must point to a currently opened and valid file
+ *
+ * @param   s[]        Character array to store file characters
+ * @param   size    Maximum number of characters to read from the file
+ * @param   *f        Address with the currently opened file
+ *
+ * @return  Returns character memory location of character array
+ */
+char * SDfgets (char s[], uint32_t size, sd_file *f);
+
+/**
+ * @brief       Read a block of bytes from a file
+ *
+ * @detailed    Read up to 'bytes' bytes, starting at the file's read pointer,
+ *              into 'dat'. Reading stops at the end of the file. Whole sectors
+ *              that line up with a sector boundary are read directly from the
+ *              SD card into 'dat' without passing through the buffer
+ *
+ * @pre         *f must point to a currently opened and valid file
+ *
+ * @param       dat[]       Location in memory with room for 'bytes' bytes
+ * @param       bytes       Maximum number of bytes to read
+ * @param       *f          Address of the desired file object
+ * @param       *bytesRead  Number of bytes actually read will be stored here
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDfread (uint8_t dat[], uint32_t bytes, sd_file *f,
+        uint32_t *bytesRead);
+
+/**
+ * @brief   Determine whether the read pointer has reached the end of the file
+ *
+ * @Pre:    *f must point to a currently opened and valid file
+ *
+ * @param   *f  Address of the requested file
+ *
+ * @return  Returns true if the read pointer points to the end of the file,
+ *          false otherwise
+ */
+inline uint8_t SDfeof (sd_file *f);
+
+/**
+ * @brief   Set the read pointer for a given file to the position 'origin +
+ *          offset'
+ *
+ * @Pre:    *f must be an opened file
+ *
+ * @param   *f      Address of the file object being referenced
+ * @param   offset  Bytes beyond 'origin' to set the pointer to
+ * @param   origin  Gives a reference to the offset; can be one of SEEK_SET,
+ *                  SEEK_CUR, SEEK_END
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDfseekr (sd_file *f, const int32_t offset, const file_pos origin);
+
+/**
+ * @brief   Set the write pointer for a given file to the position 'origin +
+ *          offset'
+ *
+ * @Pre:    *f must be an opened file
+ *
+ * @param   *f      Address of the file object being referenced
+ * @param   offset  Bytes beyond 'origin' to set the pointer to
+ * @param   origin  Gives a reference to the offset; can be one of SEEK_SET,
+ *                  SEEK_CUR, SEEK_END
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDfseekw (sd_file *f, const int32_t offset, const file_pos origin);
+
+/**
+ * @brief   Retrieve the current position of the read pointer
+ *
+ * @Pre:    *f must be an opened file
+ *
+ * @param   *f  Address of the file object being referenced
+ *
+ * @return  Returns the byte offset (from beginning) of the read pointer
+ */
+inline file_pos SDftellr (const sd_file *f);
+
+/**
+ * @brief   Retrieve the current position of the write pointer
+ *
+ * @Pre:    *f must be an opened file
+ *
+ * @param   *f  Address of the file object being referenced
+ *
+ * @return  Returns the byte offset (from beginning) of the write pointer
+ */
+inline file_pos SDftellw (const sd_file *f);
+
+#ifdef SD_SHELL
+// Shell definitions
+#define SD_SHELL_INPUT_LEN          64
+#define SD_SHELL_CMD_LEN            8
+#define SD_SHELL_ARG_LEN            32
+#define SD_SHELL_EXIT               ("exit")
+#define SD_SHELL_LS                 ("ls")
+#define SD_SHELL_CAT                ("cat")
+#define SD_SHELL_CD                 ("cd")
+#define SD_SHELL_TOUCH              ("touch")
+#define SD_SHELL_RM                 ("rm")
+
+/**
+ * @brief   Provide the user with a very basic Unix-like shell. The following
+ *          commands are available to the user: ls, cat, cd.
+ *
+ * @param   *f  If a file is opened via a command such as 'cat', its information
+ *              will be stored at this address
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SD_Shell (sd_file *f);
+
+/**
+ * @brief   Provide the shell of SD_Shell() on a given volume, whichever volume
+ *          is selected
+ *
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
+ * @param   *f      Used by commands such as 'cat' to open files
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SD_ShellVol (sd_volume *vol, sd_file *f);
+
+/**
+ * @brief   List the contents of a directory on the screen (similar to 'ls .')
+ *
+ * @param   *name   Only entries with this short filename are printed (similar
+ *                  to 'ls FILE'); pass an empty string to print every entry
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SD_Shell_ls (const char *name);
+
+/**
+ * @brief   List a given volume's working directory (see SD_Shell_ls())
+ *
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
+ * @param   *name   Short filename to list, or an empty string for every
+ *                  entry
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SD_Shell_lsVol (sd_volume *vol, const char *name);
+
+/**
+ * @brief   Dump the contents of a file to the screen (similar to 'cat f');
+ *
+ * @note:   Does not currently follow paths
+ *
+ * @param   *f  Short filename of file to print
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SD_Shell_cat (const char *name, sd_file *f);
+
+/**
+ * @brief   Dump the contents of a file on a given volume to the screen (see
+ *          SD_Shell_cat())
+ *
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
+ * @param   *name   Short filename of file to print
+ * @param   *f      Address where the file's information is stored
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SD_Shell_catVol (sd_volume *vol, const char *name, sd_file *f);
+
+/**
+ * @brief   Change the current working directory to *f (similar to 'cd f');
+ *
+ * @param   *d  Short filename of directory to change to
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SD_Shell_cd (const char *d);
+
+#ifdef SD_FILE_WRITE
+/**
+ * @brief   Create a new file, do not open it
+ *
+ * @param   name[]  C-string name for the file to be created
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SD_Shell_touch (const char name[]);
+
+/**
+ * @brief   Create a new file on a given volume, do not open it
+ *
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
+ * @param   name[]  C-string name for the file to be created
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SD_Shell_touchVol (sd_volume *vol, const char name[]);
+#endif
+#endif
+
+#if (defined SD_VERBOSE || defined SD_VERBOSE_BLOCKS)
+/**
+ * @brief    Print a block of data in hex format to the screen in SD_LINE_SIZE-byte lines
+ *
+ * @param    *dat       Pointer to the beginning of the data
+ * @param    bytes      Number of bytes to print
+ *
+ * @return   Returns 0 upon success, error code otherwise
+ */
+uint8_t SDPrintHexBlock (uint8_t *dat, uint16_t bytes);
+#endif
+
+/**@}*/
+
+/*******************************************
+ *** Private SD Definitions & Prototypes ***
+ *******************************************/
+/**
+ * @defgroup sd_private Private members
+ @{*/
+#if (defined SD_DEBUG || defined SD_VERBOSE || defined SD_VERBOSE_BLOCKS || \
+defined SD_SHELL)
+#include <stdio.h>
+#endif
+
+// SPI config
+#define SD_SPI_INIT_FREQ            200000          // Run SD initialization at 200 kHz
+#define SD_SPI_MODE                 SPI_MODE_0
+#define SD_SPI_BITMODE              SPI_MSB_FIRST
+
+// Misc. SD Definitions
+#define SD_WIGGLE_ROOM              10000
+#define SD_RESPONSE_TIMEOUT         CLKFREQ/10      // Wait 0.1 seconds for a response before timing out
+#define SD_RESPONSE_MAX_DELAY       8               // Bytes a card may take to begin a response (N_CR)
+#define SD_INIT_DELAY_MAX           (CLKFREQ/10)    // Longest pause between initialization attempts
+#define SD_PROGRAM_TIMEOUT          (CLKFREQ/2)     // Longest a card may stay busy after a write
+#define SD_ERASE_TIMEOUT            (CLKFREQ*8)     // Longest a card may stay busy after an erase
+#define SD_BUSY_PROGRAMMING         1               // sd_card.busy: a sector was written
+#define SD_BUSY_ERASING             2               // sd_card.busy: a range of sectors was erased
+#define SD_SECTOR_SIZE_SHIFT        9
+
+// SD Commands
+#define SD_CMD_IDLE                 0x40 + 0        // Send card into idle state
+#define    SD_CMD_SDHC              0x40 + 8        // Set SD card version (1 or 2) and voltage level range
+#define SD_CMD_RD_CSD               0x40 + 9        // Request "Card Specific Data" block contents
+#define SD_CMD_RD_CID               0x40 + 10       // Request "Card Identification" block contents
+#define SD_CMD_RD_BLOCK             0x40 + 17       // Request data block
+#define SD_CMD_RD_MULTI             0x40 + 18       // Request consecutive data blocks until stopped
+#define SD_CMD_WR_BLOCK             0x40 + 24       // Write data block
+#define SD_CMD_WR_MULTI             0x40 + 25       // Write consecutive data blocks until stopped
+#define SD_CMD_STOP_TRANS           0x40 + 12       // End a multi-block read
+#define SD_CMD_READ_OCR             0x40 + 58       // Request "Operating Conditions Register" contents
+#define SD_CMD_APP                  0x40 + 55       // Inform card that following instruction is application specific
+#define SD_CMD_WR_OP                0x40 + 41       // Send operating conditions for SDC
+#define SD_CMD_SD_STATUS            0x40 + 13       // (Application specific) Request the "SD Status" block
+#define SD_CMD_ERASE_START          0x40 + 32       // Set the first block to be erased
+#define SD_CMD_ERASE_END            0x40 + 33       // Set the last block to be erased
+#define SD_CMD_ERASE                0x40 + 38       // Erase the selected blocks
+// SD Arguments
+#define SD_CMD_VOLT_ARG             0x000001AA
+#define SD_ARG_LEN                  5
+
+// SD CRCs
+#define SD_CRC_IDLE                 0x95
+#define SD_CRC_SDHC                 0x87
+#define SD_CRC_ACMD                 0x77
+#define SD_CRC_OTHER                0x01
+
+// SD Responses
+#define SD_RESPONSE_IDLE            0x01
+#define SD_RESPONSE_ACTIVE          0x00
+#define SD_OCR_POWER_UP             BIT_7           // First OCR byte: card has finished powering up
+#define SD_OCR_CCS                  BIT_6           // First OCR byte: card is high capacity (SDHC)
+#define SD_DATA_START_ID            0xFE
+#define SD_DATA_MULTI_ID            0xFC            // Precedes each block of a multi-block write
+#define SD_STOP_TRAN_ID             0xFD            // Ends a multi-block write
+#define SD_RESPONSE_LEN_R1          1
+#define SD_RESPONSE_LEN_R3          5
+#define    SD_RESPONSE_LEN_R7       5
+#define SD_RSPNS_TKN_BITS           0x0f
+#define SD_RSPNS_TKN_ACCPT          ((0x02 << 1) | 1)
+#define SD_RSPNS_TKN_CRC            ((0x05 << 1) | 1)
+#define SD_RSPNS_TKN_WR             ((0x06 << 1) | 1)
+#define SD_STATUS_LEN               64              // Length of the "SD Status" block
+#define SD_STATUS_AU_SIZE_ADDR      10              // High nibble: AU_SIZE field of the "SD Status" block
+
+// Boot sector addresses/values
+#define SD_FAT_16                   2               // A FAT entry in FAT16 is 2-bytes
+#define SD_FAT_32                   4               // A FAT entry in FAT32 is 4-bytes
+#define SD_BOOT_SECTOR_ID           0xeb
+#define SD_BOOT_SECTOR_ID_ADDR      0
+#define SD_BOOT_SECTOR_BACKUP       0x1c6
+#define SD_CLUSTER_SIZE_ADDR        0x0d
+#define SD_RSVD_SCTR_CNT_ADDR       0x0e
+#define SD_NUM_FATS_ADDR            0x10
+#define SD_ROOT_ENTRY_CNT_ADDR      0x11
+#define SD_TOT_SCTR_16_ADDR         0x13
+#define SD_FAT_SIZE_16_ADDR         0x16
+#define SD_TOT_SCTR_32_ADDR         0x20
+#define SD_BYTES_PER_SCTR_ADDR      0x0b
+#define SD_MEDIA_ADDR               0x15
+#define SD_MEDIA_FIXED              0xf8            // Media descriptor of a non-removable disk
+#define SD_BOOT_SIGNATURE_ADDR      0x1fe
+#define SD_BOOT_SIGNATURE           0xaa55
+#define SD_FAT_SIZE_32_ADDR         0x24
+#define SD_ROOT_CLUSTER_ADDR        0x2c
+#define SD_PARTITION_TABLE_ADDR     0x1be           // MBR: first of the partition table's entries
+#define SD_PARTITION_ENTRIES        4
+#define SD_PARTITION_ENTRY_SIZE     16
+#define SD_PARTITION_TYPE_OFFSET    4
+#define SD_PARTITION_LBA_OFFSET     8
+#define SD_PARTITION_SIZE_OFFSET    12
+#define SD_FSINFO_SECTOR_ADDR       0x30            // FAT32: sector of FSInfo, relative to the boot sector
+#define SD_FSINFO_LEAD_SIG_ADDR     0x000
+#define SD_FSINFO_STRUCT_SIG_ADDR   0x1e4
+#define SD_FSINFO_FREE_COUNT_ADDR   0x1e8
+#define SD_FSINFO_TRAIL_SIG_ADDR    0x1fc
+#define SD_FSINFO_LEAD_SIG          0x41615252
+#define SD_FSINFO_STRUCT_SIG        0x61417272
+#define SD_FSINFO_TRAIL_SIG         0xaa550000
+
+// Ring log records: header, then up to SD_RING_RECORD_SIZE bytes of data
+#define SD_RING_MAGIC_ADDR          0
+#define SD_RING_SEQUENCE_ADDR       4
+#define SD_RING_BYTES_ADDR          8
+#define SD_RING_HEADER_SIZE         12
+#define SD_RING_MAGIC               0x474f4c52      // "RLOG"
+#define SD_RING_NO_RECORD           0xffffffff      // Sequence number of a slot without a record
+#define SD_FAT12_CLSTR_CNT          4085
+#define SD_FAT16_CLSTR_CNT          65525
+
+// FAT file/directory values
+#define SD_FILE_ENTRY_LENGTH        32              // An entry in a directory uses 32 bytes
+#define SD_DELETED_FILE_MARK        0xe5            // Marks that a file has been deleted here, continue to the next entry
+#define SD_FILE_NAME_LEN            8               // 8 characters in the standard file name
+#define SD_FILE_EXTENSION_LEN       3               // 3 character file name extension
+#define SD_FILENAME_STR_LEN         SD_FILE_NAME_LEN + SD_FILE_EXTENSION_LEN + 2
+#define SD_FILE_ATTRIBUTE_OFFSET    0x0B            // Byte of a file entry to store attribute flags
+#define SD_FILE_START_CLSTR_LOW     0x1a            // Starting cluster number
+#define SD_FILE_START_CLSTR_HIGH    0x14            // High word (16-bits) of the starting cluster number (FAT32 only)
+#define SD_FILE_LEN_OFFSET          0x1c            // Length of a file in bytes
+#define SD_FREE_CLUSTER             0               // Cluster is unused
+#define SD_RESERVED_CLUSTER         1
+#define SD_RSVD_CLSTR_VAL_BEG       -15             // First reserved cluster value
+#define SD_RSVD_CLSTR_VAL_END       -9              // Last reserved cluster value
+#define SD_BAD_CLUSTER              -8              // Cluster is corrupt
+#define SD_EOC_BEG                  -7              // First marker for end-of-chain (end of file entry within FAT)
+#define SD_EOC_END                  -1              // Last marker for end-of-chain
+#define SD_FAT16_EOC_BEG            0xfff8          // First end-of-chain value as stored in a FAT16 table
+#define SD_FAT32_EOC_BEG            0x0ffffff8      // First end-of-chain value as stored in a FAT32 table
+// FAT file attributes (definitions with trailing underscore represent character for a cleared attribute flag)
+#define SD_READ_ONLY                BIT_0
+#define SD_READ_ONLY_CHAR           'r'
+#define SD_READ_ONLY_CHAR_          'w'
+#define SD_HIDDEN_FILE              BIT_1
+#define SD_HIDDEN_FILE_CHAR         'h'
+#define SD_HIDDEN_FILE_CHAR_        '.'
+#define SD_SYSTEM_FILE              BIT_2
+#define SD_SYSTEM_FILE_CHAR         's'
+#define SD_SYSTEM_FILE_CHAR_        '.'
+#define SD_VOLUME_ID                BIT_3
+#define SD_VOLUME_ID_CHAR           'v'
+#define SD_VOLUME_ID_CHAR_          '.'
+#define SD_SUB_DIR                  BIT_4
+#define SD_SUB_DIR_CHAR             'd'
+#define SD_SUB_DIR_CHAR_            'f'
+#define SD_ARCHIVE                  BIT_5
+#define SD_ARCHIVE_CHAR             'a'
+#define SD_ARCHIVE_CHAR_            '.'
+#define SD_LONG_NAME                (SD_READ_ONLY | SD_HIDDEN_FILE | SD_SYSTEM_FILE | SD_VOLUME_ID)  // Attributes of a long file name entry
+
+// File constants
+#ifndef SD_EOF
+#define SD_EOF                      ((uint8_t) -1)  // System dependent - may need to be defined elsewhere
+#endif
+
+#define SD_FOLDER_ID                ((uint8_t) -1)  // Signal that the contents of a buffer are a directory
+#define SD_INVALID_SECTOR           ((uint32_t) -1) // Signal that a file's buffer holds none of its sectors
+#define SD_SHORT_NAME_LEN           (SD_FILE_NAME_LEN + SD_FILE_EXTENSION_LEN)  // Length of a padded, on-disk name
+#define SD_SHORT_NAME_WORDS         ((SD_SHORT_NAME_LEN + 3) / 4)                // Longs needed to hold a padded name
+
+#ifdef SD_DIR_INDEX
+#define SD_DIR_INDEX_EMPTY          0               // Hash value of an unused slot
+#define SD_DIR_INDEX_DELETED        1               // Hash value of a slot whose entry was removed
+#define SD_DIR_INDEX_NO_END         ((uint8_t) -1)  // The end of the indexed directory is not known
+#define SD_DIR_INDEX_ENTRIES        (SD_SECTOR_SIZE / SD_FILE_ENTRY_LENGTH)
+typedef struct {
+    uint16_t hash;  // Hash of the entry's padded, on-disk name
+    uint8_t sectorOffset;  // Sector within the directory cluster
+    uint8_t entry;  // Entry number within the sector
+    uint32_t allocUnit;  // Directory cluster holding the entry
+} sd_dir_index_entry;
+#endif
+
+#ifdef SD_PATH_CACHE
+typedef struct {
+    uint32_t parent;  // First allocation unit of the parent directory
+    uint32_t child;  // First allocation unit of the directory; 0 if the slot is unused
+    uint32_t rawName[SD_SHORT_NAME_WORDS];  // Padded, on-disk name of the directory
+} sd_path_cache_entry;
+#endif
+
+#if (defined SD_TAIL_CACHE && defined SD_FILE_WRITE)
+typedef struct {
+    uint32_t firstAllocUnit;  // First allocation unit of the file; 0 if the slot is unused
+    uint32_t tailAllocUnit;  // Last allocation unit of the file
+    uint32_t clusters;  // Length of the chain; guards against a stale entry
+    uint32_t checkCluster;  // A cluster of the file's last checkpoint...
+    uint32_t checkAllocUnit;  // ...and its allocation unit, which must still chain to the tail
+} sd_tail_cache_entry;
+#endif
+struct _sd_buffer {
+    uint8_t buf[SD_SECTOR_SIZE];  // Buffer for SD card contents
+    uint8_t id;  // Buffer ID - determine who owns the current information
+    uint32_t curClusterStartAddr;  // Store the current cluster's starting sector number
+    uint8_t curSectorOffset;  // Store the current sector offset from the beginning of the cluster
+    uint32_t curAllocUnit;  // Store the current allocation unit
+    uint32_t nextAllocUnit;  // Look-ahead at the next FAT entry
+#ifdef SD_FILE_WRITE
+    uint8_t mod; // When set, the currently loaded sector has been modified since it was read from
+                 // the SD card
+#endif
+#if (defined SD_FILE_WRITE || defined SD_BUFFER_POOL)
+    sd_volume *vol;  // Volume that the loaded sector belongs to; set along with mod and when the pool lends the buffer
+#endif
+#ifdef SD_BUFFER_POOL
+    uint32_t lastUse; // Pool tick of the last access; the smallest value is evicted first
+#endif
+};
+
+struct _sd_file {
+    sd_volume *vol;  // Volume holding the file
+    sd_buffer *buf;
+    uint8_t id;  // determine if the buffer is owned by this file
+    file_pos wPtr;
+    file_pos rPtr;
+    sd_file_mode mode;
+    uint32_t length;
+    uint32_t maxSectors; // Maximum number of sectors currently allocated to a file
+    uint8_t mod; // When the length of a file is changed, this variable will be set, otherwise cleared
+    uint32_t firstAllocUnit;  // File's starting allocation unit
+    uint32_t curSector; // like curSectorOffset, but does not reset upon loading a new cluster
+    uint32_t curCluster;  // like curSector, but for allocation units
+
+    uint32_t dirSectorAddr; // Which sector of the SD card contains this file's meta-data
+    uint16_t fileEntryOffset;
+#ifdef SD_FILE_WRITE
+    sd_sync_policy sync;  // When the file is flushed
+    uint32_t syncBytes;  // SD_SYNC_PERIODIC: bytes between flushes (0 to ignore)
+    uint32_t syncTicks;  // SD_SYNC_PERIODIC: clock ticks between flushes (0 to ignore)
+    uint32_t unsynced;  // Bytes written since the last flush
+    uint32_t lastSync;  // System counter at the last flush
+    uint8_t extendClusters;  // Clusters to claim the next time the file is extended
+    uint8_t extendClaimed;  // Clusters claimed by the last extension
+    uint32_t extendTicks;  // System counter at the last extension (or opening)
+    uint32_t tailAllocUnit;  // Last allocation unit of the file; 0 if unknown
+#endif
+#ifdef SD_SEEK_CHECKPOINTS
+    uint32_t *checkpoint;  // Set before opening: table of the allocation units of cluster (i << checkpointShift), 0 if not yet known; NULL for none
+    uint8_t checkpointCount;  // Set before opening: number of entries in the table; 0 for none
+    uint8_t checkpointShift;
+#endif
+};
+
+struct _sd_volume {
+    sd_block_dev *dev;  // Device holding the volume
+    sd_buffer *buf;  // Directory buffer; also lent to the volume's files
+#ifdef SD_BUFFER_POOL
+    sd_buffer *ownBuf;  // Buffer given to SDVolumeInit(); buf is a pool buffer while a file holds this one
+#endif
+
+    // Initialization variables
+    uint8_t filesystem;  // Filesystem type - one of SD_FAT_16 or SD_FAT_32
+    uint8_t sectorsPerCluster_shift;  // Used as a quick multiply/divide; Stores log_2(Sectors per Cluster)
+    uint32_t rootDirSectors;  // Number of sectors for the root directory
+    uint32_t fatStart;  // Starting block address of the FAT
+    uint32_t rootAddr;  // Starting block address of the root directory
+    uint32_t rootAllocUnit;  // Allocation unit of root directory/first data sector (-1 for FAT16, whose root is outside the data region)
+    uint32_t firstDataAddr;  // Starting block address of the first data cluster
+    uint32_t clusterCount;  // Number of data clusters; allocation units run from 2 to clusterCount + 1
+
+    // FAT filesystem variables
+    // Buffer for FAT entries only; long-aligned so that it may be scanned a long at a time
+    uint8_t fat[SD_SECTOR_SIZE] __attribute__ ((aligned (4)));
+#ifdef SD_FILE_WRITE
+    uint8_t fatMod;  // Has the currently loaded FAT sector been modified
+    uint32_t fatSize;
+    uint8_t numFATs;  // Number of copies of the FAT
+#ifdef SD_FAT_MIRROR_LAZY
+    // FAT sectors written only to the first copy of the FAT
+    uint32_t fatDirty[SD_FAT_DIRTY_SIZE];
+    uint8_t fatDirtyCount;
+#endif
+#endif
+    uint16_t entriesPerFatSector_Shift;  // How many FAT entries are in a single sector of the FAT
+    uint32_t curFatSector;  // Store the current FAT sector loaded into fat
+
+    uint32_t dir_firstAllocUnit;  // Store the current directory's starting allocation unit
+
+#ifdef SD_DIR_INDEX
+    // Hash index of the current directory's entries (open addressing, linear
+    // probing)
+    sd_dir_index_entry dirIndex[SD_DIR_INDEX_SIZE];
+    uint32_t dirIndexDir;  // First allocation unit of the indexed (working) directory
+    uint8_t dirIndexBuilt;  // Set once a search has read the whole working directory
+    uint8_t dirIndexCount;  // Number of used slots, including deleted ones
+    sd_dir_index_entry dirIndexEnd;  // Position of the first unused entry in the directory
+#endif
+
+#ifdef SD_PATH_CACHE
+    // Recently walked directories; replaced in round-robin order
+    sd_path_cache_entry pathCache[SD_PATH_CACHE_SIZE];
+    uint8_t pathCacheNext;
+#endif
+
+#if (defined SD_TAIL_CACHE && defined SD_FILE_WRITE)
+    // Last clusters of recently closed files; replaced in round-robin order
+    sd_tail_cache_entry tailCache[SD_TAIL_CACHE_SIZE];
+    uint8_t tailCacheNext;
+#endif
+
+#ifdef SD_FREE_SPACE
+    uint32_t freeClusters;  // Kept current by every change to the FAT
+#ifdef SD_FILE_WRITE
+    uint32_t fsInfoAddr;  // Address of the FAT32 FSInfo sector; 0 if there is none
+    uint8_t freeMod;  // freeClusters has changed since FSInfo was read or written
+#endif
+#endif
+
+#ifdef SD_RAW_BLOCKS
+    // Sectors of the mounted FAT volume, which raw regions may not overlap;
+    // both are 0 until the volume is mounted
+    uint32_t volumeStart;
+    uint32_t volumeEnd;
+#endif
+
+#ifdef SD_AU_ALIGN
+    uint32_t auClusters;  // Clusters per allocation unit; 0 if clusters don't line up with them
+    uint32_t auFirst;  // First allocation unit (cluster) that starts on a boundary of the card's
+    uint32_t auNext;  // Boundary at which the next search for free space begins
+#endif
+};
+
+// Sector buffers are scanned a long or a word at a time through these types;
+// may_alias keeps such loads ordered with the byte accesses to the same buffer
+// under -fstrict-aliasing
+typedef uint32_t __attribute__ ((may_alias)) sd_long_alias;
+typedef uint16_t __attribute__ ((may_alias)) sd_word_alias;
+
+#ifdef SD_SERVER
+// Handed to the server cog as it starts
+typedef struct {
+    uint32_t mosi, miso, sclk, cs, freq;
+    uint8_t err;  // Result of starting and mounting the card
+    volatile uint8_t done;  // Set by the server cog once err is valid
+} sd_server_start;
+#endif
+
+/***********************************
+ *** Private Function Prototypes ***
+ ***********************************/
+/**
+ * @brief   Check whether the card is already initialized and in SPI mode,
+ *          such as after the Propeller was reset without a power cycle
+ *
+ * @detailed    Waits only as long as a card may take to respond, so that a
+ *              card that is not yet in SPI mode costs little time
+ *
+ * @return  Returns 1 if the card is ready for data commands, 0 otherwise
+ */
+uint8_t SDIsReady (void);
+
+/**
+ * @brief   Bring a card from power-up to the active state: CMD0, CMD8, CMD58
+ *          and ACMD41
+ *
+ * @detailed    Failed attempts are retried after a delay that starts at one
+ *              millisecond and doubles up to SD_INIT_DELAY_MAX
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDReset (void);
+
+#ifdef SD_AU_ALIGN
+/**
+ * @brief   Read the size of the card's allocation unit from its "SD Status"
+ *          block (ACMD13)
+ *
+ * @detailed    Sizes that are not a power of 2 (12 and 24 MB) are rounded down
+ *              to one that divides them
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDReadAUSize (void);
+#endif
+
+/**
+ * @brief    Send a command and argument over SPI to the SD card
+ *
+ * @param    command        6-bit value representing the command sent to the SD
+ *                          card
+ *
+ * @return
+ */
+uint8_t SDSendCommand (const uint8_t cmd, const uint32_t arg,
+        const uint8_t crc);
+
+/**
+ * @brief   Receive response and data from SD card over SPI
+ *
+ * @param   bytes   Number of bytes to receive
+ * @param   *data   Location in memory with enough space to store 'bytes' bytes
+ *                  of data
+ *
+ * @return  Returns 0 for success, else error code
+ */
+uint8_t SDGetResponse (const uint8_t numBytes, uint8_t *dat);
+
+/**
+ * @brief   Receive data from SD card via SPI
+ *
+ * @param   bytes   Number of bytes to receive
+ * @param   *data   Location in memory with enough space to store 'bytes' bytes
+ *                  of data
+ *
+ * @return  Returns 0 for success, else error code
+ */
+uint8_t SDReadBlock (uint16_t bytes, uint8_t *dat);
+
+/**
+ * @brief   Receive a block of data once its start token has arrived; its
+ *          checksum is left for SDReadBlockEnd() or SDReadBlockCrc()
+ *
+ * @param   bytes   Number of bytes to receive
+ * @param   *dat    Location in memory with enough space to store 'bytes' bytes
+ *                  of data
+ *
+ * @return  Returns 0 for success, else error code
+ */
+uint8_t SDReadBlockData (uint16_t bytes, uint8_t *dat);
+
+/**
+ * @brief   Wait for the R1 response and data start token that precede a
+ *          block of data
+ *
+ * @param   *dat    Location in memory used to receive the token
+ *
+ * @return  Returns 0 for success, else error code
+ */
+uint8_t SDReadBlockStart (uint8_t *dat);
+
+/**
+ * @brief   Wait for the data start token that precedes a block of data
+ *
+ * @param   *dat    Location in memory used to receive the token
+ *
+ * @return  Returns 0 for success, else error code
+ */
+uint8_t SDReadDataToken (uint8_t *dat);
+
+/**
+ * @brief   Discard the checksum that follows a block of data and end the
+ *          transfer
+ *
+ * @return  Returns 0 for success, else error code
+ */
+uint8_t SDReadBlockEnd (void);
+
+#ifdef SD_MULTI_BLOCK
+/**
+ * @brief   Discard the checksum of a block read by CMD18, leaving the card
+ *          to send the next block
+ *
+ * @return  Returns 0 for success, else error code
+ */
+uint8_t SDReadBlockCrc (void);
+#endif
+
+/**
+ * @brief   Write data to SD card via SPI
+ *
+ * @param   bytes   Block address to read from SD card
+ * @param   *dat    Location in memory where data resides
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDWriteBlock (uint16_t bytes, uint8_t *dat);
+
+/**
+ * @brief   Send a start token and block of data, then check the card's data
+ *          response
+ *
+ * @param   token   Start token; SD_DATA_START_ID or SD_DATA_MULTI_ID
+ * @param   bytes   Number of bytes to send
+ * @param   *dat    Location in memory where data resides
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDWriteBlockData (const uint8_t token, uint16_t bytes, uint8_t *dat);
+
+/**
+ * @brief   Read SD_SECTOR_SIZE-byte data block from the block device
+ *
+ * @param   address    Number of bytes to send
+ * @param   *dat       Location in chip memory to store data block
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDReadDataBlock (uint32_t address, uint8_t *dat);
+
+/**
+ * @brief   Write SD_SECTOR_SIZE-byte data block to the block device
+ *
+ * @param   address     Block address to write to SD card
+ * @param   *dat        Location in chip memory to read data block
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDWriteDataBlock (uint32_t address, uint8_t *dat);
+
+#if (defined SD_MULTI_BLOCK || defined SD_RAW_BLOCKS)
+/**
+ * @brief   Read consecutive SD_SECTOR_SIZE-byte data blocks from the block
+ *          device
+ *
+ * @detailed    A single block, or every block of a device without multi-block
+ *              reads, is read on its own
+ *
+ * @param   address     Block address of the first block
+ * @param   count       Number of blocks to read
+ * @param   *dat        Location in chip memory to store the data blocks
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDReadDataBlocks (uint32_t address, uint32_t count, uint8_t *dat);
+#endif
+
+#if ((defined SD_MULTI_BLOCK && defined SD_FILE_WRITE) || defined SD_RAW_BLOCKS)
+/**
+ * @brief   Write consecutive SD_SECTOR_SIZE-byte data blocks to the block
+ *          device
+ *
+ * @detailed    A single block, or every block of a device without multi-block
+ *              writes, is written on its own
+ *
+ * @param   address     Block address of the first block
+ * @param   count       Number of blocks to write
+ * @param   *dat        Location in chip memory of the data blocks
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDWriteDataBlocks (uint32_t address, uint32_t count, uint8_t *dat);
+#endif
+
+#if (defined SD_ERASE_FREED || defined SD_RAW_BLOCKS)
+/**
+ * @brief   Erase consecutive sectors of the block device
+ *
+ * @detailed    Does nothing on a device without an erase operation
+ *
+ * @param   address     Address of the first sector
+ * @param   count       Number of sectors
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDEraseDataBlocks (const uint32_t address, const uint32_t count);
+#endif
+
+/**
+ * @brief   Wait for the block device to store everything written to it
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDSyncDevice (void);
+
+/**
+ * @brief   Make the volume given to one of the Vol functions the working
+ *          volume (g_sd_vol) of the functions it calls
+ *
+ * @param   *vol    A volume set up by SDVolumeInit(), or NULL for the default
+ *                  volume
+ */
+void SDUseVolume (sd_volume *vol);
+
+/**
+ * @brief   Read SD_SECTOR_SIZE-byte data block from SD card
+ *
+ * @param   *dev       Block device of the SD card
+ * @param   address    Block address to read from SD card
+ * @param   *dat       Location in chip memory to store data block
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDCardRead (sd_block_dev *dev, uint32_t address, uint8_t *dat);
+
+/**
+ * @brief   Write SD_SECTOR_SIZE-byte data block to SD card
+ *
+ * @detailed    The card programs the block in the background; the next access
+ *              waits for it
+ *
+ * @param   *dev        Block device of the SD card
+ * @param   address     Block address to write to SD card
+ * @param   *dat        Location in chip memory to read data block
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDCardWrite (sd_block_dev *dev, uint32_t address, uint8_t *dat);
+
+#ifdef SD_MULTI_BLOCK
+/**
+ * @brief   Read consecutive data blocks from SD card with a single command
+ *          (CMD18)
+ *
+ * @param   *dev        Block device of the SD card
+ * @param   address     Block address of the first block
+ * @param   count       Number of blocks to read; at least 2
+ * @param   *dat        Location in chip memory to store the data blocks
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDCardReadMulti (sd_block_dev *dev, uint32_t address, uint32_t count,
+        uint8_t *dat);
+
+#if (defined SD_FILE_WRITE || defined SD_RAW_BLOCKS)
+/**
+ * @brief   Write consecutive data blocks to SD card with a single command
+ *          (CMD25)
+ *
+ * @param   *dev        Block device of the SD card
+ * @param   address     Block address of the first block
+ * @param   count       Number of blocks to write; at least 2
+ * @param   *dat        Location in chip memory of the data blocks
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDCardWriteMulti (sd_block_dev *dev, uint32_t address, uint32_t count,
+        uint8_t *dat);
+#endif
+#endif
+
+#if (defined SD_ERASE_FREED || defined SD_RAW_BLOCKS)
+/**
+ * @brief   Erase consecutive sectors on SD card
+ *
+ * @detailed    The card finishes erasing in the background; the next access
+ *              waits for it
+ *
+ * @param   *dev        Block device of the SD card
+ * @param   address     Address of the first sector
+ * @param   count       Number of sectors
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDCardErase (sd_block_dev *dev, const uint32_t address,
+        const uint32_t count);
+
+/**
+ * @brief   Send one of the erase commands (CMD32, CMD33 or CMD38) to the
+ *          selected card and check its R1 response
+ *
+ * @param   cmd     Command
+ * @param   arg     Sector address, or 0 for CMD38
+ *
+ * @return  Returns 0 upon success, SD_INVALID_RESPONSE if the card did not
+ *          accept the command, error code otherwise
+ */
+uint8_t SDSendEraseCommand (const uint8_t cmd, const uint32_t arg);
+#endif
+
+/**
+ * @brief   Wait for SD card to finish programming or erasing
+ *
+ * @param   *dev    Block device of the SD card
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDCardSync (sd_block_dev *dev);
+
+/**
+ * @brief   Make a card the one addressed by the commands that follow
+ *
+ * @detailed    A sector still being read ahead from the previously addressed
+ *              card is received first, since its chip select stays low until
+ *              then. A card left busy is not waited for, so that one card may
+ *              program a sector while another is written
+ *
+ * @param   *dev    Block device of the SD card
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDSelectCard (sd_block_dev *dev);
+
+/**
+ * @brief   Wait for the selected card to finish programming a sector written by
+ *          SDCardWrite() or erasing sectors
+ *
+ * @detailed    Returns immediately if nothing has been written since the card
+ *              was last seen ready, so reads that follow reads cost nothing
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDWaitWhileBusy (void);
+
+/**
+ * @brief   Read from the selected card until it stops signalling busy
+ *
+ * @param   wait    Clock ticks to wait before timing out
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDPollWhileBusy (const uint32_t wait);
+
+#ifdef SD_BLOCK_FILE
+/**
+ * @brief   Read a sector of an image file
+ *
+ * @param   *dev        Block device set up by SDFileDevice()
+ * @param   address     Sector address
+ * @param   *dat        Location in memory to store the sector
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDFileRead (sd_block_dev *dev, uint32_t address, uint8_t *dat);
+
+/**
+ * @brief   Write a sector of an image file
+ *
+ * @param   *dev        Block device set up by SDFileDevice()
+ * @param   address     Sector address
+ * @param   *dat        Data of the sector
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDFileWrite (sd_block_dev *dev, uint32_t address, uint8_t *dat);
+
+/**
+ * @brief   Read consecutive sectors of an image file
+ *
+ * @param   *dev        Block device set up by SDFileDevice()
+ * @param   address     Address of the first sector
+ * @param   count       Number of sectors
+ * @param   *dat        Location in memory to store the sectors
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDFileReadMulti (sd_block_dev *dev, uint32_t address, uint32_t count,
+        uint8_t *dat);
+
+/**
+ * @brief   Write consecutive sectors of an image file
+ *
+ * @param   *dev        Block device set up by SDFileDevice()
+ * @param   address     Address of the first sector
+ * @param   count       Number of sectors
+ * @param   *dat        Data of the sectors
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDFileWriteMulti (sd_block_dev *dev, uint32_t address, uint32_t count,
+        uint8_t *dat);
+
+/**
+ * @brief   Flush an image file's stream
+ *
+ * @param   *dev        Block device set up by SDFileDevice()
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDFileSync (sd_block_dev *dev);
+#endif
+
+#ifdef SD_RAM_DISK
+/**
+ * @brief   Read consecutive sectors of a RAM disk
+ *
+ * @param   *dev        Block device set up by SDRamDevice()
+ * @param   address     Address of the first sector
+ * @param   count       Number of sectors
+ * @param   *dat        Location in memory to store the sectors
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDRamReadMulti (sd_block_dev *dev, uint32_t address, uint32_t count,
+        uint8_t *dat);
+
+/**
+ * @brief   Write consecutive sectors of a RAM disk
+ *
+ * @param   *dev        Block device set up by SDRamDevice()
+ * @param   address     Address of the first sector
+ * @param   count       Number of sectors
+ * @param   *dat        Data of the sectors
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDRamWriteMulti (sd_block_dev *dev, uint32_t address, uint32_t count,
+        uint8_t *dat);
+
+/**
+ * @brief   Read a sector of a RAM disk
+ *
+ * @param   *dev        Block device set up by SDRamDevice()
+ * @param   address     Sector address
+ * @param   *dat        Location in memory to store the sector
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDRamRead (sd_block_dev *dev, uint32_t address, uint8_t *dat);
+
+/**
+ * @brief   Write a sector of a RAM disk
+ *
+ * @param   *dev        Block device set up by SDRamDevice()
+ * @param   address     Sector address
+ * @param   *dat        Data of the sector
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDRamWrite (sd_block_dev *dev, uint32_t address, uint8_t *dat);
+#endif
+
+#ifdef SD_READ_AHEAD
+/**
+ * @brief   Begin reading a sector that will only be needed later
+ *
+ * @detailed    The SPI cog is left receiving the data; every other transfer
+ *              finishes it first (see SDFinishReadDataBlock()). A sector of
+ *              any other device is read before returning
+ *
+ * @param   address     Sector address to be read
+ * @param   *dat        Location in memory to receive the sector
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDStartReadDataBlock (uint32_t address, uint8_t *dat);
+
+/**
+ * @brief   Wait for a sector started by SDStartReadDataBlock() to arrive
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDFinishReadDataBlock (void);
+#endif
+
+/**
+ * @brief   Return byte-reversed 16-bit variable (SD cards store bytes
+ *          little-endian therefore we must reverse them to use multi-byte
+ *          variables)
+ *
+ * @param   buf[]   Address of first byte of data
+ *
+ * @return  Returns a normal (big-endian) 16-bit word
+ */
+uint16_t SDReadDat16 (const uint8_t buf[]);
+
+/**
+ * @brief   Return byte-reversed 32-bit variable (SD cards store bytes
+ *          little-endian therefore we must reverse them to use multi-byte
+ *          variables)
+ *
+ * @param   buf[]   Address of first byte of data
+ *
+ * @return  Returns a normal (big-endian) 32-bit word
+ */
+uint32_t SDReadDat32 (const uint8_t buf[]);
+
+#if (defined SD_FILE_WRITE || defined SD_RING_LOG)
+/**
+ * @brief   Write a byte-reversed 16-bit variable (SD cards store bytes
+ *          little-endian therefore we must reverse them to use multi-byte
+ *          variables)
+ *
+ * @param   buf[]   Address to store the first byte of data
+ * @param   dat     Normal, 16-bit variable to be written to RAM in reverse
+ *                  endian
+ */
+void SDWriteDat16 (uint8_t buf[], const uint16_t dat);
+
+/**
+ * @brief   Write a byte-reversed 32-bit variable (SD cards store bytes
+ *          little-endian therefore we must reverse them to use multi-byte
+ *          variables)
+ *
+ * @param   buf[]   Address to store the first byte of data
+ * @param   dat     Normal, 32-bit variable to be written to RAM in reverse
+ *                  endian
+ */
+void SDWriteDat32 (uint8_t buf[], const uint32_t dat);
+#endif
+
+/**
+ * @brief       Walk the directories of a Unix-style path (like /foo/bar/baz.txt)
+ *
+ * @detailed    Each component is entered in turn, beginning at the root
+ *              directory if the path starts with '/' and at the current
+ *              directory otherwise
+ *
+ * @param       *path   C-string representing Unix-style path
+ * @param       **name  If NULL, every component of the path is entered;
+ *                      otherwise the final component is not entered and the
+ *                      address of its first character is stored here
+ *
+ * @return      Returns 0 upon success, SD_INVALID_FILENAME if a component is
+ *              too long for an 8.3 name, error code otherwise; the current
+ *              directory (dir_firstAllocUnit) is left wherever the walk
+ *              stopped and must be restored by the caller
+ */
+uint8_t SDWalkPath (const char *path, const char **name);
+
+/**
+ * @brief   Make a sub-directory of the current directory the current one
+ *
+ * @param   *d      Short filename of the directory
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDEnterDir (const char *d);
+
+#ifdef SD_PATH_CACHE
+/**
+ * @brief   Look up a sub-directory of the current directory in the path cache
+ *
+ * @param   rawName     Name as produced by SDNormalizeName()
+ * @param   *allocUnit  The sub-directory's first allocation unit is stored
+ *                      here if it was cached
+ *
+ * @return  Returns non-zero if the sub-directory was cached, 0 otherwise
+ */
+uint8_t SDPathCacheLookup (const uint32_t rawName[], uint32_t *allocUnit);
+
+/**
+ * @brief   Remember a sub-directory of the current directory, replacing the
+ *          oldest entry in the path cache
+ *
+ * @param   rawName     Name as produced by SDNormalizeName()
+ * @param   allocUnit   The sub-directory's first allocation unit
+ */
+void SDPathCacheInsert (const uint32_t rawName[], const uint32_t allocUnit);
+#endif
+
+/**
+ * @brief   Find and return the starting sector's address for a given allocation
+ *          unit (note - not cluster)
+ *
+ * @param   allocUnit   Allocation unit in FAT filesystem
+ *
+ * @return  Returns sector address of         desired allocation unit
+ */
+uint32_t SDGetSectorFromAlloc (uint32_t allocUnit);
+
+/**
+ * @brief   Read an entry from the FAT
+ *
+ * @param   fatEntry    Entry number (allocation unit) to read in the FAT
+ * @param   *value      Address to store the value into (the next allocation
+ *                      unit)
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDGetFATValue (const uint32_t fatEntry, uint32_t *value);
+
+/**
+ * @brief   Find the next sector in the FAT, directory, or file. When it is
+ *          found, load it into the appropriate global buffer
+ *
+ * @param   *buf    Array of SD_SECTOR_SIZE bytes that can be filled with the
+ *                  requested sector
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDLoadNextSector (sd_buffer *buf);
+
+/**
+ * @brief   Load a requested sector into the buffer independent of the current
+ *          sector or cluster
+ *
+ * @Pre:    *buf must point to a file entry (g_sd_file_
+ *
+ * @param   *buf    Address of the sd_buffer object to be updated
+ * @param   offset  How many sectors past the first one should be skipped
+ *                  (sector number of the file)
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ *
+ */
+uint8_t SDLoadSectorFromOffset (sd_file *f, const uint32_t offset);
+
+/**
+ * @brief   Walk the FAT until the file's buffer points at the cluster
+ *          containing a given sector of the file; the sector itself is not read
+ *
+ * @pre     The buffer must not hold modified data - the cluster it belongs to
+ *          may change
+ *
+ * @param   *f      Address of the file object to be updated
+ * @param   offset  Sector number of the file
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDFindClusterFromOffset (sd_file *f, const uint32_t offset);
+
+#ifdef SD_SEEK_CHECKPOINTS
+/**
+ * @brief   Empty a newly opened file's checkpoint table, leaving only its
+ *          first cluster
+ *
+ * @detailed    Checkpoints start out far enough apart for the table to cover
+ *              the whole file. A file given no table (NULL or no entries)
+ *              keeps no checkpoints
+ *
+ * @param   *f      Address of the file object
+ */
+void SDCheckpointReset (sd_file *f);
+
+/**
+ * @brief   Record the cluster a file's buffer points at if a checkpoint falls
+ *          on it
+ *
+ * @param   *f      Address of the file object
+ */
+void SDCheckpointRecord (sd_file *f);
+
+/**
+ * @brief   Point a file's buffer at the last known checkpoint at or before a
+ *          cluster, unless the current cluster is closer
+ *
+ * @param   *f          Address of the file object to be updated
+ * @param   cluster     Cluster number of the file that will be walked to
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDCheckpointSeek (sd_file *f, const uint32_t cluster);
+
+#ifdef SD_FILE_WRITE
+/**
+ * @brief   Forget the checkpoints of clusters a file no longer owns
+ *
+ * @param   *f          Address of the file object
+ * @param   clusters    Number of clusters left in the file
+ */
+void SDCheckpointTruncate (sd_file *f, const uint32_t clusters);
+#endif
+#endif
+
+#ifdef SD_MULTI_BLOCK
+/**
+ * @brief   Find how many sectors, starting at a given sector of a file, are
+ *          stored one after another on the card
+ *
+ * @detailed    The run continues into following clusters for as long as each
+ *              one is the allocation unit after the previous; the file's
+ *              buffer is left pointing at the last cluster of the run
+ *
+ * @pre     The file's buffer must point at the cluster containing the sector
+ *          (see SDFindClusterFromOffset())
+ *
+ * @param   *f          Address of the file object to be updated
+ * @param   offset      Sector number of the file
+ * @param   want        Most sectors wanted
+ * @param   *sectors    Returns the number of sectors in the run; at least 1
+ *                      and at most 'want'
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDFindExtent (sd_file *f, const uint32_t offset, const uint32_t want,
+        uint32_t *sectors);
+#endif
+
+/**
+ * @brief       Read the next sector from SD card into memory
+ * @detailed    When the final sector of a cluster is finished, SDIncCluster can
+ *              be called. The appropriate global variables will be set
+ *              according (incremented or set by the FAT) and the first sector
+ *              of the next cluster will be read into the desired buffer.
+ *
+ * @param       *buf    Array of SD_SECTOR_SIZE bytes used to hold a sector from
+ *                      the SD card
+ *
+ * @return      Returns 0 upon success, error code otherwise
  */
-uint8_t SDPrintHexBlock (uint8_t *dat, uint16_t bytes);
-#endif
+uint8_t SDIncCluster (sd_buffer *buf);
 
-/**@}*/
+/**
+ * @brief   Read the standard length name of a file entry. If an extension
+ *          exists, a period will be inserted before the extension. A
+ *          null-terminator is always appended to the end
+ *
+ * @Pre:    *buf must point to the first byte in a FAT entry - no error checking
+ *          is executed on buf
+ * @Pre:    Errors may occur if at least 13 (8 + 1 + 3 + 1) bytes of memory are
+ *          not allocated for filename
+ *
+ * @param   *buf        First byte in local memory containing a FAT entry
+ * @param   *filename   Address in memory where the filename string will be
+ *                      stored
+ */
+void SDGetFilename (const uint8_t *buf, char *filename);
 
-/*******************************************
- *** Private SD Definitions & Prototypes ***
- *******************************************/
 /**
- * @defgroup sd_private Private members
- @{*/
-#if (defined SD_DEBUG || defined SD_VERBOSE || defined SD_VERBOSE_BLOCKS || \
-defined SD_SHELL)
-#include <stdio.h>
+ * @brief       Find a file entry (file or sub-directory)
+ *
+ * @detailed    Find a file or directory that matches the name in *filename in
+ *              the current directory; its relative location is communicated by
+ *              placing it in the address of *fileEntryOffset
+ *
+ * @param       *filename           C-string representing the short (standard)
+ *                                  filename
+ * @param       *fileEntryOffset    The buffer offset will be returned via this
+ *                                  address if the file is found
+ *
+ * @return      Returns 0 upon success, error code otherwise (common error code
+ *              is SD_EOC_END for end-of-chain or file-not-found marker)
+ */
+uint8_t SDFind (const char *filename, uint16_t *fileEntryOffset);
+
+/**
+ * @brief   Open a file in the current directory; see SDfopen()
+ *
+ * @param   *name   Short filename of the file
+ * @param   *f      Address where file information will be stored
+ * @param   mode    Mode to open the file with
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDOpenEntry (const char *name, sd_file *f, const sd_file_mode mode);
+
+/**
+ * @brief       Convert a C-string filename into its padded, on-disk form
+ *
+ * @detailed    "STUFF.TXT" becomes "STUFF   TXT"; the special entries "." and
+ *              ".." are supported. Case is not altered
+ *
+ * @param       *filename   C-string representing the short (standard) filename
+ * @param       rawName     Address where the SD_SHORT_NAME_LEN bytes of the
+ *                          padded name will be stored (not null-terminated);
+ *                          a directory entry or an array of
+ *                          SD_SHORT_NAME_WORDS longs
+ *
+ * @return      Returns 0 upon success, SD_INVALID_FILENAME if the name does
+ *              not fit the 8.3 format
+ */
+uint8_t SDNormalizeName (const char *filename, char rawName[]);
+
+/**
+ * @brief       Compare the name of a directory entry against a padded name
+ *
+ * @detailed    The name is compared a long at a time rather than formatting
+ *              the entry into a C-string first
+ *
+ * @pre         *entry must be long-aligned, as every entry in a sector buffer
+ *              is
+ *
+ * @param       *entry      First byte of a directory entry
+ * @param       rawName     Name as produced by SDNormalizeName()
+ *
+ * @return      Returns non-zero if the names are the same, 0 otherwise
+ */
+uint8_t SDNameMatches (const uint8_t *entry, const uint32_t rawName[]);
+
+#ifdef SD_DIR_INDEX
+/**
+ * @brief   Hash the padded, on-disk form of a filename
+ *
+ * @param   rawName     SD_SHORT_NAME_LEN bytes of a padded filename
+ *
+ * @return  Returns a hash that is never SD_DIR_INDEX_EMPTY nor
+ *          SD_DIR_INDEX_DELETED
+ */
+uint16_t SDDirIndexHash (const uint8_t rawName[]);
+
+/**
+ * @brief   Forget the contents of the directory index and begin indexing the
+ *          current directory; the index is marked built once a search has
+ *          read the whole directory
+ */
+void SDDirIndexReset (void);
+
+/**
+ * @brief       Add the directory entry at the given offset of g_sd_buf to the
+ *              index
+ *
+ * @detailed    The slot of a removed entry is reused. Once the index is 3/4
+ *              full it stops accepting entries and is no longer able to rule
+ *              out a file's existence
+ *
+ * @param       fileEntryOffset     Offset of the entry within g_sd_buf
+ */
+void SDDirIndexInsert (const uint16_t fileEntryOffset);
+
+/**
+ * @brief   Remove the directory entry at the given offset of g_sd_buf from the
+ *          index
+ *
+ * @param   fileEntryOffset     Offset of the entry within g_sd_buf
+ */
+void SDDirIndexRemove (const uint16_t fileEntryOffset);
+
+/**
+ * @brief       Record that the directory's entries end at the given offset of
+ *              g_sd_buf
+ *
+ * @param       fileEntryOffset     Offset of the first unused entry within
+ *                                  g_sd_buf, or SD_SECTOR_SIZE if the
+ *                                  directory ends with the sector in g_sd_buf
+ */
+void SDDirIndexSetEnd (const uint16_t fileEntryOffset);
+
+/**
+ * @brief       Search the directory index for a name
+ *
+ * @detailed    Each slot with a matching hash costs at most one sector read to
+ *              verify the name; the verified entry is left loaded in g_sd_buf
+ *
+ * @param       rawName             Name as produced by SDNormalizeName()
+ * @param       *fileEntryOffset    The buffer offset will be returned via this
+ *                                  address if the file is found
+ *
+ * @return      Returns 0 upon success, SD_FILENAME_NOT_FOUND if no indexed
+ *              entry matches, or an error code from reading the SD card
+ */
+uint8_t SDDirIndexLookup (const uint32_t rawName[], uint16_t *fileEntryOffset);
+
+/**
+ * @brief   Load the directory sector described by an index slot into g_sd_buf
+ *
+ * @param   *pos    Index slot describing the sector
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDDirIndexLoad (const sd_dir_index_entry *pos);
 #endif
 
-// SPI config
-#define SD_SPI_INIT_FREQ            200000          // Run SD initialization at 200 kHz
-#define SD_SPI_MODE                 SPI_MODE_0
-#define SD_SPI_BITMODE              SPI_MSB_FIRST
+/**
+ * @brief    Reload the sector currently in use by a given file
+ *
+ * @param    *f        Address of the file object requested
+ *
+ * @return        Returns 0 upon success, error code otherwise
+ */
+uint8_t SDReloadBuf (sd_file *f);
 
-// Misc. SD Definitions
-#define SD_WIGGLE_ROOM              10000
-#define SD_RESPONSE_TIMEOUT         CLKFREQ/10      // Wait 0.1 seconds for a response before timing out
-#define SD_SECTOR_SIZE_SHIFT        9
+#ifdef SD_BUFFER_POOL
+/**
+ * @brief       Borrow a buffer from the pool
+ *
+ * @detailed    The least recently used buffer is chosen; clean buffers are
+ *              preferred over modified ones so that a write-back is only
+ *              required when every buffer holds unsaved data
+ *
+ * @param       **buf   Address where the chosen buffer's address is stored
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDGetPoolBuf (sd_buffer **buf);
 
-// SD Commands
-#define SD_CMD_IDLE                 0x40 + 0        // Send card into idle state
-#define    SD_CMD_SDHC              0x40 + 8        // Set SD card version (1 or 2) and voltage level range
-#define SD_CMD_RD_CSD               0x40 + 9        // Request "Card Specific Data" block contents
-#define SD_CMD_RD_CID               0x40 + 10       // Request "Card Identification" block contents
-#define SD_CMD_RD_BLOCK             0x40 + 17       // Request data block
-#define SD_CMD_WR_BLOCK             0x40 + 24       // Write data block
-#define SD_CMD_READ_OCR             0x40 + 58       // Request "Operating Conditions Register" contents
-#define SD_CMD_APP                  0x40 + 55       // Inform card that following instruction is application specific
-#define SD_CMD_WR_OP                0x40 + 41       // Send operating conditions for SDC
-// SD Arguments
-#define SD_CMD_VOLT_ARG             0x000001AA
-#define SD_ARG_LEN                  5
+/**
+ * @brief       Make sure that the directory buffer of g_sd_vol is not held by
+ *              a file
+ *
+ * @detailed    Once a file has loaded one of its sectors into the buffer that
+ *              the directory was using (or another volume's directory has
+ *              borrowed it), the file keeps it and the directory moves to its
+ *              own buffer, if that is free, or to the least recently used pool
+ *              buffer
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDClaimDirBuf (void);
 
-// SD CRCs
-#define SD_CRC_IDLE                 0x95
-#define SD_CRC_SDHC                 0x87
-#define SD_CRC_ACMD                 0x77
-#define SD_CRC_OTHER                0x01
+/**
+ * @brief   Determine whether a buffer is owned by the driver's pool
+ *
+ * @param   *buf    Address of the buffer in question
+ *
+ * @return  Returns non-zero if the buffer is one of the pool buffers, 0
+ *          otherwise
+ */
+uint8_t SDIsPoolBuf (const sd_buffer *buf);
 
-// SD Responses
-#define SD_RESPONSE_IDLE            0x01
-#define SD_RESPONSE_ACTIVE          0x00
-#define SD_DATA_START_ID            0xFE
-#define SD_RESPONSE_LEN_R1          1
-#define SD_RESPONSE_LEN_R3          5
-#define    SD_RESPONSE_LEN_R7       5
-#define SD_RSPNS_TKN_BITS           0x0f
-#define SD_RSPNS_TKN_ACCPT          ((0x02 << 1) | 1)
-#define SD_RSPNS_TKN_CRC            ((0x05 << 1) | 1)
-#define SD_RSPNS_TKN_WR             ((0x06 << 1) | 1)
+/**
+ * @brief   Mark a buffer as just used so that the pool evicts it last
+ *
+ * @param   *buf    Address of the buffer being used
+ */
+void SDTouchBuf (sd_buffer *buf);
+#endif
 
-// Boot sector addresses/values
-#define SD_FAT_16                   2               // A FAT entry in FAT16 is 2-bytes
-#define SD_FAT_32                   4               // A FAT entry in FAT32 is 4-bytes
-#define SD_BOOT_SECTOR_ID           0xeb
-#define SD_BOOT_SECTOR_ID_ADDR      0
-#define SD_BOOT_SECTOR_BACKUP       0x1c6
-#define SD_CLUSTER_SIZE_ADDR        0x0d
-#define SD_RSVD_SCTR_CNT_ADDR       0x0e
-#define SD_NUM_FATS_ADDR            0x10
-#define SD_ROOT_ENTRY_CNT_ADDR      0x11
-#define SD_TOT_SCTR_16_ADDR         0x13
-#define SD_FAT_SIZE_16_ADDR         0x16
-#define SD_TOT_SCTR_32_ADDR         0x20
-#define SD_FAT_SIZE_32_ADDR         0x24
-#define SD_ROOT_CLUSTER_ADDR        0x2c
-#define SD_FAT12_CLSTR_CNT          4085
-#define SD_FAT16_CLSTR_CNT          65525
+#ifdef SD_READ_AHEAD
+/**
+ * @brief   Request the sector after a file's current one into a free pool
+ *          buffer
+ *
+ * @detailed    Nothing is done if the sector is already requested, lies beyond
+ *              the end of the file or no clean pool buffer is available
+ *
+ * @param   *f      Address of a file whose buffer is a pool buffer
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDReadAhead (sd_file *f);
 
-// FAT file/directory values
-#define SD_FILE_ENTRY_LENGTH        32              // An entry in a directory uses 32 bytes
-#define SD_DELETED_FILE_MARK        0xe5            // Marks that a file has been deleted here, continue to the next entry
-#define SD_FILE_NAME_LEN            8               // 8 characters in the standard file name
-#define SD_FILE_EXTENSION_LEN       3               // 3 character file name extension
-#define SD_FILENAME_STR_LEN         SD_FILE_NAME_LEN + SD_FILE_EXTENSION_LEN + 2
-#define SD_FILE_ATTRIBUTE_OFFSET    0x0B            // Byte of a file entry to store attribute flags
-#define SD_FILE_START_CLSTR_LOW     0x1a            // Starting cluster number
-#define SD_FILE_START_CLSTR_HIGH    0x14            // High word (16-bits) of the starting cluster number (FAT32 only)
-#define SD_FILE_LEN_OFFSET          0x1c            // Length of a file in bytes
-#define SD_FREE_CLUSTER             0               // Cluster is unused
-#define SD_RESERVED_CLUSTER         1
-#define SD_RSVD_CLSTR_VAL_BEG       -15             // First reserved cluster value
-#define SD_RSVD_CLSTR_VAL_END       -9              // Last reserved cluster value
-#define SD_BAD_CLUSTER              -8              // Cluster is corrupt
-#define SD_EOC_BEG                  -7              // First marker for end-of-chain (end of file entry within FAT)
-#define SD_EOC_END                  -1              // Last marker for end-of-chain
-// FAT file attributes (definitions with trailing underscore represent character for a cleared attribute flag)
-#define SD_READ_ONLY                BIT_0
-#define SD_READ_ONLY_CHAR           'r'
-#define SD_READ_ONLY_CHAR_          'w'
-#define SD_HIDDEN_FILE              BIT_1
-#define SD_HIDDEN_FILE_CHAR         'h'
-#define SD_HIDDEN_FILE_CHAR_        '.'
-#define SD_SYSTEM_FILE              BIT_2
-#define SD_SYSTEM_FILE_CHAR         's'
-#define SD_SYSTEM_FILE_CHAR_        '.'
-#define SD_VOLUME_ID                BIT_3
-#define SD_VOLUME_ID_CHAR           'v'
-#define SD_VOLUME_ID_CHAR_          '.'
-#define SD_SUB_DIR                  BIT_4
-#define SD_SUB_DIR_CHAR             'd'
-#define SD_SUB_DIR_CHAR_            'f'
-#define SD_ARCHIVE                  BIT_5
-#define SD_ARCHIVE_CHAR             'a'
-#define SD_ARCHIVE_CHAR_            '.'
+/**
+ * @brief   Swap the read-ahead buffer in as a file's buffer if it holds the
+ *          requested sector
+ *
+ * @param   *f      Address of the file
+ * @param   offset  Sector offset from the beginning of the file
+ *
+ * @return  Returns 1 if the buffer was swapped in, 0 otherwise
+ */
+uint8_t SDTakeReadAhead (sd_file *f, const uint32_t offset);
 
-// File constants
-#ifndef SD_EOF
-#define SD_EOF                      ((uint8_t) -1)  // System dependent - may need to be defined elsewhere
+/**
+ * @brief   Forget the sector read ahead for a file
+ *
+ * @param   *f      Address of the file
+ */
+void SDCancelReadAhead (const sd_file *f);
 #endif
 
-#define SD_FOLDER_ID                ((uint8_t) -1)  // Signal that the contents of a buffer are a directory
-struct _sd_buffer {
-    uint8_t buf[SD_SECTOR_SIZE];  // Buffer for SD card contents
-    uint8_t id;  // Buffer ID - determine who owns the current information
-    uint32_t curClusterStartAddr;  // Store the current cluster's starting sector number
-    uint8_t curSectorOffset;  // Store the current sector offset from the beginning of the cluster
-    uint32_t curAllocUnit;  // Store the current allocation unit
-    uint32_t nextAllocUnit;  // Look-ahead at the next FAT entry
-#ifdef SD_FILE_WRITE
-    uint8_t mod; // When set, the currently loaded sector has been modified since it was read from
-                 // the SD card
-#endif
-};
+#ifdef SD_FILE_WRITE
+/**
+ * @brief   If a buffer has been modified, write it back to the SD card
+ *
+ * @param   *buf    Address of the buffer to be saved
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDWriteBackBuf (sd_buffer *buf);
+
+/**
+ * @brief       Save a file's modified sector, record its length in the
+ *              directory buffer and bring the FAT up to date
+ *
+ * @detailed    The directory sector is left modified in the directory buffer;
+ *              SDfflush() writes it as well
+ *
+ * @param       *f      Address of the file object
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDFlushFile (sd_file *f);
+
+/**
+ * @brief       Record a file's length in its directory entry
+ *
+ * @detailed    The directory sector is loaded into the directory buffer if it
+ *              is not already there, and left modified
+ *
+ * @param       *f      Address of the file object
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDWriteFileLength (sd_file *f);
+
+/**
+ * @brief       Flush a file after a write call if its sync policy requires it
+ *
+ * @param       *f      Address of the file object that was written to
+ * @param       bytes   Number of bytes written by the call
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDCheckSync (sd_file *f, const uint32_t bytes);
 
-struct _sd_file {
-    sd_buffer *buf;
-    uint8_t id;  // determine if the buffer is owned by this file
-    file_pos wPtr;
-    file_pos rPtr;
-    sd_file_mode mode;
-    uint32_t length;
-    uint32_t maxSectors; // Maximum number of sectors currently allocated to a file
-    uint8_t mod; // When the length of a file is changed, this variable will be set, otherwise cleared
-    uint32_t firstAllocUnit;  // File's starting allocation unit
-    uint32_t curSector; // like curSectorOffset, but does not reset upon loading a new cluster
-    uint32_t curCluster;  // like curSector, but for allocation units
+/**
+ * @brief       Write the volume's FAT buffer to a sector of the FAT and clear
+ *              fatMod
+ *
+ * @detailed    With SD_FAT_MIRROR_LAZY, only the first copy of the FAT is
+ *              written and the sector is queued for SDSyncFATs(); otherwise
+ *              every copy is written
+ *
+ * @param       fatSector   Sector offset from the start of the FAT
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDWriteFATSector (const uint32_t fatSector);
 
-    uint32_t dirSectorAddr; // Which sector of the SD card contains this file's meta-data
-    uint16_t fileEntryOffset;
-};
+/**
+ * @brief       Write the FAT buffer if modified and copy every queued FAT
+ *              sector to the remaining copies of the FAT
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDSyncFATs (void);
 
-/***********************************
- *** Private Function Prototypes ***
- ***********************************/
 /**
- * @brief    Send a command and argument over SPI to the SD card
+ * @brief       Find the first empty allocation unit in the FAT
  *
- * @param    command        6-bit value representing the command sent to the SD
- *                          card
+ * @detailed    The value of the first empty allocation unit is returned and its
+ *              location will contain the end-of-chain marker, SD_EOC_END.
+ *              NOTE: It is important to realize that, though the new entry now
+ *              contains an EOC marker, this function does not know what cluster
+ *              is being extended and therefore the calling function must
+ *              modify the previous EOC to contain the return value
  *
- * @return
+ * @param       restore     If non-zero, the original fat-sector will be
+ *                          restored to the FAT buffer before returning; if
+ *                          zero, the last-used sector will remain loaded
+ *
+ * @return      Returns the number of the first unused allocation unit
  */
-uint8_t SDSendCommand (const uint8_t cmd, const uint32_t arg,
-        const uint8_t crc);
+uint32_t SDFindEmptySpace (const uint8_t restore);
 
 /**
- * @brief   Receive response and data from SD card over SPI
+ * @brief       Find the first free entry in a sector of the FAT
  *
- * @param   bytes   Number of bytes to receive
- * @param   *data   Location in memory with enough space to store 'bytes' bytes
- *                  of data
+ * @detailed    Entries are tested a long at a time; for FAT16, both entries
+ *              of a long are tested at once and only a long holding a free
+ *              one is looked at more closely
  *
- * @return  Returns 0 for success, else error code
+ * @pre         fat[] must be long-aligned
+ *
+ * @param       fat[]       Sector of the FAT
+ * @param       offset      Byte offset of the first entry to be tested
+ *
+ * @return      Returns the byte offset of the first free entry at or after
+ *              offset, or SD_SECTOR_SIZE if there is none
  */
-uint8_t SDGetResponse (const uint8_t numBytes, uint8_t *dat);
+uint16_t SDFindFreeEntry (const uint8_t fat[], uint16_t offset);
 
+#ifdef SD_FREE_SPACE
 /**
- * @brief   Receive data from SD card via SPI
+ * @brief       Count the free entries at the start of a sector of the FAT
  *
- * @param   bytes   Number of bytes to receive
- * @param   *data   Location in memory with enough space to store 'bytes' bytes
- *                  of data
+ * @detailed    Entries are tested a long at a time, like SDFindFreeEntry()
  *
- * @return  Returns 0 for success, else error code
+ * @pre         fat[] must be long-aligned
+ *
+ * @param       fat[]       Sector of the FAT
+ * @param       entries     Number of entries to be tested
+ *
+ * @return      Returns the number of free entries
  */
-uint8_t SDReadBlock (uint16_t bytes, uint8_t *dat);
+uint16_t SDCountFreeEntries (const uint8_t fat[], const uint16_t entries);
 
 /**
- * @brief   Write data to SD card via SPI
+ * @brief       Find the number of free clusters while mounting
  *
- * @param   bytes   Block address to read from SD card
- * @param   *dat    Location in memory where data resides
+ * @detailed    The count stored in FSInfo is used when the sector is valid and
+ *              holds one; otherwise every sector of the FAT is read.
+ *              The FAT buffer is used as scratch space
  *
- * @return  Returns 0 upon success, error code otherwise
+ * @param       fsInfoAddr  Address of the FSInfo sector; 0 if there is none
+ *
+ * @return      Returns 0 upon success, error code otherwise
  */
-uint8_t SDWriteBlock (uint16_t bytes, uint8_t *dat);
+uint8_t SDLoadFreeCount (const uint32_t fsInfoAddr);
 
+#ifdef SD_FILE_WRITE
 /**
- * @brief   Read SD_SECTOR_SIZE-byte data block from SD card
+ * @brief       Store the number of free clusters in the FSInfo sector if it
+ *              has changed
  *
- * @param   address    Number of bytes to send
- * @param   *dat       Location in chip memory to store data block
+ * @pre         The loaded FAT sector must have been saved (see SDSyncFATs())
+ *
+ * @return      Returns 0 upon success, error code otherwise
+ */
+uint8_t SDWriteFSInfo (void);
+#endif
+#endif
+
+/* @brief   Enlarge a file or directory by one cluster
+ *
+ * @param   *buf    Address of the buffer (containing information for a file or
+ *                  directory) to be enlarged
  *
  * @return  Returns 0 upon success, error code otherwise
  */
-uint8_t SDReadDataBlock (uint32_t address, uint8_t *dat);
+uint8_t SDExtendFAT (sd_buffer *buf);
 
 /**
- * @brief   Write SD_SECTOR_SIZE-byte data block to SD card
+ * @brief   Make room for one more cluster at the end of a file
  *
- * @param   address     Block address to write to SD card
- * @param   *dat        Location in chip memory to read data block
+ * @detailed    Clusters already chained beyond f->maxSectors (such as after an
+ *              interrupted preallocation) are reused before the FAT is
+ *              extended. A file that keeps growing quickly claims several
+ *              adjacent clusters at once, and fewer again as it slows down
+ *              (see SD_EXTEND_MAX_CLUSTERS); the surplus is released by
+ *              SDfclose(). With SD_AU_ALIGN, a file that can not
+ *              continue directly after its last cluster moves on to the start
+ *              of one of the card's allocation units. The file's buffer is left
+ *              holding none of its sectors
+ *
+ * @param   *f      Address of the file to be enlarged
  *
  * @return  Returns 0 upon success, error code otherwise
  */
-uint8_t SDWriteDataBlock (uint32_t address, uint8_t *dat);
+uint8_t SDExtendFile (sd_file *f);
 
+#ifdef SD_TAIL_CACHE
 /**
- * @brief   Return byte-reversed 16-bit variable (SD cards store bytes
- *          little-endian therefore we must reverse them to use multi-byte
- *          variables)
+ * @brief       Look up the last allocation unit of a recently closed file
  *
- * @param   buf[]   Address of first byte of data
+ * @detailed    A cached unit is only returned if the FAT still chains it to
+ *              the checkpoint kept with it, the right number of clusters
+ *              later, and marks it as the end of the chain
  *
- * @return  Returns a normal (big-endian) 16-bit word
+ * @param       *f              Address of a file whose firstAllocUnit and
+ *                              maxSectors are set
+ * @param       *tailAllocUnit  The last allocation unit, or 0 if the file is
+ *                              not cached, will be stored here
+ *
+ * @return      Returns 0 upon success, error code otherwise
  */
-uint16_t SDReadDat16 (const uint8_t buf[]);
+uint8_t SDTailCacheLookup (const sd_file *f, uint32_t *tailAllocUnit);
 
 /**
- * @brief   Return byte-reversed 32-bit variable (SD cards store bytes
- *          little-endian therefore we must reverse them to use multi-byte
- *          variables)
+ * @brief   Remember the last allocation unit of a file that is being closed,
+ *          along with its last checkpoint to check the unit against later
  *
- * @param   buf[]   Address of first byte of data
+ * @param   *f      Address of a file whose tailAllocUnit is known
+ */
+void SDTailCacheInsert (const sd_file *f);
+
+/**
+ * @brief   Forget the last allocation unit of a file that is being deleted
  *
- * @return  Returns a normal (big-endian) 32-bit word
+ * @param   firstAllocUnit  First allocation unit of the file
  */
-uint32_t SDReadDat32 (const uint8_t buf[]);
+void SDTailCacheRemove (const uint32_t firstAllocUnit);
+#endif
 
-#ifdef SD_FILE_WRITE
 /**
- * @brief   Write a byte-reversed 16-bit variable (SD cards store bytes
- *          little-endian therefore we must reverse them to use multi-byte
- *          variables)
+ * @brief   Chain free allocation units that directly follow a buffer's last
+ *          cluster onto it
  *
- * @param   buf[]   Address to store the first byte of data
- * @param   dat     Normal, 16-bit variable to be written to RAM in reverse
- *                  endian
+ * @detailed    Only allocation units whose entries share the FAT sector of the
+ *              last cluster are considered, so that the whole run is claimed
+ *              with a single FAT sector update
+ *
+ * @param   *buf    Address of a buffer positioned on the last cluster of a
+ *                  chain
+ * @param   want    Most allocation units to claim
+ * @param   *count  Set to the number of allocation units claimed (may be 0)
+ *
+ * @return  Returns 0 upon success, error code otherwise
  */
-void SDWriteDat16 (uint8_t buf[], const uint16_t dat);
+uint8_t SDClaimAdjacent (sd_buffer *buf, const uint8_t want, uint8_t *count);
 
+#ifdef SD_AU_ALIGN
 /**
- * @brief   Write a byte-reversed 32-bit variable (SD cards store bytes
- *          little-endian therefore we must reverse them to use multi-byte
- *          variables)
+ * @brief   Chain a run of free allocation units that starts on one of the
+ *          card's allocation unit boundaries onto a buffer's last cluster
  *
- * @param   buf[]   Address to store the first byte of data
- * @param   dat     Normal, 32-bit variable to be written to RAM in reverse
- *                  endian
+ * @detailed    If the allocation unit directly after the last cluster is free
+ *              (SDClaimAdjacent() stops at the end of a FAT sector), that one
+ *              is claimed instead so that the chain stays contiguous
+ *
+ * @param   *buf    Address of a buffer positioned on the last cluster of a
+ *                  chain
+ * @param   want    Number of allocation units to claim from a boundary
+ * @param   *count  Set to the number of allocation units claimed (may be 0)
+ *
+ * @return  Returns 0 upon success, error code otherwise
  */
-void SDWriteDat32 (uint8_t buf[], const uint32_t dat);
+uint8_t SDClaimAligned (sd_buffer *buf, const uint8_t want, uint8_t *count);
+
+/**
+ * @brief   Look for a run of free allocation units at the next few boundaries
+ *          of the card's allocation units
+ *
+ * @param   count   Length of the run
+ * @param   *first  Set to the first allocation unit of the run
+ *
+ * @return  Returns 0 upon success, SD_INSUFFICIENT_SPACE if none of the
+ *          SD_AU_SEARCH_MAX boundaries checked starts a free run, error code
+ *          otherwise
+ */
+uint8_t SDFindAlignedRun (const uint32_t count, uint32_t *first);
 #endif
 
 /**
- * @brief   Find and return the starting sector's address for a directory path
- *          given in a c-string. Use Unix-style path names (like /foo/bar/)
- *          !!!NOTE!!! Not yet implemented!
+ * @brief   Write a value into an entry of the FAT, loading its sector first
  *
- * @param   *path   C-string representing Unix-style path
+ * @param   fatEntry    Entry (allocation unit) to be modified
+ * @param   value       Next allocation unit, 0 (free) or SD_EOC_END
  *
- * @return  Returns sector address of desired path
+ * @return  Returns 0 upon success, error code otherwise
  */
-// TODO: Implement this (more than simply returning root directory)
-// TODO: Allow for paths outside the current directory
-uint32_t SDGetSectorFromPath (const char *path);
+uint8_t SDSetFATValue (const uint32_t fatEntry, const uint32_t value);
 
 /**
- * @brief   Find and return the starting sector's address for a given allocation
- *          unit (note - not cluster)
+ * @brief   Search the FAT for a run of consecutive free allocation units
  *
- * @param   allocUnit   Allocation unit in FAT filesystem
+ * @param   start   Allocation unit at which to start searching; the search
+ *                  wraps around to the start of the FAT
+ * @param   count   Length of the run
+ * @param   *first  Set to the first allocation unit of the run
  *
- * @return  Returns sector address of         desired allocation unit
+ * @return  Returns 0 upon success, SD_INSUFFICIENT_SPACE if no run is long
+ *          enough, error code otherwise
  */
-uint32_t SDGetSectorFromAlloc (uint32_t allocUnit);
+uint8_t SDFindFreeRun (const uint32_t start, const uint32_t count,
+        uint32_t *first);
 
 /**
- * @brief   Read an entry from the FAT
+ * @brief   Shorten a file's cluster chain and free the clusters removed
  *
- * @param   fatEntry    Entry number (allocation unit) to read in the FAT
- * @param   *value      Address to store the value into (the next allocation
- *                      unit)
+ * @param   *f          Address of the file
+ * @param   clusters    Number of clusters to keep (at least 1)
  *
  * @return  Returns 0 upon success, error code otherwise
  */
-uint8_t SDGetFATValue (const uint32_t fatEntry, uint32_t *value);
+uint8_t SDReleaseClusters (sd_file *f, const uint32_t clusters);
 
 /**
- * @brief   Find the next sector in the FAT, directory, or file. When it is
- *          found, load it into the appropriate global buffer
+ * @brief   Free every allocation unit of a cluster chain
  *
- * @param   *buf    Array of SD_SECTOR_SIZE bytes that can be filled with the
- *                  requested sector
+ * @detailed    Entries are cleared in the loaded FAT sector, which is only
+ *              written once the chain moves on to another one, so a chain laid
+ *              out in order costs one write per FAT sector
+ *
+ * @param   allocUnit   First allocation unit to be freed
  *
  * @return  Returns 0 upon success, error code otherwise
  */
-uint8_t SDLoadNextSector (sd_buffer *buf);
+uint8_t SDFreeChain (uint32_t allocUnit);
 
+#ifdef SD_ERASE_FREED
 /**
- * @brief   Load a requested sector into the buffer independent of the current
- *          sector or cluster
+ * @brief   Erase the sectors of consecutive allocation units on the card
  *
- * @Pre:    *buf must point to a file entry (g_sd_file_
+ * @detailed    The card finishes erasing in the background; the next access
+ *              waits for it
  *
- * @param   *buf    Address of the sd_buffer object to be updated
- * @param   offset  How many sectors past the first one should be skipped
- *                  (sector number of the file)
+ * @param   first   First allocation unit to be erased
+ * @param   count   Number of allocation units
  *
  * @return  Returns 0 upon success, error code otherwise
- *
  */
-uint8_t SDLoadSectorFromOffset (sd_file *f, const uint32_t offset);
+uint8_t SDEraseClusters (const uint32_t first, const uint32_t count);
+#endif
 
+#ifdef SD_RAW_BLOCKS
 /**
- * @brief       Read the next sector from SD card into memory
- * @detailed    When the final sector of a cluster is finished, SDIncCluster can
- *              be called. The appropriate global variables will be set
- *              according (incremented or set by the FAT) and the first sector
- *              of the next cluster will be read into the desired buffer.
+ * @brief   Check that a range of sectors overlaps neither the MBR, the mounted
+ *          volume nor any FAT partition
  *
- * @param       *buf    Array of SD_SECTOR_SIZE bytes used to hold a sector from
- *                      the SD card
+ * @param   first   Address of the first sector
+ * @param   count   Number of sectors
  *
- * @return      Returns 0 upon success, error code otherwise
+ * @return  Returns 0 if the range may be used, SD_RAW_PROTECTED if not, error
+ *          code otherwise
  */
-uint8_t SDIncCluster (sd_buffer *buf);
+uint8_t SDRawCheckRange (const uint32_t first, const uint32_t count);
 
 /**
- * @brief   Read the standard length name of a file entry. If an extension
- *          exists, a period will be inserted before the extension. A
- *          null-terminator is always appended to the end
+ * @brief   Check that a range of sectors overlaps neither the MBR nor the
+ *          mounted volume
  *
- * @Pre:    *buf must point to the first byte in a FAT entry - no error checking
- *          is executed on buf
- * @Pre:    Errors may occur if at least 13 (8 + 1 + 3 + 1) bytes of memory are
- *          not allocated for filename
+ * @detailed    Cheap enough for every raw write and erase, which may be given
+ *              a region that was not filled in by SDRawRegion()
  *
- * @param   *buf        First byte in local memory containing a FAT entry
- * @param   *filename   Address in memory where the filename string will be
- *                      stored
+ * @param   first   Address of the first sector
+ * @param   count   Number of sectors
+ *
+ * @return  Returns 0 if the range may be used, SD_RAW_PROTECTED or
+ *          SD_RAW_OUT_OF_RANGE if not
  */
-void SDGetFilename (const uint8_t *buf, char *filename);
+uint8_t SDRawCheckVolume (const uint32_t first, const uint32_t count);
 
 /**
- * @brief       Find a file entry (file or sub-directory)
+ * @brief   Read sector 0 of the card into the FAT buffer, saving the loaded FAT
+ *          sector first if it was modified
  *
- * @detailed    Find a file or directory that matches the name in *filename in
- *              the current directory; its relative location is communicated by
- *              placing it in the address of *fileEntryOffset
+ * @post    SDRawRestoreFAT() must be called before the FAT is used again
  *
- * @param       *filename           C-string representing the short (standard)
- *                                  filename
- * @param       *fileEntryOffset    The buffer offset will be returned via this
- *                                  address if the file is found
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDRawReadMBR (void);
+
+/**
+ * @brief   Reload the FAT sector that SDRawReadMBR() displaced
  *
- * @return      Returns 0 upon success, error code otherwise (common error code
- *              is SD_EOC_END for end-of-chain or file-not-found marker)
+ * @return  Returns 0 upon success, error code otherwise
  */
-uint8_t SDFind (const char *filename, uint16_t *fileEntryOffset);
+uint8_t SDRawRestoreFAT (void);
 
 /**
- * @brief    Reload the sector currently in use by a given file
+ * @brief   Determine whether an MBR partition type holds a FAT file system
  *
- * @param    *f        Address of the file object requested
+ * @param   type    Partition type from the partition table
  *
- * @return        Returns 0 upon success, error code otherwise
+ * @return  Returns 1 for FAT12, FAT16 and FAT32 partitions, 0 otherwise
  */
-uint8_t SDReloadBuf (sd_file *f);
+uint8_t SDIsFATPartition (const uint8_t type);
 
-#ifdef SD_FILE_WRITE
+#ifdef SD_RING_LOG
 /**
- * @brief       Find the first empty allocation unit in the FAT
- *
- * @detailed    The value of the first empty allocation unit is returned and its
- *              location will contain the end-of-chain marker, SD_EOC_END.
- *              NOTE: It is important to realize that, though the new entry now
- *              contains an EOC marker, this function does not know what cluster
- *              is being extended and therefore the calling function must
- *              modify the previous EOC to contain the return value
+ * @brief   Read a slot of a ring log into its buffer
  *
- * @param       restore     If non-zero, the original fat-sector will be
- *                          restored to g_sd_fat before returning; if zero, the
- *                          last-used sector will remain loaded
+ * @param   *log        Address of the log object
+ * @param   slot        Sector of the region to be read
+ * @param   *sequence   Returns the number of the record held by the slot, or
+ *                      SD_RING_NO_RECORD if it holds none
  *
- * @return      Returns the number of the first unused allocation unit
+ * @return  Returns 0 upon success, error code otherwise
  */
-uint32_t SDFindEmptySpace (const uint8_t restore);
+uint8_t SDRingReadSlot (sd_ring_log *log, const uint32_t slot,
+        uint32_t *sequence);
+#endif
+#endif
 
-/* @brief   Enlarge a file or directory by one cluster
+/**
+ * @brief   Delete the entry of a file in the current directory and free its
+ *          clusters
  *
- * @param   *buf    Address of the buffer (containing information for a file or
- *                  directory) to be enlarged
+ * @param   *name   Short filename of the file
  *
  * @return  Returns 0 upon success, error code otherwise
  */
-uint8_t SDExtendFAT (sd_buffer *buf);
+uint8_t SDRemoveEntry (const char *name);
 
 /**
  * @brief   Allocate space for a new file
@@ -838,6 +3161,37 @@ uint8_t SDExtendFAT (sd_buffer *buf);
 uint8_t SDCreateFile (const char *name, const uint16_t *fileEntryOffset);
 #endif
 
+#ifdef SD_SERVER
+/**
+ * @brief   Body of the server cog: start and mount the SD card, then carry
+ *          out queued requests until one of them unmounts it
+ *
+ * @param   *par    An sd_server_start
+ */
+void SDServer (void *par);
+#endif
+
+#ifdef SD_ASYNC
+/**
+ * @brief   Carry out a request on behalf of another cog
+ *
+ * @param   *req    Request taken from the queue
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDServeRequest (sd_request *req);
+
+/**
+ * @brief   Queue a request for the server cog, or carry it out right away if
+ *          there is no server cog
+ *
+ * @param   *req    Request with type and the parameters of that type set
+ *
+ * @return  Returns 0 upon success, error code otherwise
+ */
+uint8_t SDSubmitOrServe (sd_request *req);
+#endif
+
 #if (defined SD_SHELL || defined SD_VERBOSE)
 // TODO: Document this
 inline void SDPrintFileEntry (const uint8_t *file, char filename[]);
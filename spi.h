@@ -62,13 +62,19 @@
  *                              DEFAULT: ON
  *                              TODO: Use the counter module instead of
  *                              "xor clkPin, clkPin"
- * @param   SPI_FAST_SECTOR     TODO: Figure out why this doesn't work... :(
- *                              DEFAULT: OFF
+ * @param   SPI_FAST_SECTOR     Allows an entire SD card sector to be read by the
+ *                              SPI cog in a single call, optionally while the
+ *                              calling cog carries on; Requires SPI_FAST
+ *                              DEFAULT: ON
  */
 //#define SPI_DEBUG
 #define SPI_DEBUG_PARAMS
 #define SPI_FAST
-//#define SPI_FAST_SECTOR
+#define SPI_FAST_SECTOR
+
+#ifndef SPI_FAST
+#undef SPI_FAST_SECTOR
+#endif
 
 /**
  * @brief   Descriptor for SPI signal as defined by Motorola modes